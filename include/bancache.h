@@ -21,11 +21,10 @@
 #pragma once
 
 /** Stores a cached ban entry.
- * Each ban has one of these hashed in a hash_map to make for faster removal
- * of already-banned users in the case that they try to reconnect. As no wildcard
- * matching is done on these IPs, the speed of the system is improved. These cache
- * entries expire every few hours, which is a reasonable expiry for any reasonable
- * sized network.
+ * Entries are kept in a binary trie keyed on the IP address of the user, so the
+ * addresses of reconnecting users are checked without any wildcard matching. These
+ * cache entries expire every few hours, which is a reasonable expiry for any
+ * reasonable sized network.
  */
 class CoreExport BanCacheHit
 {
@@ -40,6 +39,10 @@ class CoreExport BanCacheHit
 	 */
 	time_t Expiry;
 
+	BanCacheHit() : Expiry(0)
+	{
+	}
+
 	BanCacheHit(const std::string &type, const std::string &reason, time_t seconds)
 		: Type(type), Reason(reason), Expiry(ServerInstance->Time() + seconds)
 	{
@@ -48,17 +51,95 @@ class CoreExport BanCacheHit
 	bool IsPositive() const { return (!Reason.empty()); }
 };
 
-/* A container of ban cache items.
- * must be defined after class BanCacheHit.
- */
-typedef TR1NS::unordered_map<std::string, BanCacheHit*, TR1NS::hash<std::string> > BanCacheHash;
-
 /** A manager for ban cache, which allocates and deallocates and checks cached bans.
+ *
+ * Positive hits are cached for single addresses. A negative hit means that no Z-line
+ * matched the address, and is cached for the whole range configured in the <cidr> tag
+ * when no Z-line could match an address in that range. A lookup returns the entry of
+ * the longest cached prefix of the address.
  */
 class CoreExport BanCacheManager
 {
-	BanCacheHash* BanHash;
-	bool RemoveIfExpired(BanCacheHash::iterator& it);
+	/** A node of the trie, a prefix of the addresses below it
+	 */
+	struct Node
+	{
+		/** The prefix, node 0 has none
+		 */
+		irc::sockets::cidr_mask prefix;
+
+		/** The nodes below this one, by the bit after the prefix, or 0
+		 */
+		unsigned int child[2];
+
+		/** True if hit holds an entry for the prefix
+		 */
+		bool used;
+
+		BanCacheHit hit;
+
+		Node() : used(false)
+		{
+			prefix.type = prefix.length = 0;
+			memset(prefix.bits, 0, sizeof(prefix.bits));
+			child[0] = child[1] = 0;
+		}
+	};
+
+	/** Decides which entries RemoveEntries() removes, expired entries are always removed
+	 */
+	struct Filter
+	{
+		const std::string* type;
+		bool positive;
+
+		bool Matches(const BanCacheHit& hit) const;
+	};
+
+	/** The nodes of both tries, node 0 is unused so 0 can mean no node.
+	 * Single bit branches are compressed, a node exists only if it holds an
+	 * entry or has two children.
+	 */
+	std::vector<Node> nodes;
+
+	/** Unused positions in nodes
+	 */
+	std::vector<unsigned int> freenodes;
+
+	/** The top nodes of the IPv4 and IPv6 tries, or 0
+	 */
+	unsigned int root4;
+	unsigned int root6;
+
+	unsigned int& Root(unsigned char type) { return (type == AF_INET ? root4 : root6); }
+
+	/** Get the link to a node, which is either a root or a child of another node
+	 */
+	unsigned int& Link(unsigned char type, unsigned int parent, unsigned int bit)
+	{
+		return (parent ? nodes[parent].child[bit] : Root(type));
+	}
+
+	unsigned int NewNode(const irc::sockets::cidr_mask& prefix);
+	void FreeNode(unsigned int node);
+
+	/** Find or create the node of a prefix
+	 * @return The position of the node, which is invalidated by the next change to the trie
+	 */
+	unsigned int Insert(const irc::sockets::cidr_mask& prefix);
+
+	/** Remove the node a link points to if it has no entry and less than two children
+	 */
+	void Compact(unsigned int& link);
+
+	/** Remove the entries chosen by a filter from a subtree
+	 */
+	void Prune(unsigned int& link, const Filter& filter);
+
+	/** Remove the entries chosen by a filter that cover an address in a range,
+	 * which are the entries on the path to the range and those in the range
+	 */
+	void PruneRange(unsigned int& link, const irc::sockets::cidr_mask& range, const Filter& filter);
 
  public:
 
@@ -67,19 +148,27 @@ class CoreExport BanCacheManager
 	 * @param type The type of ban cache item. std::string. .empty() means it's a negative match (user is allowed freely).
 	 * @param reason The reason for the ban. Left .empty() if it's a negative match.
 	 * @param seconds Number of seconds before nuking the bancache entry, the default is a day. This might seem long, but entries will be removed as glines/etc expire.
+	 * @return The new entry, valid until the cache is next changed, or NULL if the IP is invalid or already has an entry.
 	 */
+	BanCacheHit *AddHit(const irc::sockets::sockaddrs& ip, const std::string &type, const std::string &reason, time_t seconds = 0);
 	BanCacheHit *AddHit(const std::string &ip, const std::string &type, const std::string &reason, time_t seconds = 0);
+
+	/** Look up an IP
+	 * @param ip The IP to look up.
+	 * @return The entry of the longest cached prefix of the IP, valid until the cache is next changed, or NULL.
+	 */
+	BanCacheHit *GetHit(const irc::sockets::sockaddrs& ip);
 	BanCacheHit *GetHit(const std::string &ip);
 
-	/** Removes all entries of a given type, either positive or negative. Returns the number of hits removed.
-	 * @param type The type of bancache entries to remove (e.g. 'G')
+	/** Removes all entries of a given type, either positive or negative.
+	 * @param type The type of bancache entries to remove (e.g. 'G'), negative entries are removed regardless of type.
 	 * @param positive Remove either positive (true) or negative (false) hits.
+	 * @param range If not NULL, only remove the entries which apply to addresses in this range.
 	 */
-	void RemoveEntries(const std::string& type, bool positive);
+	void RemoveEntries(const std::string& type, bool positive, const irc::sockets::cidr_mask* range = NULL);
 
 	BanCacheManager()
+		: nodes(1), root4(0), root6(0)
 	{
-		this->BanHash = new BanCacheHash();
 	}
-	~BanCacheManager();
 };
@@ -0,0 +1,93 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/** Indexes of all channels by their user count and creation time, so that
+ * LIST filters such as ">100" and "C<60" only look at the channels which can pass them.
+ * Channels are added when created and removed when culled; a channel which is
+ * being destroyed may still be found until then, so callers check the result
+ * against the channel list if that matters.
+ */
+class CoreExport ChannelIndex
+{
+ public:
+	/** A list of the channels in a size bucket
+	 */
+	typedef intrusive_list<Channel, ChannelIndex> SizeBucket;
+
+ private:
+	/** Number of size buckets, one for empty channels and one for every bit of a user count
+	 */
+	static const unsigned int SIZE_BUCKETS = sizeof(size_t) * 8 + 1;
+
+	/** Channels bucketed by the number of bits in their user count: bucket 0 holds
+	 * the empty channels and bucket n the channels with 2^(n-1) to 2^n - 1 users.
+	 * A channel only moves to another bucket when its size crosses a power of two.
+	 */
+	SizeBucket sizebuckets[SIZE_BUCKETS];
+
+	typedef std::multimap<time_t, Channel*> AgeMap;
+
+	/** Channels by creation time
+	 */
+	AgeMap byage;
+
+	/** Get the size bucket for a user count
+	 * @param users The user count
+	 * @return The index of the bucket
+	 */
+	static unsigned int GetSizeBucket(size_t users);
+
+ public:
+	/** Add a new channel to the indexes
+	 * @param chan The channel to add
+	 */
+	void Add(Channel* chan);
+
+	/** Remove a channel from the indexes
+	 * @param chan The channel to remove
+	 */
+	void Remove(Channel* chan);
+
+	/** Move a channel to the right size bucket after a user joined or left it
+	 * @param chan The channel
+	 * @param oldsize The user count of the channel before the change
+	 */
+	void ChangeSize(Channel* chan, size_t oldsize);
+
+	/** Change the creation time of a channel, such as when a remote server lowers it
+	 * @param chan The channel
+	 * @param age The new creation time
+	 */
+	void ChangeAge(Channel* chan, time_t age);
+
+	/** Add the channels which may have a user count within the given bounds to a list.
+	 * The list can contain channels outside of the bounds, callers check the count of each.
+	 * @param minusers The least number of users
+	 * @param maxusers The most number of users
+	 * @param out The list to add the channels to
+	 */
+	void FindBySize(size_t minusers, size_t maxusers, std::vector<Channel*>& out) const;
+
+	/** Add the channels which were created within the given time range to a list
+	 * @param from The earliest creation time
+	 * @param to The latest creation time
+	 * @param out The list to add the channels to
+	 */
+	void FindByAge(time_t from, time_t to, std::vector<Channel*>& out) const;
+};
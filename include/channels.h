@@ -33,8 +33,14 @@
  * This class represents a channel, and contains its name, modes, topic, topic set time,
  * etc, and an instance of the BanList type.
  */
-class CoreExport Channel : public Extensible, public InviteBase<Channel>
+class CoreExport Channel : public Extensible, public InviteBase<Channel>, public intrusive_list_node<Channel, ChannelIndex>
 {
+ public:
+	/** Memberships of local users keyed by prefix rank, highest rank first
+	 */
+	typedef std::map<unsigned int, std::vector<Membership*>, std::greater<unsigned int> > LocalMemberBuckets;
+
+ private:
 	/** Set default modes for the channel on creation
 	 */
 	void SetDefaultModes();
@@ -61,6 +67,45 @@ class CoreExport Channel : public Extensible, public InviteBase<Channel>
 	 */
 	void DelUser(const UserMembIter& membiter);
 
+	/** Memberships of local users, bucketed by their prefix rank.
+	 * The buckets are ordered by rank, highest first, so messages sent to users
+	 * with a given status only visit the buckets of that rank or higher.
+	 */
+	LocalMemberBuckets localmembers;
+
+	/** Incremented every time a local user joins or leaves the channel
+	 */
+	unsigned long localmemberversion;
+
+	/** Incremented every time a list mode changes on the channel, see Membership::BanCache
+	 */
+	unsigned long banversion;
+
+	/** Add a membership of a local user to the bucket of the given rank
+	 * @param memb The membership to add
+	 * @param rank Prefix rank of the membership
+	 */
+	void AddLocalMember(Membership* memb, unsigned int rank);
+
+	/** Remove a membership of a local user from its bucket
+	 * @param memb The membership to remove
+	 */
+	void DelLocalMember(Membership* memb);
+
+	/** Move a membership of a local user to the right bucket after its prefix modes changed
+	 * @param memb The membership whose rank may have changed
+	 */
+	void UpdateLocalMember(Membership* memb);
+
+	/** Send a message to local members whose rank is at least the given rank
+	 * @param minrank The minimum rank, 0 to send to all local members
+	 * @param except_list Users who should not receive the message
+	 * @param message The message to send
+	 */
+	void WriteLocalMembers(unsigned int minrank, const CUList& except_list, const reference<SharedMessage>& message);
+
+	friend class Membership;
+
  public:
 	/** Creates a channel record and initialises it with default values
 	 * @param name The name of the channel
@@ -80,12 +125,17 @@ class CoreExport Channel : public Extensible, public InviteBase<Channel>
 	 */
 	void CheckDestroy();
 
+	/** Removes the channel from the channel indexes before it is destroyed
+	 */
+	CullResult cull();
+
 	/** The channel's name.
 	 */
 	std::string name;
 
 	/** Time that the object was instantiated (used for TS calculation etc)
-	*/
+	 * Change it with ChannelIndex::ChangeAge() to keep the channel indexes up to date.
+	 */
 	time_t age;
 
 	/** User list.
@@ -180,6 +230,27 @@ class CoreExport Channel : public Extensible, public InviteBase<Channel>
 	 */
 	const UserMembList* GetUsers() const { return &userlist; }
 
+	/** Get the memberships of local users on this channel, bucketed by prefix rank.
+	 * This is cheaper to walk than GetUsers() when only local users are of interest.
+	 * @return The buckets, ordered by rank, highest first
+	 */
+	const LocalMemberBuckets& GetLocalMembers() const { return localmembers; }
+
+	/** Get a counter that changes every time a local user joins or leaves the channel
+	 * @return The current value of the counter
+	 */
+	unsigned long GetLocalMemberVersion() const { return localmemberversion; }
+
+	/** Invalidates the ban verdicts cached in the memberships of the channel.
+	 * Called when a list mode changes, call it when anything else changes which bans on the channel depend on.
+	 */
+	void InvalidateBanCache() { banversion++; }
+
+	/** Get the counter which is incremented by InvalidateBanCache()
+	 * @return The current value of the counter
+	 */
+	unsigned long GetBanVersion() const { return banversion; }
+
 	/** Returns true if the user given is on the given channel.
 	 * @param user The user to look for
 	 * @return True if the user is on this channel
@@ -338,17 +409,28 @@ class CoreExport Channel : public Extensible, public InviteBase<Channel>
 	 */
 	unsigned int GetPrefixValue(User* user);
 
-	/** Check if a user is banned on this channel
+	/** Check if a user is banned on this channel.
+	 * The verdict is cached in the membership of the user if they are on the channel.
 	 * @param user A user to check against the banlist
 	 * @returns True if the user given is banned
 	 */
 	bool IsBanned(User* user);
 
-	/** Check a single ban for match
+	/** Check a single ban for match, without compiling it.
+	 * Use the overload taking a BanMask for bans which are checked repeatedly.
 	 */
 	bool CheckBan(User* user, const std::string& banmask);
 
-	/** Get the status of an "action" type extban
+	/** Check a single ban for match using its compiled form
+	 * @param user The user to check
+	 * @param banmask The ban, passed to modules
+	 * @param compiled The ban compiled with BanMask, such as ListModeBase::ListItem::banmask
+	 * @return True if the ban matches the user
+	 */
+	bool CheckBan(User* user, const std::string& banmask, const BanMask& compiled);
+
+	/** Get the status of an "action" type extban.
+	 * The verdict is cached in the membership of the user if they are on the channel.
 	 */
 	ModResult GetExtBanStatus(User *u, char type);
 };
@@ -30,12 +30,39 @@
 class CoreExport CommandParser
 {
  private:
+	/** Memory reused by ProcessCommand() for every line it processes
+	 */
+	struct LineBuffers
+	{
+		irc::linetokenizer tokenizer;
+		std::string command;
+		std::vector<std::string> params;
+	};
+
+	/** One set of buffers for every level of nesting, as command handlers and
+	 * modules may process lines themselves. A deque so that adding a level does
+	 * not move the buffers that are in use by the levels below.
+	 */
+	std::deque<LineBuffers> buffers;
+
+	/** Number of ProcessCommand() calls currently running
+	 */
+	unsigned int depth;
+
 	/** Process a command from a user.
 	 * @param user The user to parse the command for
 	 * @param cmd The command string to process
 	 */
 	void ProcessCommand(LocalUser* user, std::string& cmd);
 
+	/** Process a command from a user after it has been split into the command name and its parameters.
+	 * @param user The user to parse the command for
+	 * @param cmd The command string to process
+	 * @param command The command name in uppercase
+	 * @param command_p The parameters of the command
+	 */
+	void ProcessCommand(LocalUser* user, std::string& cmd, std::string& command, std::vector<std::string>& command_p);
+
  public:
 	/** Command list, a hash_map of command names to Command*
 	 */
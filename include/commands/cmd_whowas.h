@@ -23,20 +23,61 @@
 
 #include "modules.h"
 
-/* Forward ref for typedefs */
-class WhoWasGroup;
+namespace WhoWas
+{
+	/** Index of a slot in the record ring
+	 */
+	typedef unsigned int SlotIndex;
 
-/** A group of users related by nickname
- */
-typedef std::deque<WhoWasGroup*> whowas_set;
+	/** A SlotIndex which does not refer to any slot
+	 */
+	static const SlotIndex NO_SLOT = UINT_MAX;
 
-/** Sets of users in the whowas system
- */
-typedef std::map<irc::string,whowas_set*> whowas_users;
+	/** The records of one nickname, linked from the oldest to the newest
+	 */
+	struct Group
+	{
+		/** Slot of the oldest record */
+		SlotIndex oldest;
 
-/** Sets of time and users in whowas list
- */
-typedef std::deque<std::pair<time_t,irc::string> > whowas_users_fifo;
+		/** Slot of the newest record */
+		SlotIndex newest;
+
+		/** Number of records */
+		unsigned int count;
+
+		Group() : oldest(NO_SLOT), newest(NO_SLOT), count(0) { }
+	};
+
+	/** Nicknames tracked by WHOWAS, mapped to their records
+	 */
+	typedef TR1NS::unordered_map<std::string, Group, irc::insensitive, irc::StrHashComp> GroupMap;
+
+	/** A WHOWAS record, stored in a slot of the record ring.
+	 * The server name is interned and the other strings share one allocation.
+	 */
+	struct Entry
+	{
+		/** The nickname and group of this record, NULL if the slot is unused */
+		GroupMap::value_type* group;
+
+		/** Slots of the next older and newer records of the same nickname */
+		SlotIndex older;
+		SlotIndex newer;
+
+		/** Interned name of the server the user was on */
+		const std::string* server;
+
+		/** Signon time */
+		time_t signon;
+
+		/** Time the record was added */
+		time_t added;
+
+		/** The ident, real host, displayed host and gecos, each terminated by a NUL byte */
+		char* strings;
+	};
+}
 
 /** Handle /WHOWAS. These command handlers can be reloaded by the core,
  * and handle basic RFC1459 commands. Commands within modules work
@@ -46,13 +87,57 @@ typedef std::deque<std::pair<time_t,irc::string> > whowas_users_fifo;
 class CommandWhowas : public Command
 {
   private:
-	/** Primary container, links nicknames tracked by WHOWAS to a list of records
+	/** Records in the order they were added. Up to MaxGroups * GroupSize slots are
+	 * allocated as needed, after that the slot of the oldest record is reused.
+	 * Records removed from the middle leave an unused slot behind.
+	 */
+	std::vector<WhoWas::Entry> ring;
+
+	/** Number of slots in the ring once it is fully allocated
+	 */
+	WhoWas::SlotIndex capacity;
+
+	/** Slot of the oldest record, which may be unused
+	 */
+	WhoWas::SlotIndex first;
+
+	/** Number of slots from first to the newest record, used or not
+	 */
+	WhoWas::SlotIndex used;
+
+	/** Number of slots in use
+	 */
+	unsigned int entries;
+
+	/** Nicknames and the slots of their records
+	 */
+	WhoWas::GroupMap whowas;
+
+	/** Interned server names with the number of records which refer to them
+	 */
+	TR1NS::unordered_map<std::string, unsigned int> servernames;
+
+	/** Bytes allocated for the strings of all records
+	 */
+	size_t stringbytes;
+
+	/** Free the strings of a record and release its server name
+	 */
+	void FreeRecord(WhoWas::Entry& entry);
+
+	/** Remove the record in a slot, the slot becomes unused
+	 */
+	void FreeSlot(WhoWas::SlotIndex slot);
+
+	/** Remove the oldest slot from the ring
 	 */
-	whowas_users whowas;
+	void PopFront();
 
-	/** List of nicknames in the order they were inserted into the map
+	/** Store a record, removing older records as needed to stay within the limits
+	 * @param nick The nickname of the record
+	 * @param record The record, the ring takes over its strings and server name
 	 */
-	whowas_users_fifo whowas_fifo;
+	void Insert(const std::string& nick, const WhoWas::Entry& record);
 
   public:
 	/** Max number of WhoWas entries per user.
@@ -82,32 +167,3 @@ class CommandWhowas : public Command
 	void Maintain();
 	~CommandWhowas();
 };
-
-/** Used to hold WHOWAS information
- */
-class WhoWasGroup
-{
- public:
-	/** Real host
-	 */
-	std::string host;
-	/** Displayed host
-	 */
-	std::string dhost;
-	/** Ident
-	 */
-	std::string ident;
-	/** Server name
-	 */
-	std::string server;
-	/** Fullname (GECOS)
-	 */
-	std::string gecos;
-	/** Signon time
-	 */
-	time_t signon;
-
-	/** Initialize this WhoWasFroup with a user
-	 */
-	WhoWasGroup(User* user);
-};
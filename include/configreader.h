@@ -282,6 +282,16 @@ class CoreExport ServerConfig
 	 */
 	int c_ipv6_range;
 
+	/** Ban cache CIDR range for negative entries of ipv4 addresses (0-32)
+	 * Defaults to 32 (caches every IP seperately)
+	 */
+	int c_ipv4_bancache;
+
+	/** Ban cache CIDR range for negative entries of ipv6 addresses (0-128)
+	 * Defaults to 64
+	 */
+	int c_ipv6_bancache;
+
 	/** Holds the server name of the local server
 	 * as defined by the administrator.
 	 */
@@ -551,6 +561,14 @@ class CoreExport ServerConfig
 	/** If this value is true, snotices will not stack when repeats are sent
 	 */
 	bool NoSnoticeStack;
+
+	/** If true, the calls of each event in each module are counted and timed, see STATS h
+	 */
+	bool HookProfiling;
+
+	/** If true, users cache the list of local users they share a channel with
+	 */
+	bool NeighborCache;
 };
 
 /** The background thread for config reading, so that reading from executable includes
@@ -0,0 +1,200 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/** A map from pointers to pointers that keeps its elements in one contiguous array.
+ * Lookups go through an open addressing index with linear probing, which is only built
+ * once the map holds more than a handful of elements; small maps are searched linearly.
+ *
+ * Elements are in no particular order. Erasing an element moves the last element into
+ * its place, so erase() invalidates the erased iterator and iterators to the last element,
+ * and insert() may invalidate all iterators.
+ */
+template <typename K, typename V>
+class dense_ptr_map
+{
+ public:
+	typedef std::pair<K*, V*> value_type;
+	typedef typename std::vector<value_type>::iterator iterator;
+	typedef typename std::vector<value_type>::const_iterator const_iterator;
+	typedef typename std::vector<value_type>::size_type size_type;
+
+ private:
+	/** Maps with at most this many elements have no index
+	 */
+	static const size_type LINEAR_MAX = 8;
+
+	/** Empty slot marker in the index
+	 */
+	static const size_type EMPTY = static_cast<size_type>(-1);
+
+	/** The elements
+	 */
+	std::vector<value_type> items;
+
+	/** Open addressing index, each slot holds a position in items or EMPTY.
+	 * Its size is zero or a power of two, kept at least twice the number of elements.
+	 */
+	std::vector<size_type> index;
+
+	size_type Mask() const { return index.size() - 1; }
+
+	static size_type Hash(const K* key)
+	{
+		// Objects are at least 8 byte aligned, drop the bits that are always zero
+		std::size_t val = reinterpret_cast<std::size_t>(key) >> 3;
+		val ^= (val >> 16);
+		return static_cast<size_type>(val * 0x9E3779B1UL);
+	}
+
+	/** Find the index slot of a key
+	 * @return The slot holding the key, or the empty slot where it would go
+	 */
+	size_type FindSlot(const K* key) const
+	{
+		size_type slot = Hash(key) & Mask();
+		while ((index[slot] != EMPTY) && (items[index[slot]].first != key))
+			slot = (slot + 1) & Mask();
+		return slot;
+	}
+
+	void Rebuild(size_type slots)
+	{
+		index.assign(slots, EMPTY);
+		for (size_type i = 0; i < items.size(); i++)
+			index[FindSlot(items[i].first)] = i;
+	}
+
+	/** Remove the key in the given slot from the index, shifting back entries that
+	 * probed past it so that no tombstones are needed
+	 */
+	void RemoveSlot(size_type hole)
+	{
+		size_type slot = hole;
+		while (true)
+		{
+			slot = (slot + 1) & Mask();
+			if (index[slot] == EMPTY)
+				break;
+
+			// Move the entry into the hole unless its home slot lies cyclically in (hole, slot]
+			size_type home = Hash(items[index[slot]].first) & Mask();
+			if ((hole <= slot) ? ((hole < home) && (home <= slot)) : ((hole < home) || (home <= slot)))
+				continue;
+
+			index[hole] = index[slot];
+			hole = slot;
+		}
+		index[hole] = EMPTY;
+	}
+
+ public:
+	iterator begin() { return items.begin(); }
+	iterator end() { return items.end(); }
+	const_iterator begin() const { return items.begin(); }
+	const_iterator end() const { return items.end(); }
+	size_type size() const { return items.size(); }
+	bool empty() const { return items.empty(); }
+
+	iterator find(const K* key)
+	{
+		if (index.empty())
+		{
+			for (iterator i = items.begin(); i != items.end(); ++i)
+				if (i->first == key)
+					return i;
+			return items.end();
+		}
+
+		size_type pos = index[FindSlot(key)];
+		return ((pos == EMPTY) ? items.end() : items.begin() + pos);
+	}
+
+	const_iterator find(const K* key) const
+	{
+		return const_cast<dense_ptr_map*>(this)->find(key);
+	}
+
+	/** Insert a key unless it is already in the map
+	 * @param key The key to insert
+	 * @param value The value to map the key to
+	 * @return An iterator to the element with the key and true if it was inserted,
+	 * or false if the key was already in the map
+	 */
+	std::pair<iterator, bool> insert(K* key, V* value)
+	{
+		iterator it = find(key);
+		if (it != items.end())
+			return std::make_pair(it, false);
+
+		items.push_back(std::make_pair(key, value));
+		if (items.size() * 2 > index.size())
+		{
+			if (items.size() > LINEAR_MAX)
+				Rebuild(index.empty() ? LINEAR_MAX * 4 : index.size() * 2);
+		}
+		else
+		{
+			index[FindSlot(key)] = items.size() - 1;
+		}
+		return std::make_pair(items.end() - 1, true);
+	}
+
+	/** Erase an element by moving the last element into its place
+	 * @param it The element to erase, must be valid
+	 * @return An iterator to the element that took the place of the erased one,
+	 * which is end() if the last element was erased
+	 */
+	iterator erase(iterator it)
+	{
+		const size_type pos = it - items.begin();
+		const size_type last = items.size() - 1;
+		if (!index.empty())
+		{
+			RemoveSlot(FindSlot(it->first));
+			if (pos != last)
+				index[FindSlot(items[last].first)] = pos;
+		}
+
+		if (pos != last)
+			*it = items[last];
+		items.pop_back();
+
+		// Drop the index once the map is small enough to be searched linearly
+		if ((!index.empty()) && (items.size() <= LINEAR_MAX / 2))
+			std::vector<size_type>().swap(index);
+
+		return items.begin() + pos;
+	}
+
+	void clear()
+	{
+		items.clear();
+		std::vector<size_type>().swap(index);
+	}
+};
+
+template <typename K, typename V>
+const typename dense_ptr_map<K, V>::size_type dense_ptr_map<K, V>::LINEAR_MAX;
+
+template <typename K, typename V>
+const typename dense_ptr_map<K, V>::size_type dense_ptr_map<K, V>::EMPTY;
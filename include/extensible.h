@@ -38,6 +38,11 @@ enum SerializeFormat
 class CoreExport ExtensionItem : public ServiceProvider, public usecountbase
 {
  public:
+	/** Index of the value of this item in the extension slots of an Extensible.
+	 * No two existing items share a slot, the slot of a destroyed item is reused.
+	 */
+	const size_t slot;
+
 	ExtensionItem(const std::string& key, Module* owner);
 	virtual ~ExtensionItem();
 	/** Serialize this item into a string
@@ -57,17 +62,17 @@ class CoreExport ExtensionItem : public ServiceProvider, public usecountbase
 	virtual void free(void* item) = 0;
 
  protected:
-	/** Get the item from the internal map */
+	/** Get the item from the slot of the container */
 	void* get_raw(const Extensible* container) const;
-	/** Set the item in the internal map; returns old value */
+	/** Set the item in the slot of the container; returns old value */
 	void* set_raw(Extensible* container, void* value);
-	/** Remove the item from the internal map; returns old value */
+	/** Remove the item from the slot of the container; returns old value */
 	void* unset_raw(Extensible* container);
 };
 
 /** class Extensible is the parent class of many classes such as User and Channel.
  * class Extensible implements a system which allows modules to 'extend' the class by attaching data within
- * a map associated with the object. In this way modules can store their own custom information within user
+ * the extension slots of the object. In this way modules can store their own custom information within user
  * objects, channel objects and server objects, without breaking other modules (this is more sensible than using
  * a flags variable, and each module defining bits within the flag as 'theirs' as it is less prone to conflict and
  * supports arbitary data storage).
@@ -75,20 +80,28 @@ class CoreExport ExtensionItem : public ServiceProvider, public usecountbase
 class CoreExport Extensible : public classbase
 {
  public:
-	typedef std::map<reference<ExtensionItem>,void*> ExtensibleStore;
+	/** Extension items attached to an Extensible with their values, see GetExtList()
+	 */
+	typedef std::vector<std::pair<ExtensionItem*, void*> > ExtensibleStore;
 
 	// Friend access for the protected getter/setter
 	friend class ExtensionItem;
  private:
 	/** Private data store.
-	 * Holds all extensible metadata for the class.
+	 * Holds the values of all extension items attached to the object, indexed by ExtensionItem::slot.
+	 * Allocated when the first item is set, slots without a value are NULL.
+	 */
+	void** extensions;
+
+	/** Number of slots in extensions
 	 */
-	ExtensibleStore extensions;
+	size_t extensionslots;
  public:
 	/**
 	 * Get the extension items for iteraton (i.e. for metadata sync during netburst)
+	 * @return The extension items attached to this object with their values, ordered by slot
 	 */
-	inline const ExtensibleStore& GetExtList() const { return extensions; }
+	ExtensibleStore GetExtList() const;
 
 	Extensible();
 	virtual CullResult cull();
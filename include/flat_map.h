@@ -0,0 +1,121 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <vector>
+
+/** A map that keeps its elements sorted in one contiguous array.
+ * Meant for maps of a few elements that are built and thrown away often, where
+ * allocating a tree node for every element costs more than moving elements around.
+ *
+ * insert() and erase() invalidate all iterators.
+ */
+template <typename K, typename V, typename Compare = std::less<K> >
+class flat_map
+{
+ public:
+	typedef std::pair<K, V> value_type;
+	typedef typename std::vector<value_type>::iterator iterator;
+	typedef typename std::vector<value_type>::const_iterator const_iterator;
+	typedef typename std::vector<value_type>::size_type size_type;
+
+ private:
+	/** The elements, ordered by key
+	 */
+	std::vector<value_type> items;
+
+	struct KeyCompare
+	{
+		bool operator()(const value_type& item, const K& key) const { return Compare()(item.first, key); }
+	};
+
+ public:
+	iterator begin() { return items.begin(); }
+	iterator end() { return items.end(); }
+	const_iterator begin() const { return items.begin(); }
+	const_iterator end() const { return items.end(); }
+	size_type size() const { return items.size(); }
+	bool empty() const { return items.empty(); }
+	void clear() { items.clear(); }
+
+	iterator lower_bound(const K& key)
+	{
+		return std::lower_bound(items.begin(), items.end(), key, KeyCompare());
+	}
+
+	const_iterator lower_bound(const K& key) const
+	{
+		return std::lower_bound(items.begin(), items.end(), key, KeyCompare());
+	}
+
+	iterator find(const K& key)
+	{
+		iterator it = lower_bound(key);
+		if ((it != items.end()) && (!Compare()(key, it->first)))
+			return it;
+		return items.end();
+	}
+
+	const_iterator find(const K& key) const
+	{
+		const_iterator it = lower_bound(key);
+		if ((it != items.end()) && (!Compare()(key, it->first)))
+			return it;
+		return items.end();
+	}
+
+	size_type count(const K& key) const
+	{
+		return (find(key) != items.end() ? 1 : 0);
+	}
+
+	/** Insert an element unless its key is already in the map
+	 * @param value The element to insert
+	 * @return An iterator to the element with the key and true if it was inserted,
+	 * or false if the key was already in the map
+	 */
+	std::pair<iterator, bool> insert(const value_type& value)
+	{
+		iterator it = lower_bound(value.first);
+		if ((it != items.end()) && (!Compare()(value.first, it->first)))
+			return std::make_pair(it, false);
+		return std::make_pair(items.insert(it, value), true);
+	}
+
+	V& operator[](const K& key)
+	{
+		return insert(value_type(key, V())).first->second;
+	}
+
+	void erase(iterator it)
+	{
+		items.erase(it);
+	}
+
+	size_type erase(const K& key)
+	{
+		iterator it = find(key);
+		if (it == items.end())
+			return 0;
+		items.erase(it);
+		return 1;
+	}
+};
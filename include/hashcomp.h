@@ -55,6 +55,13 @@
  */
 CoreExport extern unsigned const char *national_case_insensitive_map;
 
+/** Incremented whenever national_case_insensitive_map is changed, either by pointing it at
+ * another table or by rewriting the table it points to. Modules which do either must
+ * increment it, code which keeps strings folded with the map compares it to notice that
+ * they are out of date.
+ */
+CoreExport extern unsigned int national_case_insensitive_map_version;
+
 /** A mapping of uppercase to lowercase, including scandinavian
  * 'oddities' as specified by RFC1459, e.g. { -> [, and | -> \
  */
@@ -375,6 +382,61 @@ namespace irc
 		bool GetToken(long &token);
 	};
 
+	/** Splits a line sent by a client into message tags, source, command and parameters
+	 * in a single pass without copying any part of it. The result is the same as reading
+	 * the line with a tokenstream, except that a leading "@tags" word is split off.
+	 *
+	 * The tokens point into the parsed string and are only valid while it is unchanged.
+	 * A linetokenizer can be reused for any number of lines; once it has seen a line with
+	 * the most parameters it will get, parsing does not allocate memory.
+	 */
+	class CoreExport linetokenizer
+	{
+	 public:
+		/** A part of the parsed line
+		 */
+		struct token
+		{
+			/** Start of the token, not null terminated
+			 */
+			const char* data;
+
+			/** Length of the token
+			 */
+			size_t length;
+
+			bool empty() const { return (length == 0); }
+			std::string str() const { return std::string(data, length); }
+		};
+
+		/** Message tags without the leading '@', empty if the line had none
+		 */
+		token tags;
+
+		/** Source of the line without the leading ':', empty if the line had none
+		 */
+		token source;
+
+		/** The command, as sent by the client
+		 */
+		token command;
+
+		/** The parameters, the leading ':' of the last one removed
+		 */
+		std::vector<token> params;
+
+		/** Split a line into tokens
+		 * @param line The line to parse, which must stay unchanged while the tokens are used
+		 */
+		void Parse(const std::string& line);
+
+		/** Copy the parameters into a vector of strings. The strings already in the
+		 * vector are overwritten, which reuses their memory.
+		 * @param out The vector to fill
+		 */
+		void GetParameters(std::vector<std::string>& out) const;
+	};
+
 	/** The portparser class seperates out a port range into integers.
 	 * A port range may be specified in the input string in the form
 	 * "6660,6661,6662-6669,7020". The end of the stream is indicated by
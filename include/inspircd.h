@@ -44,6 +44,8 @@
 #include <vector>
 
 #include "intrusive_list.h"
+#include "dense_ptr_map.h"
+#include "flat_map.h"
 #include "compat.h"
 #include "typedefs.h"
 
@@ -59,13 +61,15 @@ CoreExport extern InspIRCd* ServerInstance;
 #include "numerics.h"
 #include "uid.h"
 #include "server.h"
+#include "timer.h"
 #include "users.h"
 #include "channels.h"
-#include "timer.h"
+#include "chanindex.h"
 #include "hashcomp.h"
 #include "logger.h"
 #include "usermanager.h"
 #include "socket.h"
+#include "wildcard.h"
 #include "ctables.h"
 #include "command_parse.h"
 #include "mode.h"
@@ -389,6 +393,10 @@ class CoreExport InspIRCd
 	 */
 	chan_hash* chanlist;
 
+	/** Indexes of the channels in chanlist by size and creation time
+	 */
+	ChannelIndex ChanIndex;
+
 	/** List of the open ports
 	 */
 	std::vector<ListenSocket*> ports;
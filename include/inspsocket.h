@@ -97,24 +97,127 @@ class CoreExport SocketTimeout : public Timer
 	virtual bool Tick(time_t now);
 };
 
+/** The receive queue of a StreamSocket.
+ * Incoming data is read straight into the free space at the tail of the
+ * buffer and consumed from the head by advancing an offset, so splitting
+ * a large burst into lines never copies the remainder of the queue. Space
+ * taken up by consumed data is reclaimed when more room is needed at the
+ * tail, and the buffer is released entirely once the queue drains.
+ */
+class CoreExport RecvQueue
+{
+	/** The buffer holding the queued data, or NULL if none is allocated */
+	char* buf;
+	/** Offset of the first unconsumed byte in buf */
+	size_t head;
+	/** Offset one past the last byte of data in buf */
+	size_t tail;
+	/** Allocated size of buf */
+	size_t capacity;
+
+	RecvQueue(const RecvQueue&);
+	RecvQueue& operator=(const RecvQueue&);
+
+ public:
+	RecvQueue() : buf(NULL), head(0), tail(0), capacity(0) { }
+	~RecvQueue() { delete[] buf; }
+
+	/** Get a pointer to the unconsumed data. Only valid until the queue is next modified. */
+	const char* data() const { return buf + head; }
+	/** Get the number of bytes of unconsumed data */
+	size_t length() const { return tail - head; }
+	/** Check whether there is any unconsumed data */
+	bool empty() const { return head == tail; }
+	/** Copy the unconsumed data into a string */
+	std::string str() const { return std::string(data(), length()); }
+
+	/** Find a character in the unconsumed data
+	 * @param c The character to look for
+	 * @return The offset of the first occurrence of c relative to data(), or std::string::npos
+	 */
+	size_t find(char c) const;
+
+	/** Get a writable area of at least len bytes at the tail of the queue.
+	 * Data written there becomes part of the queue once it is passed to commit().
+	 * @param len The number of bytes the caller intends to write
+	 * @return A pointer to the free space, valid until the queue is next modified
+	 */
+	char* prepare(size_t len);
+	/** Append len bytes previously written to the area returned by prepare() */
+	void commit(size_t len) { tail += len; }
+
+	/** Copy data onto the tail of the queue */
+	void append(const char* data, size_t len);
+	void append(const std::string& data) { append(data.data(), data.length()); }
+
+	/** Consume bytes from the head of the queue
+	 * @param len The number of bytes to remove, at most length()
+	 */
+	void erase_front(size_t len);
+	/** Discard all queued data and release the buffer */
+	void clear();
+};
+
+/** A block of outgoing data which can not be changed once it is built.
+ * It is queued by reference on the send queue of every socket it is written
+ * to, so sending the same data to many sockets does not copy it for each.
+ * Hold it in a reference<SharedMessage> while writing it out.
+ */
+class CoreExport SharedMessage : public refcountbase
+{
+ public:
+	/** The data to send */
+	const std::string data;
+
+	SharedMessage(const std::string& Data) : data(Data) { }
+};
+
 /**
  * StreamSocket is a class that wraps a TCP socket and handles send
  * and receive queues, including passing them to IO hooks
  */
 class CoreExport StreamSocket : public EventHandler
 {
+	/** An entry in the send queue, holding either its own data or a shared message */
+	struct SendQueueItem
+	{
+		/** The message to send, or NULL if this item holds its own data */
+		reference<SharedMessage> shared;
+		/** The data to send if this item does not refer to a shared message */
+		std::string owned;
+
+		SendQueueItem() { }
+		SendQueueItem(SharedMessage* msg) : shared(msg) { }
+
+		/** Get the data to send */
+		const std::string& str() const { return shared ? shared->data : owned; }
+
+		/** Get the data to send as a string which may be modified,
+		 * making a private copy of it first if it is shared.
+		 */
+		std::string& GetMutable()
+		{
+			if (shared)
+			{
+				owned = shared->data;
+				shared = NULL;
+			}
+			return owned;
+		}
+	};
+
 	/** The IOHook that handles raw I/O for this socket, or NULL */
 	IOHook* iohook;
 
-	/** Private send queue. Note that individual strings may be shared
+	/** Private send queue. Note that individual items may be shared with other sockets
 	 */
-	std::deque<std::string> sendq;
+	std::deque<SendQueueItem> sendq;
 	/** Length, in bytes, of the sendq */
 	size_t sendq_len;
 	/** Error - if nonempty, the socket is dead, and this is the reason. */
 	std::string error;
  protected:
-	std::string recvq;
+	RecvQueue recvq;
  public:
 	StreamSocket() : iohook(NULL), sendq_len(0) {}
 	IOHook* GetIOHook() const;
@@ -143,6 +246,10 @@ class CoreExport StreamSocket : public EventHandler
 	/** Send the given data out the socket, either now or when writes unblock
 	 */
 	void WriteData(const std::string& data);
+	/** Send a shared message out the socket, either now or when writes unblock.
+	 * The message is queued by reference rather than copied.
+	 */
+	void WriteData(SharedMessage* msg);
 	/** Convenience function: read a line from the socket
 	 * @param line The line read
 	 * @param delim The line delimiter
@@ -80,7 +80,6 @@ class intrusive_list
 		void operator--()
 		{
 			curr = curr->intrusive_list_node<T, Tag>::ptr_prev;
-			return *this;
 		}
 
 		iterator operator--(int)
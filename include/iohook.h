@@ -20,6 +20,7 @@
 #pragma once
 
 class StreamSocket;
+class RecvQueue;
 
 class IOHookProvider : public ServiceProvider
 {
@@ -81,9 +82,9 @@ class IOHook : public classbase
 	/**
 	 * Called when the stream socket has data to read
 	 * @param sock The socket that is ready
-	 * @param recvq The receive queue that new data should be appended to
+	 * @param recvq The receive queue that new data should be read into
 	 * @return 1 if new data has been read, 0 if no new data is ready (but the
 	 *  socket is still connected), -1 if there was an error or close
 	 */
-	virtual int OnStreamSocketRead(StreamSocket* sock, std::string& recvq) = 0;
+	virtual int OnStreamSocketRead(StreamSocket* sock, RecvQueue& recvq) = 0;
 };
@@ -28,25 +28,88 @@ class CoreExport ListModeBase : public ModeHandler
 	 */
 	struct ListItem
 	{
-		std::string setter;
+		/** Who set the item, interned and shared with other items set by the same source
+		 */
+		const std::string* setter;
 		std::string mask;
 		time_t time;
-		ListItem(const std::string& Mask, const std::string& Setter, time_t Time)
-			: setter(Setter), mask(Mask), time(Time) { }
+		/** The mask compiled for Channel::CheckBan()
+		 */
+		BanMask banmask;
+		ListItem(const std::string& Mask, const std::string* Setter, time_t Time)
+			: setter(Setter), mask(Mask), time(Time), banmask(Mask) { }
 	};
 
-	/** Items stored in the channel's list
+	/** Items stored in the channel's list, in the order they were added
 	 */
-	typedef std::list<ListItem> ModeList;
+	typedef std::vector<ListItem> ModeList;
+
+	/** An extban in a listmode's list, such as "m:nick!*@*"
+	 */
+	struct ExtBanItem
+	{
+		/** Position of the item in the ModeList
+		 */
+		ModeList::size_type pos;
+		/** The mask without the extban type, such as "nick!*@*"
+		 */
+		std::string mask;
+		/** The mask without the extban type compiled for Channel::CheckBan()
+		 */
+		BanMask banmask;
+		ExtBanItem(ModeList::size_type Pos, const std::string& Mask)
+			: pos(Pos), mask(Mask), banmask(Mask) { }
+	};
+
+	/** Extbans of one type in a listmode's list, in list order
+	 */
+	typedef std::vector<ExtBanItem> ExtBanList;
 
  private:
 	class ChanData
 	{
 	public:
+		/** The items, including removed ones which are dropped by Compact().
+		 * A removed item has a NULL setter.
+		 */
 		ModeList list;
 		int maxitems;
 
-		ChanData() : maxitems(-1) { }
+		/** Number of removed items in the list
+		 */
+		ModeList::size_type removed;
+
+		/** Position of every item in the list by mask
+		 */
+		TR1NS::unordered_map<std::string, ModeList::size_type> index;
+
+		/** The extbans in the list by extban type
+		 */
+		std::map<char, ExtBanList> extbans;
+
+		ChanData() : maxitems(-1), removed(0) { }
+		~ChanData();
+
+		/** Add an item to the end of the list
+		 * @param mask The mask of the item, must not be on the list
+		 * @param setter Who set the item
+		 */
+		void Add(const std::string& mask, const std::string& setter);
+
+		/** Remove an item from the list. The item is only marked as removed,
+		 * so clearing a list one item at a time does not move the rest of it
+		 * every time; the list is compacted before it is next read.
+		 * @param pos The position of the item
+		 */
+		void Remove(ModeList::size_type pos);
+
+		/** Drop the removed items from the list, keeping the order of the others
+		 */
+		void Compact();
+
+		/** Get the number of items in the list which have not been removed
+		 */
+		ModeList::size_type GetCount() const { return list.size() - removed; }
 	};
 
 	/** The number of items a listmode's list may contain
@@ -129,6 +192,13 @@ class CoreExport ListModeBase : public ModeHandler
 	 */
 	ModeList* GetList(Channel* channel);
 
+	/** Retrieves the extbans of a type on the given channel, such as "m:nick!*@*" for type 'm'
+	 * @param channel Channel to get the extbans from
+	 * @param type The extban type
+	 * @return The extbans of the type, with their masks compiled, can be NULL
+	 */
+	const ExtBanList* GetExtBans(Channel* channel, char type);
+
 	/** Display the list for this mode
 	 * See mode.h
 	 * @param user The user to send the list to
@@ -202,5 +272,22 @@ inline ListModeBase::ModeList* ListModeBase::GetList(Channel* channel)
 	if (!cd)
 		return NULL;
 
+	if (cd->removed)
+		cd->Compact();
 	return &cd->list;
 }
+
+inline const ListModeBase::ExtBanList* ListModeBase::GetExtBans(Channel* channel, char type)
+{
+	ChanData* cd = extItem.get(channel);
+	if (!cd)
+		return NULL;
+
+	if (cd->removed)
+		cd->Compact();
+	std::map<char, ExtBanList>::const_iterator it = cd->extbans.find(type);
+	if (it == cd->extbans.end())
+		return NULL;
+
+	return &it->second;
+}
@@ -27,7 +27,40 @@ class CoreExport Membership : public Extensible, public intrusive_list_node<Memb
 	Channel* const chan;
 	// mode list, sorted by prefix rank, higest first
 	std::string modes;
-	Membership(User* u, Channel* c) : user(u), chan(c) {}
+
+	/** Rank of the bucket this membership is in, see Channel::localmembers.
+	 * Only used for local users.
+	 */
+	unsigned int bucketrank;
+
+	/** Position of this membership in its bucket
+	 */
+	size_t bucketpos;
+
+	/** Verdicts of Channel::IsBanned() and Channel::GetExtBanStatus() for this member.
+	 * They are valid as long as the ban versions of the channel and the user do not change.
+	 */
+	struct BanCache
+	{
+		/** Ban versions of the channel and the user when the verdicts were cached */
+		unsigned long chanversion;
+		unsigned long userversion;
+
+		/** One bit per extban type and one for IsBanned(), set for the cached verdicts */
+		uint64_t cached;
+
+		/** The cached verdicts which were MOD_RES_DENY and MOD_RES_ALLOW */
+		uint64_t denied;
+		uint64_t allowed;
+
+		BanCache() : chanversion(0), userversion(0), cached(0), denied(0), allowed(0) { }
+	};
+
+	/** Cached ban verdicts of this member
+	 */
+	BanCache bancache;
+
+	Membership(User* u, Channel* c) : user(u), chan(c), bucketrank(0), bucketpos(0) {}
 	inline bool hasMode(char m) const
 	{
 		return modes.find(m) != std::string::npos;
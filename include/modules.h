@@ -120,18 +120,24 @@ struct ModResult {
  * This #define allows us to call a method in all
  * loaded modules in a readable simple way, e.g.:
  * 'FOREACH_MOD(OnConnect,(user));'
+ * Events no module is attached to return before evaluating any arguments.
  */
 #define FOREACH_MOD(y,x) do { \
-	const IntModuleList& _handlers = ServerInstance->Modules->EventHandlers[I_ ## y]; \
-	for (IntModuleList::const_reverse_iterator _i = _handlers.rbegin(), _next; _i != _handlers.rend(); _i = _next) \
+	Module* const* _table = ServerInstance->Modules->EventTables[I_ ## y]; \
+	if (!*_table) \
+		break; \
+	const bool _profile = ServerInstance->Config->HookProfiling; \
+	ModuleManager::EventTimer _timer(_profile, ServerInstance->Modules->EventCounters[I_ ## y]); \
+	for (; *_table; ++_table) \
 	{ \
-		_next = _i+1; \
+		ModuleManager::HookTimer _hook(_profile, *_table, I_ ## y); \
 		try \
 		{ \
-			(*_i)->y x ; \
+			(*_table)->y x ; \
 		} \
 		catch (CoreException& modexcept) \
 		{ \
+			_hook.Exception(); \
 			ServerInstance->Logs->Log("MODULE", LOG_DEFAULT, "Exception caught: " + modexcept.GetReason()); \
 		} \
 	} \
@@ -145,18 +151,23 @@ struct ModResult {
  */
 #define DO_EACH_HOOK(n,v,args) \
 do { \
-	const IntModuleList& _handlers = ServerInstance->Modules->EventHandlers[I_ ## n]; \
-	for (IntModuleList::const_reverse_iterator _i = _handlers.rbegin(), _next; _i != _handlers.rend(); _i = _next) \
+	Module* const* _table = ServerInstance->Modules->EventTables[I_ ## n]; \
+	if (!*_table) \
+		break; \
+	const bool _profile = ServerInstance->Config->HookProfiling; \
+	ModuleManager::EventTimer _timer(_profile, ServerInstance->Modules->EventCounters[I_ ## n]); \
+	for (; *_table; ++_table) \
 	{ \
-		_next = _i+1; \
+		ModuleManager::HookTimer _hook(_profile, *_table, I_ ## n); \
 		try \
 		{ \
-			v = (*_i)->n args;
+			v = (*_table)->n args;
 
 #define WHILE_EACH_HOOK(n) \
 		} \
 		catch (CoreException& except_ ## n) \
 		{ \
+			_hook.Exception(); \
 			ServerInstance->Logs->Log("MODULE", LOG_DEFAULT, "Exception caught: " + (except_ ## n).GetReason()); \
 		} \
 	} \
@@ -266,6 +277,7 @@ enum Implementation
 	I_OnWhoisLine, I_OnBuildNeighborList, I_OnGarbageCollect, I_OnSetConnectClass,
 	I_OnText, I_OnPassCompare, I_OnRunTestSuite, I_OnNamesListItem, I_OnNumeric,
 	I_OnPreRehash, I_OnModuleRehash, I_OnSendWhoLine, I_OnChangeIdent, I_OnSetUserIP,
+	I_OnBufferFlushed,
 	I_END
 };
 
@@ -276,6 +288,35 @@ enum Implementation
  */
 class CoreExport Module : public classbase, public usecountbase
 {
+ public:
+	/** Profiling counters of one event in a module
+	 */
+	struct HookStats
+	{
+		/** Number of calls
+		 */
+		unsigned long calls;
+
+		/** Number of calls that threw an exception
+		 */
+		unsigned long exceptions;
+
+		/** Total time of the calls, in ticks of ModuleManager::GetTicks()
+		 */
+		uint64_t total;
+
+		/** Time of the longest call, in ticks of ModuleManager::GetTicks()
+		 */
+		uint64_t max;
+
+		HookStats() : calls(0), exceptions(0), total(0), max(0) { }
+	};
+
+ private:
+	/** Profiling counters indexed by event, allocated when the module is first profiled
+	 */
+	HookStats* hookstats;
+
 	/** Detach an event from this module
 	 * @param i Event type to detach
 	 */
@@ -305,6 +346,22 @@ class CoreExport Module : public classbase, public usecountbase
 	 */
 	virtual void init() {}
 
+	/** Get the profiling counters of an event, allocating the counters of all events if needed
+	 * @param i The event
+	 * @return The counters of the event
+	 */
+	HookStats* GetHookStats(Implementation i)
+	{
+		if (!hookstats)
+			hookstats = new HookStats[I_END];
+		return hookstats + i;
+	}
+
+	/** Get the profiling counters of all events
+	 * @return The counters indexed by event, or NULL if the module was never profiled
+	 */
+	const HookStats* GetHookStats() const { return hookstats; }
+
 	/** Clean up prior to destruction
 	 * If you override, you must call this AFTER your module's cleanup
 	 */
@@ -556,7 +613,7 @@ class CoreExport Module : public classbase, public usecountbase
 	 *
 	 * Set exceptions[user] = true to include, exceptions[user] = false to exclude
 	 */
-	virtual void OnBuildNeighborList(User* source, IncludeChanList& include_c, std::map<User*, bool>& exceptions);
+	virtual void OnBuildNeighborList(User* source, IncludeChanList& include_c, NeighborExceptions& exceptions);
 
 	/** Called before any nickchange, local or remote. This can be used to implement Q-lines etc.
 	 * Please note that although you can see remote nickchanges through this function, you should
@@ -1061,6 +1118,13 @@ class CoreExport Module : public classbase, public usecountbase
 	 * @param user The user whose IP is being set
 	 */
 	virtual void OnSetUserIP(LocalUser* user);
+
+	/** Called when everything queued for a local user has been written to their socket.
+	 * Commands with long replies, such as LIST, use this to send the rest of the reply
+	 * a part at a time instead of filling the user's sendq in one go.
+	 * @param user The user whose sendq is now empty
+	 */
+	virtual void OnBufferFlushed(LocalUser* user);
 };
 
 /** A list of modules
@@ -1107,14 +1171,134 @@ class CoreExport ModuleManager
 	 */
 	bool PrioritizeHooks();
 
+	/** Compile the table of an event from its handlers
+	 * @param i The event whose handlers have changed
+	 */
+	void RebuildEventTable(Implementation i);
+
+	/** Readings of GetTicks() and GetClock() at startup, used to convert ticks to time
+	 */
+	const uint64_t startticks;
+	const uint64_t startclock;
+
  public:
 	typedef std::map<std::string, Module*> ModuleMap;
 
-	/** Event handler hooks.
-	 * This needs to be public to be used by FOREACH_MOD and friends.
+	/** Dispatch counters of an event
+	 */
+	struct EventStats
+	{
+		/** Number of times the event was dispatched to at least one module
+		 */
+		unsigned long calls;
+
+		/** Time spent in those dispatches in nanoseconds, including the time of events dispatched from within them.
+		 * Only measured while hook profiling is enabled.
+		 */
+		uint64_t time;
+
+		EventStats() : calls(0), time(0) { }
+	};
+
+	/** Read a monotonic clock
+	 * @return A time in nanoseconds, counted from an unspecified starting point
+	 */
+	static uint64_t GetClock();
+
+	/** Counts a dispatch of an event and, if profiling is enabled, adds the time between
+	 * its construction and destruction to the counters of the event
+	 */
+	class EventTimer
+	{
+		EventStats& stats;
+		const bool timed;
+		const uint64_t start;
+
+	 public:
+		EventTimer(bool enabled, EventStats& es) : stats(es), timed(enabled), start(enabled ? GetClock() : 0) { }
+		~EventTimer()
+		{
+			stats.calls++;
+			if (timed)
+				stats.time += GetClock() - start;
+		}
+	};
+
+	/** Read the time stamp counter of the CPU, or the monotonic clock where there is none
+	 * @return A number of ticks, use TicksToNanoseconds() to convert a difference of them to time
+	 */
+	static uint64_t GetTicks()
+	{
+#if defined __GNUC__ && (defined __i386__ || defined __x86_64__)
+		return __builtin_ia32_rdtsc();
+#else
+		return GetClock();
+#endif
+	}
+
+	/** Convert a number of ticks of GetTicks() to time
+	 * @param ticks The number of ticks
+	 * @return The time in nanoseconds
+	 */
+	uint64_t TicksToNanoseconds(uint64_t ticks) const;
+
+	/** Profiles one call of an event in a module
+	 */
+	class HookTimer
+	{
+		Module::HookStats* const stats;
+		const uint64_t start;
+
+	 public:
+		HookTimer(bool enabled, Module* mod, Implementation i)
+			: stats(enabled ? mod->GetHookStats(i) : NULL), start(enabled ? GetTicks() : 0)
+		{
+		}
+
+		/** Count the call as one that threw an exception
+		 */
+		void Exception()
+		{
+			if (stats)
+				stats->exceptions++;
+		}
+
+		~HookTimer()
+		{
+			if (!stats)
+				return;
+
+			const uint64_t elapsed = GetTicks() - start;
+			stats->calls++;
+			stats->total += elapsed;
+			if (elapsed > stats->max)
+				stats->max = elapsed;
+		}
+	};
+
+	/** Get the name of an event
+	 * @param i The event
+	 * @return The name of the event, without the I_ prefix
+	 */
+	static const char* GetEventName(Implementation i);
+
+	/** Event handler hooks, the modules attached to each event.
+	 * Modules are called in the reverse of the order they have here.
 	 */
 	IntModuleList EventHandlers[I_END];
 
+	/** The modules attached to each event in the order they are called, followed by NULL.
+	 * These are compiled from EventHandlers whenever they change. A table that is replaced
+	 * stays valid until the end of the main loop iteration, so a dispatch that is in progress
+	 * when a module attaches or detaches finishes with the table it started with.
+	 * This needs to be public to be used by FOREACH_MOD and friends.
+	 */
+	Module* const* EventTables[I_END];
+
+	/** Dispatch counters of each event
+	 */
+	EventStats EventCounters[I_END];
+
 	/** List of data services keyed by name */
 	std::multimap<std::string, ServiceProvider*> DataProviders;
 
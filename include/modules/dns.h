@@ -133,6 +133,21 @@ namespace DNS
 		Manager(Module* mod) : DataProvider(mod, "DNS") { }
 
 		virtual void Process(Request* req) = 0;
+
+		/** Send several requests at once, with as few system calls as possible.
+		 * Unlike Process() this does not throw: requests which can not be sent
+		 * get OnError() with ERROR_UNKNOWN and are deleted. Requests answered from
+		 * the cache complete before this returns.
+		 * @param reqs The requests to send
+		 */
+		virtual void ProcessBatch(const std::vector<Request*>& reqs) = 0;
+
+		/** Called when a request times out
+		 * @param req The request
+		 * @return True if the request was sent to another nameserver and is still pending
+		 */
+		virtual bool Retry(Request* req) = 0;
+
 		virtual void RemoveRequest(Request* req) = 0;
 		virtual std::string GetErrorStr(Error) = 0;
 	};
@@ -182,6 +197,9 @@ namespace DNS
 		 */
 		bool Tick(time_t now)
 		{
+			if (manager->Retry(this))
+				return true;
+
 			Query rr(*this);
 			rr.error = ERROR_TIMEDOUT;
 			this->OnError(&rr);
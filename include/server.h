@@ -39,6 +39,11 @@ class CoreExport Server : public classbase
 	bool silentuline;
 
  public:
+	/** Registered users on this server, maintained by UserManager::AddToIndexes() and
+	 * UserManager::RemoveFromIndexes()
+	 */
+	ServerUserList users;
+
 	Server(const std::string& srvname, const std::string& srvdesc)
 		: name(srvname), description(srvdesc), uline(false), silentuline(false) { }
 
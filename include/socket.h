@@ -129,6 +129,9 @@ namespace irc
 
 #include "iohook.h"
 #include "socketengine.h"
+
+class AcceptThread;
+
 /** This class handles incoming connections on client ports.
  * It will create a new User for every valid connection
  * and assign it a file descriptor.
@@ -147,6 +150,11 @@ class CoreExport ListenSocket : public EventHandler
 	 */
 	dynamic_reference_nocheck<IOHookProvider> iohookprov;
 
+	/** Threads accepting connections on their own SO_REUSEPORT sockets bound
+	 * to the same address, empty unless <bind:acceptthreads> is set.
+	 */
+	std::vector<AcceptThread*> acceptthreads;
+
 	/** Create a new listening socket
 	 */
 	ListenSocket(ConfigTag* tag, const irc::sockets::sockaddrs& bind_to);
@@ -161,6 +169,13 @@ class CoreExport ListenSocket : public EventHandler
 	 */
 	void AcceptInternal();
 
+	/** Hand an accepted connection to the modules or create a user for it
+	 * @param incomingSockfd The fd of the new connection
+	 * @param client The address of the remote end
+	 * @param server The address of the local end
+	 */
+	void AcceptConnection(int incomingSockfd, irc::sockets::sockaddrs& client, irc::sockets::sockaddrs& server);
+
 	/** Inspects the bind block belonging to this socket to set the name of the IO hook
 	 * provider which this socket will use for incoming connections.
 	 * @return True if the IO hook provider was found or none was given, false otherwise.
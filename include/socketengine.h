@@ -436,6 +436,17 @@ public:
 	 */
 	int SendTo(EventHandler* fd, const void *buf, size_t len, int flags, const sockaddr *to, socklen_t tolen);
 
+	/** Send several datagrams to the same address.
+	 * Uses sendmmsg(2) where it is available, otherwise calls sendto(2) for each datagram.
+	 * @param fd The EventHandler of the socket to send on.
+	 * @param bufs The datagrams to send.
+	 * @param flags A flag value that controls the sending of the data.
+	 * @param to The remote IP address and port.
+	 * @param tolen The size of the to parameter.
+	 * @return The number of datagrams sent from the start of bufs, or -1 if none could be sent.
+	 */
+	int SendToMany(EventHandler* fd, const std::vector<std::string>& bufs, int flags, const sockaddr *to, socklen_t tolen);
+
 	/** Abstraction for BSD sockets connect(2).
 	 * This function should emulate its namesake system call exactly.
 	 * @param fd This version of the call takes an EventHandler instead of a bare file descriptor.
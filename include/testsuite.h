@@ -26,7 +26,10 @@ class TestSuite
 
 	bool DoThreadTests();
 	bool DoWildTests();
+	bool DoWildBenchmark();
 	bool DoCommaSepStreamTests();
 	bool DoSpaceSepStreamTests();
 	bool DoGenerateUIDTests();
+	bool DoLineTokenizerTests();
+	bool DoXLineIndexTests();
 };
@@ -35,6 +35,8 @@ class Module;
  */
 class CoreExport Timer
 {
+	friend class TimerManager;
+
 	/** The triggering time
 	 */
 	time_t trigger;
@@ -47,6 +49,15 @@ class CoreExport Timer
 	 */
 	bool repeat;
 
+	/** Slot of the timer wheel this timer is in, NULL if it is not scheduled
+	 */
+	Timer** slot;
+
+	/** Neighbours of this timer in its slot, the slot is a circular list
+	 */
+	Timer* next;
+	Timer* prev;
+
  public:
 	/** Default constructor, initializes the triggering time
 	 * @param secs_from_now The number of seconds from now to trigger the timer
@@ -54,6 +65,7 @@ class CoreExport Timer
 	 * @param repeating Repeat this timer every secs_from_now seconds if set to true
 	 */
 	Timer(unsigned int secs_from_now, time_t now, bool repeating = false)
+		: slot(NULL), next(NULL), prev(NULL)
 	{
 		trigger = now + secs_from_now;
 		secs = secs_from_now;
@@ -117,19 +129,58 @@ class CoreExport Timer
 	}
 };
 
-typedef std::multimap<time_t, Timer*> TimerMap;
-
 /** This class manages sets of Timers, and triggers them at their defined times.
  * This will ensure timers are not missed, as well as removing timers that have
  * expired and allowing the addition of new ones.
+ *
+ * Timers are kept in a hierarchical timing wheel with one second ticks: the first
+ * level has a slot for each of the next 256 seconds, every further level covers
+ * 64 slots of the level below it. Timers in higher levels are moved down when the
+ * lower level wraps around. Adding, removing and rescheduling a timer are O(1).
  */
 class CoreExport TimerManager
 {
-	/** A list of all pending timers
+	enum
+	{
+		ROOT_BITS = 8,
+		LEVEL_BITS = 6,
+		ROOT_SIZE = 1 << ROOT_BITS,
+		LEVEL_SIZE = 1 << LEVEL_BITS,
+		LEVELS = 3
+	};
+
+	/** Slots for the next ROOT_SIZE seconds
+	 */
+	Timer* root[ROOT_SIZE];
+
+	/** Slots for timers further in the future
 	 */
-	TimerMap Timers;
+	Timer* levels[LEVELS][LEVEL_SIZE];
+
+	/** The next second to run the timers of
+	 */
+	time_t nexttick;
+
+	/** Put a timer into the slot matching its trigger time
+	 */
+	void Schedule(Timer* t);
+
+	/** Append a timer to a slot
+	 */
+	static void Link(Timer** slot, Timer* t);
+
+	/** Remove a timer from its slot
+	 */
+	static void Unlink(Timer* t);
+
+	/** Move the timers in a slot of a higher level down into the slots below
+	 * @return The index of the slot
+	 */
+	unsigned int Cascade(unsigned int level);
 
  public:
+	TimerManager();
+
 	/** Tick all pending Timers
 	 * @param TIME the current system time
 	 */
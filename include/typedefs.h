@@ -24,6 +24,7 @@
 class BanCacheManager;
 class BufferedSocket;
 class Channel;
+class ChannelIndex;
 class Command;
 class ConfigStatus;
 class ConfigTag;
@@ -42,9 +43,11 @@ class ServerConfig;
 class ServerLimits;
 class Thread;
 class User;
+class WildcardMask;
 class XLine;
 class XLineManager;
 class XLineFactory;
+struct BanMask;
 struct ConnectClass;
 struct ModResult;
 
@@ -58,6 +61,22 @@ typedef TR1NS::unordered_map<std::string, Channel*, irc::insensitive, irc::StrHa
  */
 typedef intrusive_list<LocalUser> LocalUserList;
 
+/** Tag of the list of local users with work left for UserManager::DoBackgroundUserStuff()
+ */
+struct busy_user_tag { };
+
+/** A list holding local users which have a command flood penalty or unprocessed input
+ */
+typedef intrusive_list<LocalUser, busy_user_tag> BusyUserList;
+
+/** Tag of the list of registered users on a server, this is the type of Server::users
+ */
+struct server_user_tag { };
+
+/** A list holding the registered users on a server
+ */
+typedef intrusive_list<User, server_user_tag> ServerUserList;
+
 /** A list of failed port bindings, used for informational purposes on startup */
 typedef std::vector<std::pair<std::string, std::string> > FailedPortList;
 
@@ -77,6 +96,10 @@ typedef UserChanList::iterator UCListIter;
  */
 typedef std::vector<Membership*> IncludeChanList;
 
+/** Users whose inclusion in the neighbor list of a user is decided explicitly, true to include them
+ */
+typedef flat_map<User*, bool> NeighborExceptions;
+
 /** A list of custom modes parameters on a channel
  */
 typedef std::map<char,std::string> CustomModeList;
@@ -109,7 +132,7 @@ typedef std::map<std::string, file_cache> ConfigFileCache;
 typedef TR1NS::unordered_map<std::string, Command*> Commandtable;
 
 /** Membership list of a channel */
-typedef std::map<User*, Membership*> UserMembList;
+typedef dense_ptr_map<User, Membership> UserMembList;
 /** Iterator of UserMembList */
 typedef UserMembList::iterator UserMembIter;
 /** const Iterator of UserMembList */
@@ -24,6 +24,69 @@
 /** A list of ip addresses cross referenced against clone counts */
 typedef std::map<irc::sockets::cidr_mask, unsigned int> clonemap;
 
+/** Users indexed by a hostname, so that masks such as "host.example.com" and
+ * "*.example.com" can be looked up without checking every user.
+ * Keys are the hostnames folded with ascii_case_insensitive_map and reversed,
+ * which makes all hosts within a domain adjacent in the index.
+ */
+class CoreExport HostIndex
+{
+	typedef std::multimap<std::string, User*> IndexMap;
+	IndexMap index;
+
+	static std::string MakeKey(const std::string& host);
+
+ public:
+	/** Add a user to the index
+	 * @param user The user to add
+	 * @param host The host to index the user by
+	 */
+	void Add(User* user, const std::string& host);
+
+	/** Remove a user from the index
+	 * @param user The user to remove
+	 * @param host The host the user was added with
+	 */
+	void Remove(User* user, const std::string& host);
+
+	/** Add the users whose host can match a mask to a list
+	 * @param mask The mask, compiled with ascii_case_insensitive_map
+	 * @param out The list to add the users to
+	 * @return False if the index can't look up masks of this shape, out is unchanged then
+	 */
+	bool Find(const WildcardMask& mask, std::vector<User*>& out) const;
+};
+
+/** Users indexed by IP address, so that the users in a CIDR range can be
+ * looked up without checking every user
+ */
+class CoreExport IPIndex
+{
+	typedef std::multimap<std::string, User*> IndexMap;
+	IndexMap index;
+
+	/** Make the key of an address range, the family followed by the address bytes
+	 */
+	static std::string MakeKey(const irc::sockets::cidr_mask& range);
+
+ public:
+	/** Add a user to the index by their current IP address
+	 * @param user The user to add
+	 */
+	void Add(User* user);
+
+	/** Remove a user from the index, the user's IP address must not have changed since Add()
+	 * @param user The user to remove
+	 */
+	void Remove(User* user);
+
+	/** Add the users in an address range to a list
+	 * @param range The range
+	 * @param out The list to add the users to
+	 */
+	void Find(const irc::sockets::cidr_mask& range, std::vector<User*>& out) const;
+};
+
 class CoreExport UserManager
 {
  private:
@@ -54,10 +117,30 @@ class CoreExport UserManager
 	 */
 	LocalUserList local_users;
 
+	/** Local users which have a command flood penalty or unprocessed input, see MarkBusy()
+	 */
+	BusyUserList busy_users;
+
 	/** Oper list, a vector containing all local and remote opered users
 	 */
 	std::list<User*> all_opers;
 
+	/** Registered users indexed by their real host
+	 */
+	HostIndex hosts;
+
+	/** Registered users indexed by their displayed host
+	 */
+	HostIndex dhosts;
+
+	/** Registered users indexed by their IP address
+	 */
+	IPIndex ips;
+
+	/** Servers which have registered users, the users are in Server::users
+	 */
+	std::set<Server*> servers;
+
 	/** Number of unregistered users online right now.
 	 * (Unregistered means before USER/NICK/dns)
 	 */
@@ -74,10 +157,17 @@ class CoreExport UserManager
      */
 	void GarbageCollect();
 
-	/** Perform background user events such as PING checks
+	/** Decay the command flood penalty of busy users and process their queued input.
+	 * Ping and registration timeouts are handled by the UserTimeoutTimer of each user.
 	 */
 	void DoBackgroundUserStuff();
 
+	/** Add a user to the list of users processed by DoBackgroundUserStuff().
+	 * They are removed once they have no penalty and no queued lines left.
+	 * @param user The user to add
+	 */
+	void MarkBusy(LocalUser* user);
+
 	/** Returns true when all modules have done pre-registration checks on a user
 	 * @param user The user to verify
 	 * @return True if all modules have finished checking this user
@@ -95,6 +185,17 @@ class CoreExport UserManager
 	 */
 	void AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server);
 
+	/** Add a user who has finished registering to the host and IP indexes and the
+	 * user list of their server. This is called once the user's hosts and IP are set.
+	 * @param user The user to add
+	 */
+	void AddToIndexes(User* user);
+
+	/** Remove a user from the host and IP indexes and the user list of their server
+	 * @param user The user to remove, does nothing if the user was not added
+	 */
+	void RemoveFromIndexes(User* user);
+
 	/** Disconnect a user gracefully
 	 * @param user The user to remove
 	 * @param quitreason The quit reason to show to normal users
@@ -216,7 +216,7 @@ struct CoreExport ConnectClass : public refcountbase
  * connection is stored here primarily, from the user's socket ID (file descriptor) through to the
  * user's nickname and hostname.
  */
-class CoreExport User : public Extensible
+class CoreExport User : public Extensible, public intrusive_list_node<User, server_user_tag>
 {
  private:
 	/** Cached nick!ident@dhost value using the displayed hostname
@@ -239,6 +239,10 @@ class CoreExport User : public Extensible
 	 */
 	std::string cachedip;
 
+	/** Incremented every time something bans can match on changes, see Membership::BanCache
+	 */
+	unsigned long banversion;
+
 	/** The user's mode list.
 	 * Much love to the STL for giving us an easy to use bitset, saving us RAM.
 	 * if (modes[modeletter-65]) is set, then the mode is
@@ -247,6 +251,19 @@ class CoreExport User : public Extensible
 	 */
 	std::bitset<64> modes;
 
+	/** Local users sharing at least one channel with this user, excluding this user.
+	 * Only maintained when the neighbor cache is enabled.
+	 */
+	std::vector<LocalUser*> neighborcache;
+
+	/** Sum of the local member versions of this user's channels when neighborcache was built
+	 */
+	unsigned long neighborstamp;
+
+	/** True if neighborcache was built for the current channel list of the user
+	 */
+	bool neighborcached;
+
  public:
 
 	/** Hostname of connection.
@@ -335,6 +352,10 @@ class CoreExport User : public Extensible
 	 */
 	unsigned int quitting:1;
 
+	/** True while the user is in the UserManager indexes and in the user list of their server
+	 */
+	unsigned int indexed:1;
+
 	/** What type of user is this? */
 	const unsigned int usertype:2;
 
@@ -379,6 +400,16 @@ class CoreExport User : public Extensible
 	 */
 	void InvalidateCache();
 
+	/** Invalidates the ban verdicts cached for this user in all of their memberships.
+	 * Call this when something changes which extbans can match on, such as the account of the user.
+	 */
+	void InvalidateBanCache() { banversion++; }
+
+	/** Get the counter which is incremented by InvalidateBanCache()
+	 * @return The current value of the counter
+	 */
+	unsigned long GetBanVersion() const { return banversion; }
+
 	/** Returns whether this user is currently away or not. If true,
 	 * further information can be found in User::awaymsg and User::awaytime
 	 * @return True if the user is away, false otherwise
@@ -542,6 +573,16 @@ class CoreExport User : public Extensible
 	 */
 	void WriteCommonRaw(const std::string &line, bool include_self = true);
 
+	/** Get the local users sharing at least one channel with this user, excluding this user.
+	 * The list is cached and rebuilt when a local user joins or leaves one of the channels.
+	 * @return The local neighbors of this user in no particular order
+	 */
+	const std::vector<LocalUser*>& GetLocalNeighbors();
+
+	/** Discard the cached local neighbors, called when the channel list of the user changes
+	 */
+	void InvalidateNeighbors() { neighborcached = false; neighborcache.clear(); }
+
 	/** Write to all users that can see this user (including this user in the list), appending CR/LF
 	 * @param text The format string for text to send to the users
 	 * @param ... POD-type format arguments
@@ -645,17 +686,51 @@ class CoreExport UserIOHandler : public StreamSocket
 	void OnDataReady();
 	void OnError(BufferedSocketError error);
 
+	/** Writes out the sendq, and fires OnBufferFlushed once it has been emptied
+	 */
+	void DoWrite();
+
 	/** Adds to the user's write buffer.
 	 * You may add any amount of text up to this users sendq value, if you exceed the
 	 * sendq value, the user will be removed, and further buffer adds will be dropped.
 	 * @param data The data to add to the write buffer
 	 */
 	void AddWriteBuf(const std::string &data);
+
+	/** Adds a shared message to the user's write buffer, subject to the same
+	 * sendq limits as AddWriteBuf(const std::string&).
+	 * @param msg The message to add to the write buffer
+	 */
+	void AddWriteBuf(SharedMessage* msg);
+
+	/** Check whether there are complete lines in the receive queue waiting to be processed
+	 */
+	bool HasQueuedLines() const { return (recvq.find('\n') != std::string::npos); }
+
+ private:
+	/** Check whether adding len bytes to the write buffer is allowed, and
+	 * start quitting the user if it would exceed their hard sendq limit.
+	 * @return True if the data may be added
+	 */
+	bool CanAddWriteBuf(size_t len);
 };
 
 typedef unsigned int already_sent_t;
 
-class CoreExport LocalUser : public User, public InviteBase<LocalUser>, public intrusive_list_node<LocalUser>
+/** Enforces the registration timeout of a local user and pings them once they are registered.
+ * While the user is unregistered it ticks every second, afterwards it is due when the user
+ * should be pinged next.
+ */
+class CoreExport UserTimeoutTimer : public Timer
+{
+	LocalUser* const user;
+
+ public:
+	UserTimeoutTimer(LocalUser* me);
+	bool Tick(time_t TIME);
+};
+
+class CoreExport LocalUser : public User, public InviteBase<LocalUser>, public intrusive_list_node<LocalUser>, public intrusive_list_node<LocalUser, busy_user_tag>
 {
  public:
 	LocalUser(int fd, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server);
@@ -663,6 +738,10 @@ class CoreExport LocalUser : public User, public InviteBase<LocalUser>, public i
 
 	UserIOHandler eh;
 
+	/** Checks the ping and registration timeouts of this user
+	 */
+	UserTimeoutTimer timeouttimer;
+
 	/** Stats counter for bytes inbound
 	 */
 	unsigned int bytes_in;
@@ -721,6 +800,10 @@ class CoreExport LocalUser : public User, public InviteBase<LocalUser>, public i
 	 */
 	unsigned int exempt:1;
 
+	/** True if the user is in UserManager::busy_users
+	 */
+	unsigned int busy:1;
+
 	/** Used by PING checking code
 	 */
 	time_t nping;
@@ -762,6 +845,18 @@ class CoreExport LocalUser : public User, public InviteBase<LocalUser>, public i
 	void Write(const std::string& text);
 	void Write(const char*, ...) CUSTOM_PRINTF(2, 3);
 
+	/** Write a line built by MakeSharedLine() to this user.
+	 * The line is queued by reference, so writing it to many users only copies a pointer for each.
+	 * @param line The line to write
+	 */
+	void Write(SharedMessage* line);
+
+	/** Build a line which can be written to any number of local users with Write(SharedMessage*).
+	 * @param text The text of the line, which is cropped to the maximum line length and has CR/LF appended
+	 * @return A new message, which must be held in a reference<SharedMessage> while it is in use
+	 */
+	static SharedMessage* MakeSharedLine(const std::string& text);
+
 	/** Returns the list of channels this user has been invited to but has not yet joined.
 	 * @return A list of channels the user is invited to
 	 */
@@ -0,0 +1,166 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/** A glob pattern compiled for matching against many strings.
+ * Matches exactly like InspIRCd::Match() and InspIRCd::MatchCIDR() with the same
+ * mask and case map, but the common shapes of masks (no wildcards, "literal*",
+ * "*literal", "*literal*") are matched without backtracking against a literal
+ * which was folded through the case map when the mask was compiled.
+ * Other masks fall back to the backtracking matcher.
+ */
+class CoreExport WildcardMask
+{
+ public:
+	/** The shape of a compiled mask
+	 */
+	enum MaskKind
+	{
+		/** No wildcards, the literal must match the whole string */
+		MASK_EXACT,
+		/** "literal*" */
+		MASK_PREFIX,
+		/** "*literal" */
+		MASK_SUFFIX,
+		/** "*literal*" */
+		MASK_INFIX,
+		/** Only stars, matches everything */
+		MASK_ANY,
+		/** Anything else, matched by the backtracking matcher */
+		MASK_GENERAL
+	};
+
+ private:
+	/** The mask as given
+	 */
+	std::string mask;
+
+	/** The literal part of the mask, folded through the case map
+	 */
+	std::string literal;
+
+	/** The case map the literal was folded with
+	 */
+	unsigned const char* map;
+
+	/** True if the mask was compiled with the national case map, which modules can change.
+	 * The compiled form is not used once the national map has changed since it was compiled.
+	 */
+	bool national;
+
+	/** The value of national_case_insensitive_map_version when the mask was compiled
+	 */
+	unsigned int mapversion;
+
+	MaskKind kind;
+
+	/** Position in the literal of a character that only one byte folds to, or npos.
+	 * MASK_INFIX masks look for that byte with memchr() to find candidate positions.
+	 */
+	std::string::size_type anchor;
+
+	/** The only byte which folds to the character at anchor
+	 */
+	unsigned char anchorbyte;
+
+	/** True if the mask is an IP address range as used by InspIRCd::MatchCIDR()
+	 */
+	bool hascidr;
+
+	/** The range if hascidr is true
+	 */
+	irc::sockets::cidr_mask cidr;
+
+	/** Check whether the literal matches the given bytes, which must be as long as the literal
+	 */
+	bool CompareLiteral(const unsigned char* str) const;
+
+ public:
+	/** Create a mask which matches only the empty string
+	 */
+	WildcardMask();
+
+	/** Compile a mask
+	 * @param mask The glob pattern
+	 * @param casemap The case map to match with, NULL for the national case map
+	 */
+	WildcardMask(const std::string& mask, unsigned const char* casemap = NULL);
+
+	/** Replace the compiled mask
+	 * @param mask The glob pattern
+	 * @param casemap The case map to match with, NULL for the national case map
+	 */
+	void Compile(const std::string& mask, unsigned const char* casemap = NULL);
+
+	/** Match a string, like InspIRCd::Match()
+	 * @param str The string to match
+	 * @return True if the string matches the mask
+	 */
+	bool Match(const std::string& str) const;
+
+	/** Match a string as a glob or as an address in a CIDR range, like InspIRCd::MatchCIDR()
+	 * @param str The string to match
+	 * @return True if the string matches the mask
+	 */
+	bool MatchCIDR(const std::string& str) const;
+
+	/** Get the mask this was compiled from
+	 * @return The mask
+	 */
+	const std::string& GetMask() const { return mask; }
+
+	/** Get the shape of the mask
+	 * @return The kind of the mask
+	 */
+	MaskKind GetKind() const { return kind; }
+
+	/** Get the literal part of the mask, folded through the case map.
+	 * Only meaningful for MASK_EXACT, MASK_PREFIX, MASK_SUFFIX and MASK_INFIX masks.
+	 * @return The literal
+	 */
+	const std::string& GetLiteral() const { return literal; }
+};
+
+/** A ban mask of the form nick!ident\@host compiled for Channel::CheckBan()
+ */
+struct CoreExport BanMask
+{
+	/** False if the mask can never match a user as a plain ban, such as an extban
+	 */
+	bool valid;
+
+	/** The part of the mask before the first '@', matched against "nick!ident"
+	 */
+	WildcardMask nickident;
+
+	/** The part of the mask after the first '@', matched against the hosts and the IP address
+	 */
+	WildcardMask host;
+
+	BanMask() : valid(false) { }
+
+	/** Compile a ban mask
+	 * @param mask The mask
+	 */
+	BanMask(const std::string& mask) { Compile(mask); }
+
+	/** Replace the compiled mask
+	 * @param mask The mask
+	 */
+	void Compile(const std::string& mask);
+};
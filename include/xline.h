@@ -159,6 +159,7 @@ class CoreExport KLine : public XLine
 	 */
 	KLine(time_t s_time, long d, std::string src, std::string re, std::string ident, std::string host)
 		: XLine(s_time, d, src, re, "K"), identmask(ident), hostmask(host)
+		, identpattern(ident, ascii_case_insensitive_map), hostpattern(host, ascii_case_insensitive_map)
 	{
 		matchtext = this->identmask;
 		matchtext.append("@").append(this->hostmask);
@@ -187,6 +188,14 @@ class CoreExport KLine : public XLine
 	 */
 	std::string hostmask;
 
+	/** identmask compiled for matching
+	 */
+	WildcardMask identpattern;
+
+	/** hostmask compiled for matching
+	 */
+	WildcardMask hostpattern;
+
 	std::string matchtext;
 };
 
@@ -205,6 +214,7 @@ class CoreExport GLine : public XLine
 	 */
 	GLine(time_t s_time, long d, std::string src, std::string re, std::string ident, std::string host)
 		: XLine(s_time, d, src, re, "G"), identmask(ident), hostmask(host)
+		, identpattern(ident, ascii_case_insensitive_map), hostpattern(host, ascii_case_insensitive_map)
 	{
 		matchtext = this->identmask;
 		matchtext.append("@").append(this->hostmask);
@@ -231,6 +241,14 @@ class CoreExport GLine : public XLine
 	 */
 	std::string hostmask;
 
+	/** identmask compiled for matching
+	 */
+	WildcardMask identpattern;
+
+	/** hostmask compiled for matching
+	 */
+	WildcardMask hostpattern;
+
 	std::string matchtext;
 };
 
@@ -249,6 +267,7 @@ class CoreExport ELine : public XLine
 	 */
 	ELine(time_t s_time, long d, std::string src, std::string re, std::string ident, std::string host)
 		: XLine(s_time, d, src, re, "E"), identmask(ident), hostmask(host)
+		, identpattern(ident, ascii_case_insensitive_map), hostpattern(host, ascii_case_insensitive_map)
 	{
 		matchtext = this->identmask;
 		matchtext.append("@").append(this->hostmask);
@@ -275,6 +294,14 @@ class CoreExport ELine : public XLine
 	 */
 	std::string hostmask;
 
+	/** identmask compiled for matching
+	 */
+	WildcardMask identpattern;
+
+	/** hostmask compiled for matching
+	 */
+	WildcardMask hostpattern;
+
 	std::string matchtext;
 };
 
@@ -291,7 +318,7 @@ class CoreExport ZLine : public XLine
 	 * @param ip IP to match
 	 */
 	ZLine(time_t s_time, long d, std::string src, std::string re, std::string ip)
-		: XLine(s_time, d, src, re, "Z"), ipaddr(ip)
+		: XLine(s_time, d, src, re, "Z"), ipaddr(ip), ippattern(ip)
 	{
 	}
 
@@ -312,6 +339,10 @@ class CoreExport ZLine : public XLine
 	/** IP mask (no ident part)
 	 */
 	std::string ipaddr;
+
+	/** ipaddr compiled for matching
+	 */
+	WildcardMask ippattern;
 };
 
 /** QLine class
@@ -327,7 +358,7 @@ class CoreExport QLine : public XLine
 	 * @param nickname Nickname to match
 	 */
 	QLine(time_t s_time, long d, std::string src, std::string re, std::string nickname)
-		: XLine(s_time, d, src, re, "Q"), nick(nickname)
+		: XLine(s_time, d, src, re, "Q"), nick(nickname), nickpattern(nickname)
 	{
 	}
 
@@ -347,6 +378,10 @@ class CoreExport QLine : public XLine
 	/** Nickname mask
 	 */
 	std::string nick;
+
+	/** nick compiled for matching
+	 */
+	WildcardMask nickpattern;
 };
 
 /** XLineFactory is used to generate an XLine pointer, given just the
@@ -395,9 +430,108 @@ class CoreExport XLineFactory
  * or any other line created by a module. It also manages XLineFactory classes which
  * can generate a specialized XLine for use by another module.
  */
+class TestSuite;
+
 class CoreExport XLineManager
 {
+	friend class TestSuite;
+
+ public:
+	/** Index of the lines of one of the core line types, defined in xline.cpp
+	 */
+	class Index;
+
+	/** Counters of the work done applying lines to users
+	 */
+	struct ApplyStats
+	{
+		/** Number of passes over the local users
+		 */
+		unsigned long passes;
+
+		/** Number of lines applied in those passes
+		 */
+		unsigned long lines;
+
+		/** Number of users checked in those passes
+		 */
+		unsigned long users;
+
+		/** Number of users checked in the last pass
+		 */
+		unsigned long lastusers;
+
+		ApplyStats() : passes(0), lines(0), users(0), lastusers(0) { }
+	};
+
+ private:
+	/** Runs the deferred work of the XLineManager at the end of a main loop iteration
+	 */
+	class DeferredAction : public HandlerBase0<void>
+	{
+		XLineManager* const manager;
+
+	 public:
+		DeferredAction(XLineManager* mgr) : manager(mgr) { }
+		void Call();
+	};
+
+	DeferredAction deferredaction;
+
+	/** True if deferredaction is in the action list
+	 */
+	bool deferredscheduled;
+
+	/** True if ApplyLines() was called since the pending lines were last applied
+	 */
+	bool applyrequested;
+
+	/** Ranges of the Z-lines added since the last deferred action, the negative ban cache entries
+	 * for addresses in them are stale
+	 */
+	std::vector<irc::sockets::cidr_mask> bancachestale;
+
+	/** True if a Z-line that is not an IP address or a CIDR range was added since the last
+	 * deferred action, all negative ban cache entries are stale
+	 */
+	bool bancacheflush;
+
+	ApplyStats applystats;
+
+	/** Make sure the deferred work runs at the end of this main loop iteration
+	 */
+	void ScheduleDeferred();
+
+	/** Remove stale ban cache entries and apply the pending lines if requested
+	 */
+	void RunDeferred();
+
  protected:
+	/** Indexes of the core line types, keyed by line type
+	 */
+	std::map<std::string, Index*> indexes;
+
+	/** Find the index of a line type
+	 * @param type The type of line
+	 * @return The index of the type, or NULL if lines of the type are not indexed
+	 */
+	Index* GetIndex(const std::string& type);
+
+	/** Get the number of CIDR trie nodes allocated by the index of a line type
+	 * @param type The type of line
+	 * @return The number of nodes, or 0 if lines of the type are not indexed
+	 */
+	std::size_t GetTrieSize(const std::string& type);
+
+	/** Check indexed candidate lines against a user or a pattern, expiring the expired candidates
+	 * @param container The entry of the line type in the main map
+	 * @param candidates Lines which might match
+	 * @param user The user to match against, or NULL to match against pattern
+	 * @param pattern The pattern to match against if user is NULL
+	 * @return The first matching candidate, or NULL if none of them match
+	 */
+	XLine* MatchCandidates(ContainerIter container, const std::vector<XLine*>& candidates, User* user, const std::string& pattern);
+
 	/** Used to hold XLines which have not yet been applied.
 	 */
 	std::vector<XLine *> pending_lines;
@@ -407,9 +541,9 @@ class CoreExport XLineManager
 	XLineFactMap line_factory;
 
 	/** Container of all lines, this is a map of maps which
-	 * allows for fast lookup for add/remove of a line, and
-	 * the shortest possible timed O(n) for checking a user
-	 * against a line.
+	 * allows for fast lookup for add/remove of a line. Lines of
+	 * the core types are also in an Index, which is used to check
+	 * users against them without looking at every line.
 	 */
 	XLineContainer lookup_lines;
 
@@ -503,6 +637,13 @@ class CoreExport XLineManager
 	 */
 	XLine* MatchesLine(const std::string &type, const std::string &pattern);
 
+	/** Check if a line may match an IP address in a range
+	 * @param type The type of line to look up
+	 * @param range The range of addresses
+	 * @return False if no line of the type can match an address in the range
+	 */
+	bool HasLinesWithin(const std::string& type, const irc::sockets::cidr_mask& range);
+
 	/** Expire a line given two iterators which identify it in the main map.
 	 * @param container Iterator to the first level of entries the map
 	 * @param item Iterator to the second level of entries in the map
@@ -511,10 +652,17 @@ class CoreExport XLineManager
 
 	/** Apply any new lines that are pending to be applied.
 	 * This will only apply lines in the pending_lines list, to save on
-	 * CPU time.
+	 * CPU time. The lines are applied at the end of the current main loop
+	 * iteration, in a single pass over the local users together with all
+	 * other lines added until then.
 	 */
 	void ApplyLines();
 
+	/** Get the counters of the work done applying lines to users
+	 * @return The counters
+	 */
+	const ApplyStats& GetApplyStats() const { return applystats; }
+
 	/** Handle /STATS for a given type.
 	 * NOTE: Any items in the list for this particular line type which have expired
 	 * will be expired and removed before the list is displayed.
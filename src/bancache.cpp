@@ -20,82 +20,265 @@
 
 #include "inspircd.h"
 #include "bancache.h"
+#include "xline.h"
 
-BanCacheHit *BanCacheManager::AddHit(const std::string &ip, const std::string &type, const std::string &reason, time_t seconds)
+/** Get a bit of a prefix, counting from the most significant bit
+ */
+static inline unsigned int GetBit(const irc::sockets::cidr_mask& prefix, unsigned int pos)
 {
-	BanCacheHit*& b = (*BanHash)[ip];
-	if (b != NULL) // can't have two cache entries on the same IP, sorry..
-		return NULL;
-
-	b = new BanCacheHit(type, reason, (seconds ? seconds : 86400));
-	return b;
+	return (prefix.bits[pos / 8] >> (7 - (pos % 8))) & 1;
 }
 
-BanCacheHit *BanCacheManager::GetHit(const std::string &ip)
+/** Count the leading bits two prefixes have in common, up to a maximum
+ */
+static unsigned int CommonBits(const irc::sockets::cidr_mask& a, const irc::sockets::cidr_mask& b, unsigned int max)
 {
-	BanCacheHash::iterator i = this->BanHash->find(ip);
-
-	if (i == this->BanHash->end())
-		return NULL; // free and safe
-
-	if (RemoveIfExpired(i))
-		return NULL; // expired
-
-	return i->second; // hit.
+	unsigned int pos = 0;
+	while ((pos + 8 <= max) && (a.bits[pos / 8] == b.bits[pos / 8]))
+		pos += 8;
+	while ((pos < max) && (GetBit(a, pos) == GetBit(b, pos)))
+		pos++;
+	return pos;
 }
 
-bool BanCacheManager::RemoveIfExpired(BanCacheHash::iterator& it)
+bool BanCacheManager::Filter::Matches(const BanCacheHit& hit) const
 {
-	if (ServerInstance->Time() < it->second->Expiry)
+	if (ServerInstance->Time() >= hit.Expiry)
+		return true;
+
+	if (!type)
 		return false;
 
-	ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "Hit on " + it->first + " is out of date, removing!");
-	delete it->second;
-	it = BanHash->erase(it);
-	return true;
+	// when removing positive hits, remove only if the type matches,
+	// when removing negative hits, remove all of them
+	if (positive)
+		return (hit.IsPositive() && (hit.Type == *type));
+	return !hit.IsPositive();
 }
 
-void BanCacheManager::RemoveEntries(const std::string& type, bool positive)
+unsigned int BanCacheManager::NewNode(const irc::sockets::cidr_mask& prefix)
 {
-	if (positive)
-		ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCacheManager::RemoveEntries(): Removing positive hits for " + type);
+	unsigned int node;
+	if (freenodes.empty())
+	{
+		node = nodes.size();
+		nodes.push_back(Node());
+	}
 	else
-		ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCacheManager::RemoveEntries(): Removing all negative hits");
-
-	for (BanCacheHash::iterator i = BanHash->begin(); i != BanHash->end(); )
 	{
-		if (RemoveIfExpired(i))
-			continue; // updates the iterator if expired
+		node = freenodes.back();
+		freenodes.pop_back();
+	}
 
-		BanCacheHit* b = i->second;
-		bool remove = false;
+	nodes[node].prefix = prefix;
+	return node;
+}
 
-		if (positive)
+void BanCacheManager::FreeNode(unsigned int node)
+{
+	Node& entry = nodes[node];
+	entry.child[0] = entry.child[1] = 0;
+	entry.used = false;
+	entry.hit = BanCacheHit();
+	freenodes.push_back(node);
+}
+
+unsigned int BanCacheManager::Insert(const irc::sockets::cidr_mask& prefix)
+{
+	unsigned int parent = 0;
+	unsigned int bit = 0;
+	while (true)
+	{
+		const unsigned int curr = Link(prefix.type, parent, bit);
+		if (!curr)
 		{
-			// when removing positive hits, remove only if the type matches
-			remove = b->IsPositive() && (b->Type == type);
+			const unsigned int leaf = NewNode(prefix);
+			Link(prefix.type, parent, bit) = leaf;
+			return leaf;
 		}
-		else
+
+		const unsigned int currlen = nodes[curr].prefix.length;
+		const unsigned int common = CommonBits(nodes[curr].prefix, prefix, std::min<unsigned int>(currlen, prefix.length));
+		if (common == currlen)
 		{
-			// when removing negative hits, remove all of them
-			remove = !b->IsPositive();
+			if (currlen == prefix.length)
+				return curr;
+
+			parent = curr;
+			bit = GetBit(prefix, currlen);
+			continue;
 		}
 
-		if (remove)
+		// The prefix ends or differs within the prefix of curr, add a node where they split
+		irc::sockets::cidr_mask splitprefix(prefix);
+		splitprefix.length = common;
+		for (unsigned int i = common; i < prefix.length; i++)
+			splitprefix.bits[i / 8] &= ~(0x80 >> (i % 8));
+
+		const unsigned int split = NewNode(splitprefix);
+		nodes[split].child[GetBit(nodes[curr].prefix, common)] = curr;
+		Link(prefix.type, parent, bit) = split;
+		if (common == prefix.length)
+			return split;
+
+		const unsigned int leaf = NewNode(prefix);
+		nodes[split].child[GetBit(prefix, common)] = leaf;
+		return leaf;
+	}
+}
+
+void BanCacheManager::Compact(unsigned int& link)
+{
+	const Node& node = nodes[link];
+	if ((node.used) || ((node.child[0]) && (node.child[1])))
+		return;
+
+	const unsigned int next = (node.child[0] ? node.child[0] : node.child[1]);
+	FreeNode(link);
+	link = next;
+}
+
+void BanCacheManager::Prune(unsigned int& link, const Filter& filter)
+{
+	if (!link)
+		return;
+
+	Prune(nodes[link].child[0], filter);
+	Prune(nodes[link].child[1], filter);
+
+	Node& node = nodes[link];
+	if ((node.used) && (filter.Matches(node.hit)))
+	{
+		ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCacheManager::RemoveEntries(): Removing a hit on " + node.prefix.str());
+		node.used = false;
+		node.hit = BanCacheHit();
+	}
+	Compact(link);
+}
+
+void BanCacheManager::PruneRange(unsigned int& link, const irc::sockets::cidr_mask& range, const Filter& filter)
+{
+	if (!link)
+		return;
+
+	Node& node = nodes[link];
+	const unsigned int len = std::min(node.prefix.length, range.length);
+	if (CommonBits(node.prefix, range, len) < len)
+		return;
+
+	if (node.prefix.length >= range.length)
+	{
+		Prune(link, filter);
+		return;
+	}
+
+	// The node covers the range
+	PruneRange(node.child[GetBit(range, node.prefix.length)], range, filter);
+	if ((node.used) && (filter.Matches(node.hit)))
+	{
+		ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCacheManager::RemoveEntries(): Removing a hit on " + node.prefix.str());
+		node.used = false;
+		node.hit = BanCacheHit();
+	}
+	Compact(link);
+}
+
+BanCacheHit *BanCacheManager::AddHit(const irc::sockets::sockaddrs& ip, const std::string &type, const std::string &reason, time_t seconds)
+{
+	irc::sockets::cidr_mask prefix(ip, 128);
+	if ((prefix.type != AF_INET) && (prefix.type != AF_INET6))
+		return NULL;
+
+	if (type.empty())
+	{
+		// Cache negative hits for the whole configured range, unless a Z-line may match in it
+		const int range = (prefix.type == AF_INET ? ServerInstance->Config->c_ipv4_bancache : ServerInstance->Config->c_ipv6_bancache);
+		if (range < prefix.length)
 		{
-			/* we need to remove this one. */
-			ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCacheManager::RemoveEntries(): Removing a hit on " + i->first);
-			delete b;
-			i = BanHash->erase(i);
+			irc::sockets::cidr_mask widened(ip, range);
+			if (!ServerInstance->XLines->HasLinesWithin("Z", widened))
+				prefix = widened;
 		}
-		else
-			++i;
 	}
+
+	Node& node = nodes[Insert(prefix)];
+	if ((node.used) && (ServerInstance->Time() < node.hit.Expiry)) // can't have two cache entries on the same prefix, sorry..
+		return NULL;
+
+	node.used = true;
+	node.hit = BanCacheHit(type, reason, (seconds ? seconds : 86400));
+	return &node.hit;
+}
+
+BanCacheHit *BanCacheManager::AddHit(const std::string &ip, const std::string &type, const std::string &reason, time_t seconds)
+{
+	irc::sockets::sockaddrs sa;
+	if (!irc::sockets::aptosa(ip, 0, sa))
+		return NULL;
+	return AddHit(sa, type, reason, seconds);
+}
+
+BanCacheHit *BanCacheManager::GetHit(const irc::sockets::sockaddrs& ip)
+{
+	const irc::sockets::cidr_mask addr(ip, 128);
+	if ((addr.type != AF_INET) && (addr.type != AF_INET6))
+		return NULL;
+
+	unsigned int best = 0;
+	for (unsigned int curr = Root(addr.type); curr; )
+	{
+		const Node& node = nodes[curr];
+		if ((node.prefix.length > addr.length) || (CommonBits(node.prefix, addr, node.prefix.length) < node.prefix.length))
+			break;
+
+		if (node.used)
+			best = curr;
+
+		if (node.prefix.length == addr.length)
+			break;
+		curr = node.child[GetBit(addr, node.prefix.length)];
+	}
+
+	if (!best)
+		return NULL; // free and safe
+
+	if (ServerInstance->Time() >= nodes[best].hit.Expiry)
+	{
+		// Remove it and use the entry of a shorter prefix, if there is one
+		ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "Hit on " + nodes[best].prefix.str() + " is out of date, removing!");
+		const irc::sockets::cidr_mask expired = nodes[best].prefix;
+		Filter filter = { NULL, false };
+		PruneRange(Root(addr.type), expired, filter);
+		return GetHit(ip);
+	}
+
+	return &nodes[best].hit; // hit.
 }
 
-BanCacheManager::~BanCacheManager()
+BanCacheHit *BanCacheManager::GetHit(const std::string &ip)
+{
+	irc::sockets::sockaddrs sa;
+	if (!irc::sockets::aptosa(ip, 0, sa))
+		return NULL;
+	return GetHit(sa);
+}
+
+void BanCacheManager::RemoveEntries(const std::string& type, bool positive, const irc::sockets::cidr_mask* range)
 {
-	for (BanCacheHash::iterator n = BanHash->begin(); n != BanHash->end(); ++n)
-		delete n->second;
-	delete BanHash;
+	const std::string where = (range ? " in " + range->str() : "");
+	if (positive)
+		ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCacheManager::RemoveEntries(): Removing positive hits for " + type + where);
+	else
+		ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCacheManager::RemoveEntries(): Removing all negative hits" + where);
+
+	Filter filter = { &type, positive };
+	if (range)
+	{
+		if ((range->type == AF_INET) || (range->type == AF_INET6))
+			PruneRange(Root(range->type), *range, filter);
+		return;
+	}
+
+	Prune(root4, filter);
+	Prune(root6, filter);
 }
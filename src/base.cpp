@@ -89,46 +89,76 @@ ServiceProvider::~ServiceProvider()
 {
 }
 
-ExtensionItem::ExtensionItem(const std::string& Key, Module* mod) : ServiceProvider(mod, Key, SERVICE_METADATA)
+namespace
+{
+	/** Existing extension items by slot, NULL for free slots
+	 */
+	std::vector<ExtensionItem*>& GetExtensionSlots()
+	{
+		// Extension items can be static objects, so this is created on first use
+		static std::vector<ExtensionItem*> slots;
+		return slots;
+	}
+
+	/** Assign the first free slot to an extension item
+	 * @param item The item
+	 * @return The slot of the item
+	 */
+	size_t AllocateExtensionSlot(ExtensionItem* item)
+	{
+		std::vector<ExtensionItem*>& slots = GetExtensionSlots();
+		std::vector<ExtensionItem*>::iterator free = std::find(slots.begin(), slots.end(), static_cast<ExtensionItem*>(NULL));
+		if (free == slots.end())
+		{
+			slots.push_back(item);
+			return slots.size() - 1;
+		}
+		*free = item;
+		return free - slots.begin();
+	}
+}
+
+ExtensionItem::ExtensionItem(const std::string& Key, Module* mod)
+	: ServiceProvider(mod, Key, SERVICE_METADATA)
+	, slot(AllocateExtensionSlot(this))
 {
 }
 
 ExtensionItem::~ExtensionItem()
 {
+	GetExtensionSlots()[slot] = NULL;
 }
 
 void* ExtensionItem::get_raw(const Extensible* container) const
 {
-	Extensible::ExtensibleStore::const_iterator i =
-		container->extensions.find(const_cast<ExtensionItem*>(this));
-	if (i == container->extensions.end())
+	if (slot >= container->extensionslots)
 		return NULL;
-	return i->second;
+	return container->extensions[slot];
 }
 
 void* ExtensionItem::set_raw(Extensible* container, void* value)
 {
-	std::pair<Extensible::ExtensibleStore::iterator,bool> rv =
-		container->extensions.insert(std::make_pair(this, value));
-	if (rv.second)
+	if (slot >= container->extensionslots)
 	{
-		return NULL;
-	}
-	else
-	{
-		void* old = rv.first->second;
-		rv.first->second = value;
-		return old;
+		void** extensions = new void*[slot + 1];
+		std::copy(container->extensions, container->extensions + container->extensionslots, extensions);
+		std::fill(extensions + container->extensionslots, extensions + slot + 1, static_cast<void*>(NULL));
+		delete[] container->extensions;
+		container->extensions = extensions;
+		container->extensionslots = slot + 1;
 	}
+
+	void* old = container->extensions[slot];
+	container->extensions[slot] = value;
+	return old;
 }
 
 void* ExtensionItem::unset_raw(Extensible* container)
 {
-	Extensible::ExtensibleStore::iterator i = container->extensions.find(this);
-	if (i == container->extensions.end())
+	if (slot >= container->extensionslots)
 		return NULL;
-	void* rv = i->second;
-	container->extensions.erase(i);
+	void* rv = container->extensions[slot];
+	container->extensions[slot] = NULL;
 	return rv;
 }
 
@@ -165,24 +195,29 @@ void Extensible::doUnhookExtensions(const std::vector<reference<ExtensionItem> >
 	for(std::vector<reference<ExtensionItem> >::const_iterator i = toRemove.begin(); i != toRemove.end(); ++i)
 	{
 		ExtensionItem* item = *i;
-		ExtensibleStore::iterator e = extensions.find(item);
-		if (e != extensions.end())
+		if ((item->slot < extensionslots) && (extensions[item->slot]))
 		{
-			item->free(e->second);
-			extensions.erase(e);
+			item->free(extensions[item->slot]);
+			extensions[item->slot] = NULL;
 		}
 	}
 }
 
-static struct DummyExtensionItem : LocalExtItem
+Extensible::Extensible()
+	: extensions(NULL), extensionslots(0)
 {
-	DummyExtensionItem() : LocalExtItem("", NULL) {}
-	void free(void*) {}
-} dummy;
+}
 
-Extensible::Extensible()
+Extensible::ExtensibleStore Extensible::GetExtList() const
 {
-	extensions[&dummy] = NULL;
+	ExtensibleStore list;
+	const std::vector<ExtensionItem*>& slots = GetExtensionSlots();
+	for (size_t i = 0; i < extensionslots; ++i)
+	{
+		if (extensions[i])
+			list.push_back(std::make_pair(slots[i], extensions[i]));
+	}
+	return list;
 }
 
 CullResult Extensible::cull()
@@ -193,16 +228,20 @@ CullResult Extensible::cull()
 
 void Extensible::FreeAllExtItems()
 {
-	for(ExtensibleStore::iterator i = extensions.begin(); i != extensions.end(); ++i)
+	const std::vector<ExtensionItem*>& slots = GetExtensionSlots();
+	for (size_t i = 0; i < extensionslots; ++i)
 	{
-		i->first->free(i->second);
+		if (extensions[i])
+			slots[i]->free(extensions[i]);
 	}
-	extensions.clear();
+	delete[] extensions;
+	extensions = NULL;
+	extensionslots = 0;
 }
 
 Extensible::~Extensible()
 {
-	if (!extensions.empty() && ServerInstance && ServerInstance->Logs)
+	if (extensions && ServerInstance && ServerInstance->Logs)
 		ServerInstance->Logs->Log("CULLLIST", LOG_DEBUG, "Extensible destructor called without cull @%p", (void*)this);
 }
 
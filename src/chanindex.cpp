@@ -0,0 +1,99 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+
+unsigned int ChannelIndex::GetSizeBucket(size_t users)
+{
+	unsigned int bucket = 0;
+	while (users)
+	{
+		bucket++;
+		users >>= 1;
+	}
+	return bucket;
+}
+
+void ChannelIndex::Add(Channel* chan)
+{
+	sizebuckets[GetSizeBucket(chan->GetUserCounter())].push_front(chan);
+	byage.insert(std::make_pair(chan->age, chan));
+}
+
+void ChannelIndex::Remove(Channel* chan)
+{
+	sizebuckets[GetSizeBucket(chan->GetUserCounter())].erase(chan);
+
+	std::pair<AgeMap::iterator, AgeMap::iterator> range = byage.equal_range(chan->age);
+	for (AgeMap::iterator i = range.first; i != range.second; ++i)
+	{
+		if (i->second == chan)
+		{
+			byage.erase(i);
+			return;
+		}
+	}
+
+	// The creation time was changed without going through ChangeAge()
+	ServerInstance->Logs->Log("CHANNELS", LOG_DEFAULT, "ERROR: Channel index has no entry for %s at %lu, searching all entries", chan->name.c_str(), (unsigned long)chan->age);
+	for (AgeMap::iterator i = byage.begin(); i != byage.end(); ++i)
+	{
+		if (i->second == chan)
+		{
+			byage.erase(i);
+			return;
+		}
+	}
+}
+
+void ChannelIndex::ChangeSize(Channel* chan, size_t oldsize)
+{
+	unsigned int oldbucket = GetSizeBucket(oldsize);
+	unsigned int newbucket = GetSizeBucket(chan->GetUserCounter());
+	if (oldbucket == newbucket)
+		return;
+
+	sizebuckets[oldbucket].erase(chan);
+	sizebuckets[newbucket].push_front(chan);
+}
+
+void ChannelIndex::ChangeAge(Channel* chan, time_t age)
+{
+	Remove(chan);
+	chan->age = age;
+	Add(chan);
+}
+
+void ChannelIndex::FindBySize(size_t minusers, size_t maxusers, std::vector<Channel*>& out) const
+{
+	if (minusers > maxusers)
+		return;
+
+	unsigned int last = GetSizeBucket(maxusers);
+	for (unsigned int bucket = GetSizeBucket(minusers); bucket <= last; ++bucket)
+		out.insert(out.end(), sizebuckets[bucket].begin(), sizebuckets[bucket].end());
+}
+
+void ChannelIndex::FindByAge(time_t from, time_t to, std::vector<Channel*>& out) const
+{
+	if (from > to)
+		return;
+
+	AgeMap::const_iterator end = byage.upper_bound(to);
+	for (AgeMap::const_iterator i = byage.lower_bound(from); i != end; ++i)
+		out.push_back(i->second);
+}
@@ -37,13 +37,83 @@ namespace
 	ChanModeReference secretmode(NULL, "secret");
 	ChanModeReference privatemode(NULL, "private");
 	UserModeReference invisiblemode(NULL, "invisible");
+
+	/** Bit of the IsBanned() verdict in Membership::BanCache
+	 */
+	const uint64_t BANNED_BIT = static_cast<uint64_t>(1) << 63;
+
+	/** Get the bit of an extban type in Membership::BanCache
+	 * @param type The extban type
+	 * @return The bit of the type or 0 if verdicts of this type are not cached
+	 */
+	uint64_t ExtBanBit(char type)
+	{
+		if ((type < 'A') || (type > 'z'))
+			return 0;
+		return static_cast<uint64_t>(1) << (type - 'A');
+	}
+
+	/** Look up a cached ban verdict of a member, dropping all cached verdicts of the member if they are outdated
+	 * @param memb The member to look up the verdict for
+	 * @param bit The bit of the verdict
+	 * @param result Set to the verdict if it is cached
+	 * @return True if the verdict is cached
+	 */
+	bool GetCachedBanVerdict(Membership* memb, uint64_t bit, ModResult& result)
+	{
+		Membership::BanCache& cache = memb->bancache;
+		if ((cache.chanversion != memb->chan->GetBanVersion()) || (cache.userversion != memb->user->GetBanVersion()))
+		{
+			cache.chanversion = memb->chan->GetBanVersion();
+			cache.userversion = memb->user->GetBanVersion();
+			cache.cached = cache.denied = cache.allowed = 0;
+			return false;
+		}
+
+		if (!(cache.cached & bit))
+			return false;
+
+		if (cache.denied & bit)
+			result = MOD_RES_DENY;
+		else if (cache.allowed & bit)
+			result = MOD_RES_ALLOW;
+		else
+			result = MOD_RES_PASSTHRU;
+		return true;
+	}
+
+	/** Cache a ban verdict of a member.
+	 * Nothing is cached if the ban versions changed since GetCachedBanVerdict() was called.
+	 * @param memb The member to cache the verdict for
+	 * @param bit The bit of the verdict
+	 * @param result The verdict
+	 */
+	void SetCachedBanVerdict(Membership* memb, uint64_t bit, ModResult result)
+	{
+		Membership::BanCache& cache = memb->bancache;
+		if ((cache.chanversion != memb->chan->GetBanVersion()) || (cache.userversion != memb->user->GetBanVersion()))
+			return;
+
+		cache.cached |= bit;
+		if (result == MOD_RES_DENY)
+			cache.denied |= bit;
+		else if (result == MOD_RES_ALLOW)
+			cache.allowed |= bit;
+	}
 }
 
 Channel::Channel(const std::string &cname, time_t ts)
-	: name(cname), age(ts), topicset(0)
+	: localmemberversion(0), banversion(0), name(cname), age(ts), topicset(0)
 {
 	if (!ServerInstance->chanlist->insert(std::make_pair(cname, this)).second)
 		throw CoreException("Cannot create duplicate channel " + cname);
+	ServerInstance->ChanIndex.Add(this);
+}
+
+CullResult Channel::cull()
+{
+	ServerInstance->ChanIndex.Remove(this);
+	return Extensible::cull();
 }
 
 void Channel::SetMode(ModeHandler* mh, bool on)
@@ -86,14 +156,51 @@ void Channel::SetTopic(User* u, const std::string& ntopic)
 
 Membership* Channel::AddUser(User* user)
 {
-	Membership*& memb = userlist[user];
-	if (memb)
+	if (userlist.find(user) != userlist.end())
 		return NULL;
 
-	memb = new Membership(user, this);
+	Membership* memb = new Membership(user, this);
+	userlist.insert(user, memb);
+	ServerInstance->ChanIndex.ChangeSize(this, userlist.size() - 1);
+	if (IS_LOCAL(user))
+	{
+		AddLocalMember(memb, 0);
+		localmemberversion++;
+	}
+	user->InvalidateNeighbors();
+	// Extbans can match on the channels of a user
+	user->InvalidateBanCache();
 	return memb;
 }
 
+void Channel::AddLocalMember(Membership* memb, unsigned int rank)
+{
+	std::vector<Membership*>& bucket = localmembers[rank];
+	memb->bucketrank = rank;
+	memb->bucketpos = bucket.size();
+	bucket.push_back(memb);
+}
+
+void Channel::DelLocalMember(Membership* memb)
+{
+	// Move the last membership of the bucket into the place of the removed one
+	std::vector<Membership*>& bucket = localmembers[memb->bucketrank];
+	Membership* last = bucket.back();
+	bucket[memb->bucketpos] = last;
+	last->bucketpos = memb->bucketpos;
+	bucket.pop_back();
+}
+
+void Channel::UpdateLocalMember(Membership* memb)
+{
+	unsigned int rank = memb->getRank();
+	if (rank == memb->bucketrank)
+		return;
+
+	DelLocalMember(memb);
+	AddLocalMember(memb, rank);
+}
+
 void Channel::DelUser(User* user)
 {
 	UserMembIter it = userlist.find(user);
@@ -126,9 +233,17 @@ void Channel::CheckDestroy()
 void Channel::DelUser(const UserMembIter& membiter)
 {
 	Membership* memb = membiter->second;
+	if (IS_LOCAL(memb->user))
+	{
+		DelLocalMember(memb);
+		localmemberversion++;
+	}
+	memb->user->InvalidateNeighbors();
+	memb->user->InvalidateBanCache();
 	memb->cull();
 	delete memb;
 	userlist.erase(membiter);
+	ServerInstance->ChanIndex.ChangeSize(this, userlist.size() + 1);
 
 	// If this channel became empty then it should be removed
 	CheckDestroy();
@@ -381,23 +496,33 @@ void Channel::ForceJoin(User* user, const std::string* privs, bool bursting, boo
 
 bool Channel::IsBanned(User* user)
 {
+	Membership* memb = GetUser(user);
 	ModResult result;
-	FIRST_MOD_RESULT(OnCheckChannelBan, result, (user, this));
-
-	if (result != MOD_RES_PASSTHRU)
+	if (memb && GetCachedBanVerdict(memb, BANNED_BIT, result))
 		return (result == MOD_RES_DENY);
 
-	ListModeBase* banlm = static_cast<ListModeBase*>(*ban);
-	const ListModeBase::ModeList* bans = banlm->GetList(this);
-	if (bans)
+	FIRST_MOD_RESULT(OnCheckChannelBan, result, (user, this));
+
+	if (result == MOD_RES_PASSTHRU)
 	{
-		for (ListModeBase::ModeList::const_iterator it = bans->begin(); it != bans->end(); it++)
+		ListModeBase* banlm = static_cast<ListModeBase*>(*ban);
+		const ListModeBase::ModeList* bans = banlm->GetList(this);
+		if (bans)
 		{
-			if (CheckBan(user, it->mask))
-				return true;
+			for (ListModeBase::ModeList::const_iterator it = bans->begin(); it != bans->end(); it++)
+			{
+				if (CheckBan(user, it->mask, it->banmask))
+				{
+					result = MOD_RES_DENY;
+					break;
+				}
+			}
 		}
 	}
-	return false;
+
+	if (memb)
+		SetCachedBanVerdict(memb, BANNED_BIT, result);
+	return (result == MOD_RES_DENY);
 }
 
 bool Channel::CheckBan(User* user, const std::string& mask)
@@ -415,6 +540,7 @@ bool Channel::CheckBan(User* user, const std::string& mask)
 	if (at == std::string::npos)
 		return false;
 
+	// A mask that is only checked once is cheaper to match directly than to compile
 	const std::string nickIdent = user->nick + "!" + user->ident;
 	std::string prefix = mask.substr(0, at);
 	if (InspIRCd::Match(nickIdent, prefix, NULL))
@@ -428,24 +554,59 @@ bool Channel::CheckBan(User* user, const std::string& mask)
 	return false;
 }
 
+bool Channel::CheckBan(User* user, const std::string& mask, const BanMask& compiled)
+{
+	ModResult result;
+	FIRST_MOD_RESULT(OnCheckBan, result, (user, this, mask));
+	if (result != MOD_RES_PASSTHRU)
+		return (result == MOD_RES_DENY);
+
+	// extbans were handled above, if this is one it obviously didn't match
+	if (!compiled.valid)
+		return false;
+
+	const std::string nickIdent = user->nick + "!" + user->ident;
+	if (compiled.nickident.Match(nickIdent))
+	{
+		if (compiled.host.Match(user->host) ||
+			compiled.host.Match(user->dhost) ||
+			compiled.host.MatchCIDR(user->GetIPString()))
+			return true;
+	}
+	return false;
+}
+
 ModResult Channel::GetExtBanStatus(User *user, char type)
 {
+	Membership* memb = GetUser(user);
+	const uint64_t bit = ExtBanBit(type);
 	ModResult rv;
-	FIRST_MOD_RESULT(OnExtBanCheck, rv, (user, this, type));
-	if (rv != MOD_RES_PASSTHRU)
+	if (memb && bit && GetCachedBanVerdict(memb, bit, rv))
 		return rv;
 
-	ListModeBase* banlm = static_cast<ListModeBase*>(*ban);
-	const ListModeBase::ModeList* bans = banlm->GetList(this);
-	if (bans)
+	FIRST_MOD_RESULT(OnExtBanCheck, rv, (user, this, type));
+
+	if (rv == MOD_RES_PASSTHRU)
 	{
-		for (ListModeBase::ModeList::const_iterator it = bans->begin(); it != bans->end(); ++it)
+		// Only the extbans of this type, such as "m:nick!*@*" for 'm', are relevant
+		ListModeBase* banlm = static_cast<ListModeBase*>(*ban);
+		const ListModeBase::ExtBanList* extbans = banlm->GetExtBans(this, type);
+		if (extbans)
 		{
-			if (CheckBan(user, it->mask))
-				return MOD_RES_DENY;
+			for (ListModeBase::ExtBanList::const_iterator it = extbans->begin(); it != extbans->end(); ++it)
+			{
+				if (CheckBan(user, it->mask, it->banmask))
+				{
+					rv = MOD_RES_DENY;
+					break;
+				}
+			}
 		}
 	}
-	return MOD_RES_PASSTHRU;
+
+	if (memb && bit)
+		SetCachedBanVerdict(memb, bit, rv);
+	return rv;
 }
 
 /* Channel::PartUser
@@ -532,13 +693,8 @@ void Channel::WriteChannel(User* user, const char* text, ...)
 
 void Channel::WriteChannel(User* user, const std::string &text)
 {
-	const std::string message = ":" + user->GetFullHost() + " " + text;
-
-	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
-	{
-		if (IS_LOCAL(i->first))
-			i->first->Write(message);
-	}
+	reference<SharedMessage> message = LocalUser::MakeSharedLine(":" + user->GetFullHost() + " " + text);
+	WriteLocalMembers(0, CUList(), message);
 }
 
 void Channel::WriteChannelWithServ(const std::string& ServName, const char* text, ...)
@@ -550,13 +706,8 @@ void Channel::WriteChannelWithServ(const std::string& ServName, const char* text
 
 void Channel::WriteChannelWithServ(const std::string& ServName, const std::string &text)
 {
-	const std::string message = ":" + (ServName.empty() ? ServerInstance->Config->ServerName : ServName) + " " + text;
-
-	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
-	{
-		if (IS_LOCAL(i->first))
-			i->first->Write(message);
-	}
+	reference<SharedMessage> message = LocalUser::MakeSharedLine(":" + (ServName.empty() ? ServerInstance->Config->ServerName : ServName) + " " + text);
+	WriteLocalMembers(0, CUList(), message);
 }
 
 /* write formatted text from a source user to all users on a channel except
@@ -591,15 +742,31 @@ void Channel::RawWriteAllExcept(User* user, bool serversource, char status, CULi
 		if (mh)
 			minrank = mh->GetPrefixRank();
 	}
-	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
+	reference<SharedMessage> message = LocalUser::MakeSharedLine(out);
+	WriteLocalMembers(minrank, except_list, message);
+}
+
+void Channel::WriteLocalMembers(unsigned int minrank, const CUList& except_list, const reference<SharedMessage>& message)
+{
+	// The common cases are no exceptions or only the source being excepted,
+	// handle them without looking up every member in the list
+	User* const except = (except_list.size() == 1 ? *except_list.begin() : NULL);
+	const bool checklist = (except_list.size() > 1);
+
+	for (LocalMemberBuckets::const_iterator b = localmembers.begin(); b != localmembers.end(); ++b)
 	{
-		if (IS_LOCAL(i->first) && (except_list.find(i->first) == except_list.end()))
+		/* The remaining buckets don't have the status we're after */
+		if (b->first < minrank)
+			break;
+
+		const std::vector<Membership*>& bucket = b->second;
+		for (std::vector<Membership*>::const_iterator i = bucket.begin(); i != bucket.end(); ++i)
 		{
-			/* User doesn't have the status we're after */
-			if (minrank && i->second->getRank() < minrank)
+			User* const u = (*i)->user;
+			if ((u == except) || ((checklist) && (except_list.count(u))))
 				continue;
 
-			i->first->Write(out);
+			static_cast<LocalUser*>(u)->Write(message);
 		}
 	}
 }
@@ -788,6 +955,8 @@ unsigned int Channel::GetPrefixValue(User* user)
 
 bool Membership::SetPrefix(PrefixMode* delta_mh, bool adding)
 {
+	// Extbans can match on the status of a user in other channels
+	user->InvalidateBanCache();
 	char prefix = delta_mh->GetModeChar();
 	for (unsigned int i = 0; i < modes.length(); i++)
 	{
@@ -798,11 +967,15 @@ bool Membership::SetPrefix(PrefixMode* delta_mh, bool adding)
 			modes = modes.substr(0,i) +
 				(adding ? std::string(1, prefix) : "") +
 				modes.substr(mchar == prefix ? i+1 : i);
+			if (IS_LOCAL(user))
+				chan->UpdateLocalMember(this);
 			return adding != (mchar == prefix);
 		}
 	}
 	if (adding)
 		modes.push_back(prefix);
+	if ((adding) && (IS_LOCAL(user)))
+		chan->UpdateLocalMember(this);
 	return adding;
 }
 
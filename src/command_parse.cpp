@@ -161,24 +161,36 @@ CmdResult CommandParser::CallHandler(const std::string& commandname, const std::
 
 void CommandParser::ProcessCommand(LocalUser *user, std::string &cmd)
 {
-	std::vector<std::string> command_p;
-	irc::tokenstream tokens(cmd);
-	std::string command, token;
-	tokens.GetToken(command);
+	if (depth == buffers.size())
+		buffers.push_back(LineBuffers());
+	LineBuffers& buf = buffers[depth];
 
-	/* A client sent a nick prefix on their command (ick)
+	/* A client may send a nick prefix on their command (ick)
 	 * rhapsody and some braindead bouncers do this --
 	 * the rfc says they shouldnt but also says the ircd should
-	 * discard it if they do.
+	 * discard it if they do. The tokenizer splits it off along
+	 * with any message tags, neither is used at the moment.
 	 */
-	if (command[0] == ':')
-		tokens.GetToken(command);
+	buf.tokenizer.Parse(cmd);
+	buf.command.assign(buf.tokenizer.command.data, buf.tokenizer.command.length);
+	std::transform(buf.command.begin(), buf.command.end(), buf.command.begin(), ::toupper);
+	buf.tokenizer.GetParameters(buf.params);
 
-	while (tokens.GetToken(token))
-		command_p.push_back(token);
-
-	std::transform(command.begin(), command.end(), command.begin(), ::toupper);
+	depth++;
+	try
+	{
+		ProcessCommand(user, cmd, buf.command, buf.params);
+	}
+	catch (...)
+	{
+		depth--;
+		throw;
+	}
+	depth--;
+}
 
+void CommandParser::ProcessCommand(LocalUser* user, std::string& cmd, std::string& command, std::vector<std::string>& command_p)
+{
 	/* find the command, check it exists */
 	Command* handler = GetHandler(command);
 
@@ -341,8 +353,9 @@ void CommandParser::ProcessBuffer(std::string &buffer,LocalUser *user)
 	if (buffer.empty())
 		return;
 
-	ServerInstance->Logs->Log("USERINPUT", LOG_RAWIO, "C[%s] I :%s %s",
-		user->uuid.c_str(), user->nick.c_str(), buffer.c_str());
+	if (ServerInstance->Config->RawLog)
+		ServerInstance->Logs->Log("USERINPUT", LOG_RAWIO, "C[%s] I :%s %s",
+			user->uuid.c_str(), user->nick.c_str(), buffer.c_str());
 	ProcessCommand(user,buffer);
 }
 
@@ -358,6 +371,7 @@ bool CommandParser::AddCommand(Command *f)
 }
 
 CommandParser::CommandParser()
+	: depth(0)
 {
 }
 
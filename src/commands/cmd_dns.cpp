@@ -394,19 +394,226 @@ class Packet : public Query
 	}
 };
 
-class MyManager : public Manager, public Timer, public EventHandler
+class MyManager;
+
+/** A nameserver, with the UDP socket queries are sent to it on
+ */
+class Upstream : public EventHandler
 {
-	typedef TR1NS::unordered_map<Question, Query, Question::hash> cache_map;
-	cache_map cache;
+	MyManager* const manager;
+
+ public:
+	/** Address and port of the nameserver
+	 */
+	irc::sockets::sockaddrs addr;
+
+	/** Number of queries in a row that the nameserver did not answer
+	 */
+	unsigned int failures;
+
+	/** While this is in the future, the nameserver is only used if no other one is available
+	 */
+	time_t downuntil;
+
+	Upstream(MyManager* mgr, const irc::sockets::sockaddrs& server)
+		: manager(mgr)
+		, addr(server)
+		, failures(0)
+		, downuntil(0)
+	{
+	}
+
+	~Upstream()
+	{
+		if (this->GetFd() > -1)
+		{
+			ServerInstance->SE->DelFd(this);
+			ServerInstance->SE->Shutdown(this, 2);
+			ServerInstance->SE->Close(this);
+		}
+	}
+
+	/** Create and bind the socket
+	 * @return True if the nameserver can be used
+	 */
+	bool Open()
+	{
+		int s = socket(addr.sa.sa_family, SOCK_DGRAM, 0);
+		this->SetFd(s);
+		if (s == -1)
+		{
+			ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: Error creating DNS socket for %s", addr.str().c_str());
+			return false;
+		}
+
+		ServerInstance->SE->SetReuse(s);
+		ServerInstance->SE->NonBlocking(s);
+
+		irc::sockets::sockaddrs bindto;
+		memset(&bindto, 0, sizeof(bindto));
+		bindto.sa.sa_family = addr.sa.sa_family;
+
+		if (ServerInstance->SE->Bind(s, bindto) < 0)
+		{
+			ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: Error binding DNS socket for %s", addr.str().c_str());
+		}
+		else if (!ServerInstance->SE->AddFd(this, FD_WANT_POLL_READ | FD_WANT_NO_WRITE))
+		{
+			ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: Internal error starting DNS for %s", addr.str().c_str());
+		}
+		else
+		{
+			return true;
+		}
+
+		ServerInstance->SE->Close(this);
+		this->SetFd(-1);
+		return false;
+	}
+
+	bool IsUsable(time_t now) const
+	{
+		return (downuntil <= now);
+	}
+
+	void HandleEvent(EventType et, int);
+};
+
+/** A query sent again over TCP because the answer did not fit in a UDP packet
+ */
+class TCPQuery : public BufferedSocket
+{
+	MyManager* const manager;
+
+	/** True once the socket was closed and queued for culling
+	 */
+	bool dead;
+
+ public:
+	/** Id of the request this is for
+	 */
+	const unsigned short id;
+
+	/** The nameserver the query is sent to
+	 */
+	Upstream* const upstream;
+
+	TCPQuery(MyManager* mgr, unsigned short qid, Upstream* server)
+		: manager(mgr)
+		, dead(false)
+		, id(qid)
+		, upstream(server)
+	{
+	}
+
+	/** Connect to the nameserver and queue the query
+	 * @param packet The query
+	 * @param len Length of the query
+	 */
+	void Start(const unsigned char* packet, unsigned short len)
+	{
+		irc::sockets::sockaddrs bindto;
+		bindto.sa.sa_family = 0;
+		BufferedSocketError err = BeginConnect(upstream->addr, bindto, ServerInstance->Config->dns_timeout ? ServerInstance->Config->dns_timeout : 5);
+		if (err != I_ERR_NONE)
+		{
+			state = I_ERROR;
+			SetError(SocketEngine::LastError());
+			OnError(err);
+			return;
+		}
 
-	irc::sockets::sockaddrs myserver;
+		// Every message on a TCP connection is preceded by its length
+		std::string data;
+		data.reserve(len + 2);
+		data.push_back(len >> 8);
+		data.push_back(len & 0xFF);
+		data.append(reinterpret_cast<const char*>(packet), len);
+		WriteData(data);
+	}
 
-	static bool IsExpired(const Query& record, time_t now = ServerInstance->Time())
+	void Discard()
 	{
-		const ResourceRecord& req = record.answers[0];
-		return (req.created + static_cast<time_t>(req.ttl) < now);
+		if (dead)
+			return;
+
+		dead = true;
+		Close();
+		ServerInstance->GlobalCulls.AddItem(this);
 	}
 
+	void OnDataReady() CXX11_OVERRIDE;
+	void OnError(BufferedSocketError) CXX11_OVERRIDE;
+};
+
+class MyManager : public Manager, public Timer
+{
+	/** A cached answer
+	 */
+	struct CacheEntry;
+
+	typedef TR1NS::unordered_map<Question, CacheEntry, Question::hash> cache_map;
+	/** Cached questions, most recently used first. The pointers point to the keys of cache.
+	 */
+	typedef std::list<const Question*> lru_list;
+	/** Cached questions ordered by the time their answer expires
+	 */
+	typedef std::multimap<time_t, const Question*> expiry_map;
+
+	struct CacheEntry
+	{
+		Query query;
+		lru_list::iterator lru;
+		expiry_map::iterator expiry;
+	};
+
+	/** A request waiting for an answer
+	 */
+	struct PendingQuery
+	{
+		DNS::Request* req;
+		/** Index of the nameserver the query was last sent to in upstreams
+		 */
+		unsigned int upstream;
+		/** Number of times the query was sent
+		 */
+		unsigned int attempts;
+
+		PendingQuery() : req(NULL), upstream(0), attempts(0) { }
+	};
+
+	/** A query is sent to at most this many nameservers
+	 */
+	static const unsigned int MAX_ATTEMPTS = 2;
+
+	/** After this many unanswered queries in a row a nameserver is avoided
+	 */
+	static const unsigned int MAX_FAILURES = 3;
+
+	/** Number of seconds a nameserver which stopped answering is avoided for
+	 */
+	static const time_t DOWN_TIME = 30;
+
+	cache_map cache;
+	lru_list lru;
+	expiry_map expiries;
+
+	/** Maximum number of cached answers
+	 */
+	size_t maxcache;
+
+	std::vector<Upstream*> upstreams;
+
+	/** The nameserver to try first for the next query
+	 */
+	unsigned int nextupstream;
+
+	/** Request ids which are not in use, in no particular order
+	 */
+	std::vector<unsigned short> freeids;
+
+	std::map<unsigned short, TCPQuery*> tcpqueries;
+
 	/** Check the DNS cache to see if request can be handled by a cached result
 	 * @return true if a cached result was found.
 	 */
@@ -418,16 +625,17 @@ class MyManager : public Manager, public Timer, public EventHandler
 		if (it == this->cache.end())
 			return false;
 
-		Query& record = it->second;
-		if (IsExpired(record))
+		CacheEntry& entry = it->second;
+		if (entry.expiry->first < ServerInstance->Time())
 		{
-			this->cache.erase(it);
+			this->RemoveCache(it);
 			return false;
 		}
 
 		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: Using cached result for " + question.name);
-		record.cached = true;
-		req->OnLookupComplete(&record);
+		this->lru.splice(this->lru.begin(), this->lru, entry.lru);
+		entry.query.cached = true;
+		req->OnLookupComplete(&entry.query);
 		return true;
 	}
 
@@ -438,16 +646,219 @@ class MyManager : public Manager, public Timer, public EventHandler
 	{
 		const ResourceRecord& rr = r.answers[0];
 		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: added cache for " + rr.name + " -> " + rr.rdata + " ttl: " + ConvToStr(rr.ttl));
-		this->cache[r.questions[0]] = r;
+
+		if (!this->maxcache)
+			return;
+
+		cache_map::iterator it = this->cache.find(r.questions[0]);
+		if (it != this->cache.end())
+			this->RemoveCache(it);
+
+		// Make room by dropping the least recently used answers
+		while (this->cache.size() >= this->maxcache)
+			this->RemoveCache(this->cache.find(*this->lru.back()));
+
+		it = this->cache.insert(std::make_pair(r.questions[0], CacheEntry())).first;
+		CacheEntry& entry = it->second;
+		entry.query = r;
+		entry.lru = this->lru.insert(this->lru.begin(), &it->first);
+		entry.expiry = this->expiries.insert(std::make_pair(rr.created + static_cast<time_t>(rr.ttl), &it->first));
+	}
+
+	void RemoveCache(cache_map::iterator it)
+	{
+		this->lru.erase(it->second.lru);
+		this->expiries.erase(it->second.expiry);
+		this->cache.erase(it);
+	}
+
+	/** Pack the question of a request into a query with id 0
+	 * @param req The request
+	 * @param buffer The buffer to write the query to
+	 * @param size The size of the buffer
+	 * @param question Set to the question as it is sent, for PTR requests this differs from the request
+	 * @return The length of the query
+	 */
+	static unsigned short Pack(DNS::Request* req, unsigned char* buffer, unsigned short size, Question& question)
+	{
+		Packet p;
+		p.flags = QUERYFLAGS_RD;
+		p.questions.push_back(*req);
+
+		unsigned short len = p.Pack(buffer, size);
+
+		/* Note that calling Pack() above can actually change the contents of p.questions[0].name, if the query is a PTR,
+		 * to contain the value that would be in the DNS cache, which is why it is passed back.
+		 */
+		question = p.questions[0];
+		return len;
+	}
+
+	static void SetId(unsigned char* buffer, unsigned short id)
+	{
+		buffer[0] = id >> 8;
+		buffer[1] = id & 0xFF;
+	}
+
+	/** Pick the nameserver for a query, going round the usable ones in turn
+	 * @param avoid Index of a nameserver not to pick, such as the one a query timed out on
+	 * @return The index of the nameserver, avoid if there is no other one
+	 */
+	unsigned int PickUpstream(unsigned int avoid)
+	{
+		const time_t now = ServerInstance->Time();
+		unsigned int fallback = avoid;
+		for (size_t i = 0; i < this->upstreams.size(); ++i)
+		{
+			unsigned int candidate = this->nextupstream++ % this->upstreams.size();
+			if (candidate == avoid)
+				continue;
+
+			if (this->upstreams[candidate]->IsUsable(now))
+				return candidate;
+
+			if (fallback == avoid)
+				fallback = candidate;
+		}
+		return fallback;
+	}
+
+	/** Give a request an unused id and pick the nameserver it is sent to
+	 * @param req The request
+	 */
+	void Register(DNS::Request* req)
+	{
+		if (this->upstreams.empty())
+			throw Exception("DNS: No nameserver is available");
+
+		if (this->freeids.empty())
+			throw Exception("DNS: All ids are in use");
+
+		// Take a random free id, the id is all that stops a forged answer from being accepted
+		size_t index = ServerInstance->GenRandomInt(this->freeids.size());
+		req->id = this->freeids[index];
+		this->freeids[index] = this->freeids.back();
+		this->freeids.pop_back();
+
+		PendingQuery& pending = this->requests[req->id];
+		pending.req = req;
+		pending.upstream = this->PickUpstream(this->upstreams.size());
+		pending.attempts = 1;
+
+		if (this->upstreams.size() > 1)
+			req->SetInterval(this->AttemptTimeout());
+	}
+
+	/** Get the number of seconds to wait for an answer before asking another nameserver
+	 */
+	unsigned int AttemptTimeout() const
+	{
+		unsigned int timeout = (ServerInstance->Config->dns_timeout ? ServerInstance->Config->dns_timeout : 5);
+		if (this->upstreams.size() > 1)
+			timeout = std::max(timeout / MAX_ATTEMPTS, 1U);
+		return timeout;
+	}
+
+	/** Count an unanswered query against a nameserver
+	 */
+	void MarkFailed(Upstream* upstream)
+	{
+		const time_t now = ServerInstance->Time();
+		if ((++upstream->failures >= MAX_FAILURES) && (upstream->IsUsable(now)))
+		{
+			ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: %s is not answering, avoiding it for %ld seconds",
+				upstream->addr.str().c_str(), static_cast<long>(DOWN_TIME));
+			upstream->downuntil = now + DOWN_TIME;
+		}
+	}
+
+	/** Send a pending request to another nameserver
+	 * @return True if the request was sent
+	 */
+	bool Resend(DNS::Request* req)
+	{
+		PendingQuery& pending = this->requests[req->id];
+		if (pending.attempts >= MAX_ATTEMPTS)
+			return false;
+
+		unsigned int upstream = this->PickUpstream(pending.upstream);
+		if ((upstream == pending.upstream) || (upstream >= this->upstreams.size()))
+			return false;
+
+		this->DiscardTCP(req->id);
+
+		unsigned char buffer[524];
+		Question question;
+		unsigned short len;
+		try
+		{
+			len = Pack(req, buffer, sizeof(buffer), question);
+		}
+		catch (Exception&)
+		{
+			return false;
+		}
+		SetId(buffer, req->id);
+
+		Upstream* server = this->upstreams[upstream];
+		if (ServerInstance->SE->SendTo(server, buffer, len, 0, &server->addr.sa, server->addr.sa_size()) != len)
+			return false;
+
+		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Asking " + server->addr.str() + " for " + req->name);
+		pending.upstream = upstream;
+		pending.attempts++;
+		req->SetInterval(this->AttemptTimeout());
+		return true;
+	}
+
+	/** Send a request again over TCP, to the nameserver which sent a truncated answer
+	 */
+	void StartTCP(DNS::Request* req, Upstream* upstream)
+	{
+		unsigned char buffer[524];
+		Question question;
+		unsigned short len = Pack(req, buffer, sizeof(buffer), question);
+		SetId(buffer, req->id);
+
+		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Answer for " + req->name + " was truncated, asking again over TCP");
+
+		TCPQuery* query = new TCPQuery(this, req->id, upstream);
+		this->tcpqueries[req->id] = query;
+		// This can fail the request right away
+		query->Start(buffer, len);
+	}
+
+	void DiscardTCP(unsigned short id)
+	{
+		std::map<unsigned short, TCPQuery*>::iterator it = this->tcpqueries.find(id);
+		if (it == this->tcpqueries.end())
+			return;
+
+		TCPQuery* query = it->second;
+		this->tcpqueries.erase(it);
+		query->Discard();
+	}
+
+	/** Fail a request which was never sent
+	 */
+	static void Fail(DNS::Request* req, const std::string& reason)
+	{
+		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Unable to look up %s: %s", req->name.c_str(), reason.c_str());
+		Query rr(*req);
+		rr.error = ERROR_UNKNOWN;
+		req->OnError(&rr);
+		delete req;
 	}
 
  public:
-	DNS::Request* requests[MAX_REQUEST_ID];
+	PendingQuery requests[MAX_REQUEST_ID];
 
-	MyManager(Module* c) : Manager(c), Timer(3600, ServerInstance->Time(), true)
+	MyManager(Module* c) : Manager(c), Timer(60, ServerInstance->Time(), true), maxcache(0), nextupstream(0)
 	{
-		for (int i = 0; i < MAX_REQUEST_ID; ++i)
-			requests[i] = NULL;
+		// Id 0 is never used
+		this->freeids.reserve(MAX_REQUEST_ID - 1);
+		for (int i = 1; i < MAX_REQUEST_ID; ++i)
+			this->freeids.push_back(i);
 		ServerInstance->Timers->AddTimer(this);
 	}
 
@@ -455,7 +866,7 @@ class MyManager : public Manager, public Timer, public EventHandler
 	{
 		for (int i = 0; i < MAX_REQUEST_ID; ++i)
 		{
-			DNS::Request* request = requests[i];
+			DNS::Request* request = requests[i].req;
 			if (!request)
 				continue;
 
@@ -465,67 +876,103 @@ class MyManager : public Manager, public Timer, public EventHandler
 
 			delete request;
 		}
+
+		for (std::vector<Upstream*>::iterator i = this->upstreams.begin(); i != this->upstreams.end(); ++i)
+			delete *i;
 	}
 
 	void Process(DNS::Request* req)
 	{
-		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Processing request to lookup " + req->name + " of type " + ConvToStr(req->type) + " to " + this->myserver.addr());
+		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Processing request to lookup " + req->name + " of type " + ConvToStr(req->type));
 
-		/* Create an id */
-		unsigned int tries = 0;
-		do
+		unsigned char buffer[524];
+		Question question;
+		unsigned short len = Pack(req, buffer, sizeof(buffer), question);
+
+		if (req->use_cache && this->CheckCache(req, question))
 		{
-			req->id = ServerInstance->GenRandomInt(DNS::MAX_REQUEST_ID);
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Using cached result");
+			delete req;
+			return;
+		}
+
+		this->Register(req);
+		SetId(buffer, req->id);
+
+		Upstream* server = this->upstreams[this->requests[req->id].upstream];
+		if (ServerInstance->SE->SendTo(server, buffer, len, 0, &server->addr.sa, server->addr.sa_size()) != len)
+			throw Exception("DNS: Unable to send query");
+	}
 
-			if (++tries == DNS::MAX_REQUEST_ID*5)
+	void ProcessBatch(const std::vector<DNS::Request*>& reqs)
+	{
+		// Queries to send and their requests, by the index of the nameserver they go to
+		std::vector<std::vector<std::string> > packets(this->upstreams.size());
+		std::vector<std::vector<DNS::Request*> > sending(this->upstreams.size());
+
+		for (std::vector<DNS::Request*>::const_iterator i = reqs.begin(); i != reqs.end(); ++i)
+		{
+			DNS::Request* req = *i;
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Processing batched request to lookup " + req->name + " of type " + ConvToStr(req->type));
+
+			try
 			{
-				// If we couldn't find an empty slot this many times, do a sequential scan as a last
-				// resort. If an empty slot is found that way, go on, otherwise throw an exception
-				req->id = 0;
-				for (int i = 1; i < DNS::MAX_REQUEST_ID; i++)
+				unsigned char buffer[524];
+				Question question;
+				unsigned short len = Pack(req, buffer, sizeof(buffer), question);
+
+				if (req->use_cache && this->CheckCache(req, question))
 				{
-					if (!this->requests[i])
-					{
-						req->id = i;
-						break;
-					}
+					delete req;
+					continue;
 				}
 
-				if (req->id == 0)
-					throw Exception("DNS: All ids are in use");
+				this->Register(req);
+				SetId(buffer, req->id);
 
-				break;
+				unsigned int upstream = this->requests[req->id].upstream;
+				packets[upstream].push_back(std::string(reinterpret_cast<char*>(buffer), len));
+				sending[upstream].push_back(req);
+			}
+			catch (Exception& ex)
+			{
+				Fail(req, ex.GetReason());
 			}
 		}
-		while (!req->id || this->requests[req->id]);
 
-		this->requests[req->id] = req;
+		for (size_t i = 0; i < packets.size(); ++i)
+		{
+			if (packets[i].empty())
+				continue;
 
-		Packet p;
-		p.flags = QUERYFLAGS_RD;
-		p.id = req->id;
-		p.questions.push_back(*req);
+			Upstream* server = this->upstreams[i];
+			int sent = ServerInstance->SE->SendToMany(server, packets[i], 0, &server->addr.sa, server->addr.sa_size());
+			for (size_t j = std::max(sent, 0); j < sending[i].size(); ++j)
+				Fail(sending[i][j], "Unable to send query");
+		}
+	}
 
-		unsigned char buffer[524];
-		unsigned short len = p.Pack(buffer, sizeof(buffer));
+	bool Retry(DNS::Request* req)
+	{
+		PendingQuery& pending = this->requests[req->id];
+		if (pending.req != req)
+			return false;
 
-		/* Note that calling Pack() above can actually change the contents of p.questions[0].name, if the query is a PTR,
-		 * to contain the value that would be in the DNS cache, which is why this is here.
-		 */
-		if (req->use_cache && this->CheckCache(req, p.questions[0]))
-		{
-			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Using cached result");
-			delete req;
-			return;
-		}
+		if (pending.upstream < this->upstreams.size())
+			this->MarkFailed(this->upstreams[pending.upstream]);
 
-		if (ServerInstance->SE->SendTo(this, buffer, len, 0, &this->myserver.sa, this->myserver.sa_size()) != len)
-			throw Exception("DNS: Unable to send query");
+		return this->Resend(req);
 	}
 
 	void RemoveRequest(DNS::Request* req)
 	{
-		this->requests[req->id] = NULL;
+		PendingQuery& pending = this->requests[req->id];
+		if (pending.req != req)
+			return;
+
+		pending.req = NULL;
+		this->freeids.push_back(req->id);
+		this->DiscardTCP(req->id);
 	}
 
 	std::string GetErrorStr(Error e)
@@ -555,23 +1002,14 @@ class MyManager : public Manager, public Timer, public EventHandler
 		}
 	}
 
-	void HandleEvent(EventType et, int)
+	/** Handle an answer from a nameserver
+	 * @param buffer The answer
+	 * @param length The length of the answer
+	 * @param from The nameserver which sent the answer
+	 * @param tcp True if the answer came over TCP
+	 */
+	void HandleReply(const unsigned char* buffer, unsigned short length, Upstream* from, bool tcp)
 	{
-		if (et == EVENT_ERROR)
-		{
-			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: UDP socket got an error event");
-			return;
-		}
-
-		unsigned char buffer[524];
-		irc::sockets::sockaddrs from;
-		socklen_t x = sizeof(from);
-
-		int length = ServerInstance->SE->RecvFrom(this, buffer, sizeof(buffer), 0, &from.sa, &x);
-
-		if (length < Packet::HEADER_LENGTH)
-			return;
-
 		Packet recv_packet;
 
 		try
@@ -584,19 +1022,31 @@ class MyManager : public Manager, public Timer, public EventHandler
 			return;
 		}
 
-		if (myserver != from)
+		PendingQuery& pending = this->requests[recv_packet.id];
+		DNS::Request* request = pending.req;
+		if (request == NULL)
 		{
-			std::string server1 = from.str();
-			std::string server2 = myserver.str();
-			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Got a result from the wrong server! Bad NAT or DNS forging attempt? '%s' != '%s'",
-				server1.c_str(), server2.c_str());
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Received an answer for something we didn't request");
 			return;
 		}
 
-		DNS::Request* request = this->requests[recv_packet.id];
-		if (request == NULL)
+		if ((pending.upstream >= this->upstreams.size()) || (this->upstreams[pending.upstream] != from))
 		{
-			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Received an answer for something we didn't request");
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Got a result from %s which the query was not sent to! Bad NAT or DNS forging attempt?",
+				from->addr.str().c_str());
+			return;
+		}
+
+		// The query was already sent again over TCP
+		if ((!tcp) && (this->tcpqueries.count(recv_packet.id)))
+			return;
+
+		from->failures = 0;
+		from->downuntil = 0;
+
+		if ((!tcp) && (recv_packet.flags & QUERYFLAGS_TC))
+		{
+			this->StartTCP(request, from);
 			return;
 		}
 
@@ -637,6 +1087,10 @@ class MyManager : public Manager, public Timer, public EventHandler
 					break;
 			}
 
+			// Another nameserver may be able to answer
+			if (((error == ERROR_SERVER_FAILURE) || (error == ERROR_REFUSED)) && (this->Resend(request)))
+				return;
+
 			ServerInstance->stats->statsDnsBad++;
 			recv_packet.error = error;
 			request->OnError(&recv_packet);
@@ -662,80 +1116,151 @@ class MyManager : public Manager, public Timer, public EventHandler
 		delete request;
 	}
 
+	/** Called when a TCP query could not be completed
+	 */
+	void TCPFailed(unsigned short id)
+	{
+		this->DiscardTCP(id);
+
+		DNS::Request* request = this->requests[id].req;
+		if (!request)
+			return;
+
+		ServerInstance->stats->statsDnsBad++;
+		ServerInstance->stats->statsDns++;
+
+		Query rr(*request);
+		rr.error = ERROR_SERVER_FAILURE;
+		request->OnError(&rr);
+		delete request;
+	}
+
 	bool Tick(time_t now)
 	{
 		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: purging DNS cache");
 
-		for (cache_map::iterator it = this->cache.begin(); it != this->cache.end(); )
-		{
-			const Query& query = it->second;
-			if (IsExpired(query, now))
-				this->cache.erase(it++);
-			else
-				++it;
-		}
+		// Answers are ordered by expiry time, stop at the first one which is still valid
+		while ((!this->expiries.empty()) && (this->expiries.begin()->first < now))
+			this->RemoveCache(this->cache.find(*this->expiries.begin()->second));
 		return true;
 	}
 
-	void Rehash(const std::string& dnsserver)
+	/** Set the maximum number of cached answers
+	 */
+	void SetCacheSize(size_t size)
 	{
-		if (this->GetFd() > -1)
-		{
-			ServerInstance->SE->DelFd(this);
-			ServerInstance->SE->Shutdown(this, 2);
-			ServerInstance->SE->Close(this);
-			this->SetFd(-1);
+		this->maxcache = size;
+		while (this->cache.size() > this->maxcache)
+			this->RemoveCache(this->cache.find(*this->lru.back()));
+	}
 
-			/* Remove expired entries from the cache */
-			this->Tick(ServerInstance->Time());
-		}
+	void Rehash(const std::vector<std::string>& servers)
+	{
+		/* Remove expired entries from the cache */
+		this->Tick(ServerInstance->Time());
 
-		irc::sockets::aptosa(dnsserver, DNS::PORT, myserver);
+		for (std::map<unsigned short, TCPQuery*>::iterator i = this->tcpqueries.begin(); i != this->tcpqueries.end(); ++i)
+			i->second->Discard();
+		this->tcpqueries.clear();
+		for (std::vector<Upstream*>::iterator i = this->upstreams.begin(); i != this->upstreams.end(); ++i)
+			delete *i;
+		this->upstreams.clear();
 
-		/* Initialize mastersocket */
-		int s = socket(myserver.sa.sa_family, SOCK_DGRAM, 0);
-		this->SetFd(s);
+		// Answers to pending queries would come to the old sockets, let the queries time out or go to a new nameserver
+		for (int i = 0; i < MAX_REQUEST_ID; ++i)
+			this->requests[i].upstream = UINT_MAX;
 
-		/* Have we got a socket? */
-		if (this->GetFd() != -1)
+		for (std::vector<std::string>::const_iterator i = servers.begin(); i != servers.end(); ++i)
 		{
-			ServerInstance->SE->SetReuse(s);
-			ServerInstance->SE->NonBlocking(s);
-
-			irc::sockets::sockaddrs bindto;
-			memset(&bindto, 0, sizeof(bindto));
-			bindto.sa.sa_family = myserver.sa.sa_family;
-
-			if (ServerInstance->SE->Bind(this->GetFd(), bindto) < 0)
+			irc::sockets::sockaddrs addr;
+			if (!irc::sockets::aptosa(*i, DNS::PORT, addr))
 			{
-				/* Failed to bind */
-				ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: Error binding dns socket - hostnames will NOT resolve");
-				ServerInstance->SE->Close(this);
-				this->SetFd(-1);
-			}
-			else if (!ServerInstance->SE->AddFd(this, FD_WANT_POLL_READ | FD_WANT_NO_WRITE))
-			{
-				ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: Internal error starting DNS - hostnames will NOT resolve.");
-				ServerInstance->SE->Close(this);
-				this->SetFd(-1);
+				ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: '%s' is not a valid nameserver address", i->c_str());
+				continue;
 			}
+
+			Upstream* upstream = new Upstream(this, addr);
+			if (upstream->Open())
+				this->upstreams.push_back(upstream);
+			else
+				delete upstream;
 		}
-		else
+
+		if (this->upstreams.empty())
+			ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: No usable nameserver - hostnames will NOT resolve");
+	}
+};
+
+void Upstream::HandleEvent(EventType et, int)
+{
+	if (et == EVENT_ERROR)
+	{
+		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: UDP socket got an error event");
+		return;
+	}
+
+	// Drain a burst of answers in one go, the socket engine reports the socket again if more are left
+	for (unsigned int count = 0; count < 64; ++count)
+	{
+		unsigned char buffer[524];
+		irc::sockets::sockaddrs from;
+		socklen_t x = sizeof(from);
+
+		int length = ServerInstance->SE->RecvFrom(this, buffer, sizeof(buffer), 0, &from.sa, &x);
+		if (length < 0)
+			return;
+
+		if (length < Packet::HEADER_LENGTH)
+			continue;
+
+		if (addr != from)
 		{
-			ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: Error creating DNS socket - hostnames will NOT resolve");
+			std::string server1 = from.str();
+			std::string server2 = addr.str();
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Got a result from the wrong server! Bad NAT or DNS forging attempt? '%s' != '%s'",
+				server1.c_str(), server2.c_str());
+			continue;
 		}
+
+		// This can delete us on rehash, but the answers never cause one
+		manager->HandleReply(buffer, length, this, false);
 	}
-};
+}
+
+void TCPQuery::OnDataReady()
+{
+	if (recvq.length() < 2)
+		return;
+
+	const unsigned char* data = reinterpret_cast<const unsigned char*>(recvq.data());
+	const unsigned short len = (data[0] << 8) | data[1];
+	if (recvq.length() < 2U + len)
+		return;
+
+	// The manager discards this query when the request completes
+	manager->HandleReply(data + 2, len, upstream, true);
+}
+
+void TCPQuery::OnError(BufferedSocketError err)
+{
+	if (dead)
+		return;
+
+	// A connect timeout culls the socket by itself
+	if (err == I_ERR_TIMEOUT)
+		dead = true;
+	manager->TCPFailed(id);
+}
 
 class ModuleDNS : public Module
 {
 	MyManager manager;
-	std::string DNSServer;
+	std::vector<std::string> DNSServers;
 
-	void FindDNSServer()
+	void FindDNSServers()
 	{
 #ifdef _WIN32
-		// attempt to look up their nameserver from the system
+		// attempt to look up their nameservers from the system
 		ServerInstance->Logs->Log("CONFIG", LOG_DEFAULT, "WARNING: <dns:server> not defined, attempting to find a working server in the system settings...");
 
 		PFIXED_INFO pFixedInfo;
@@ -753,41 +1278,51 @@ class ModuleDNS : public Module
 			if (pFixedInfo)
 			{
 				if (GetNetworkParams(pFixedInfo, &dwBufferSize) == NO_ERROR)
-					DNSServer = pFixedInfo->DnsServerList.IpAddress.String;
+				{
+					for (PIP_ADDR_STRING server = &pFixedInfo->DnsServerList; server; server = server->Next)
+					{
+						if (*server->IpAddress.String)
+							DNSServers.push_back(server->IpAddress.String);
+					}
+				}
 
 				HeapFree(GetProcessHeap(), 0, pFixedInfo);
 			}
 
-			if (!DNSServer.empty())
+			if (!DNSServers.empty())
 			{
-				ServerInstance->Logs->Log("CONFIG", LOG_DEFAULT, "<dns:server> set to '%s' as first active resolver in the system settings.", DNSServer.c_str());
+				ServerInstance->Logs->Log("CONFIG", LOG_DEFAULT, "<dns:server> set to '%s' as active resolvers in the system settings.", irc::stringjoiner(DNSServers).GetJoined().c_str());
 				return;
 			}
 		}
 
 		ServerInstance->Logs->Log("CONFIG", LOG_DEFAULT, "No viable nameserver found! Defaulting to nameserver '127.0.0.1'!");
 #else
-		// attempt to look up their nameserver from /etc/resolv.conf
-		ServerInstance->Logs->Log("CONFIG", LOG_DEFAULT, "WARNING: <dns:server> not defined, attempting to find working server in /etc/resolv.conf...");
+		// attempt to look up their nameservers from /etc/resolv.conf
+		ServerInstance->Logs->Log("CONFIG", LOG_DEFAULT, "WARNING: <dns:server> not defined, attempting to find working servers in /etc/resolv.conf...");
 
 		std::ifstream resolv("/etc/resolv.conf");
+		std::string token;
 
-		while (resolv >> DNSServer)
+		while (resolv >> token)
 		{
-			if (DNSServer == "nameserver")
+			if (token == "nameserver")
 			{
-				resolv >> DNSServer;
-				if (DNSServer.find_first_not_of("0123456789.") == std::string::npos)
-				{
-					ServerInstance->Logs->Log("CONFIG", LOG_DEFAULT, "<dns:server> set to '%s' as first resolver in /etc/resolv.conf.",DNSServer.c_str());
-					return;
-				}
+				resolv >> token;
+				if (token.find_first_not_of("0123456789.") == std::string::npos)
+					DNSServers.push_back(token);
 			}
 		}
 
+		if (!DNSServers.empty())
+		{
+			ServerInstance->Logs->Log("CONFIG", LOG_DEFAULT, "<dns:server> set to '%s' as resolvers in /etc/resolv.conf.", irc::stringjoiner(DNSServers).GetJoined().c_str());
+			return;
+		}
+
 		ServerInstance->Logs->Log("CONFIG", LOG_DEFAULT, "/etc/resolv.conf contains no viable nameserver entries! Defaulting to nameserver '127.0.0.1'!");
 #endif
-		DNSServer = "127.0.0.1";
+		DNSServers.push_back("127.0.0.1");
 	}
 
  public:
@@ -797,20 +1332,27 @@ class ModuleDNS : public Module
 
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
 	{
-		std::string oldserver = DNSServer;
-		DNSServer = ServerInstance->Config->ConfValue("dns")->getString("server");
-		if (DNSServer.empty())
-			FindDNSServer();
+		ConfigTag* tag = ServerInstance->Config->ConfValue("dns");
+		std::vector<std::string> oldservers;
+		oldservers.swap(DNSServers);
+
+		irc::spacesepstream serverstream(tag->getString("server"));
+		for (std::string server; serverstream.GetToken(server); )
+			DNSServers.push_back(server);
+		if (DNSServers.empty())
+			FindDNSServers();
 
-		if (oldserver != DNSServer)
-			this->manager.Rehash(DNSServer);
+		if (oldservers != DNSServers)
+			this->manager.Rehash(DNSServers);
+
+		this->manager.SetCacheSize(tag->getInt("cachesize", 4096, 0));
 	}
 
 	void OnUnloadModule(Module* mod)
 	{
 		for (int i = 0; i < MAX_REQUEST_ID; ++i)
 		{
-			DNS::Request* req = this->manager.requests[i];
+			DNS::Request* req = this->manager.requests[i].req;
 			if (!req)
 				continue;
 
@@ -832,4 +1374,3 @@ class ModuleDNS : public Module
 };
 
 MODULE_INIT(ModuleDNS)
-
@@ -20,6 +20,66 @@
 
 #include "inspircd.h"
 
+/** The filters of a LIST query
+ */
+struct ListFilter
+{
+	/** Only channels with more than this many users match, if nonzero */
+	long minusers;
+
+	/** Only channels with fewer than this many users match, if nonzero */
+	long maxusers;
+
+	/** True if the creation time of channels is limited */
+	bool hasage;
+
+	/** The earliest and latest creation times of matching channels, if hasage is set */
+	time_t minage;
+	time_t maxage;
+
+	/** Patterns matched against the name and topic of channels, any of them has to match */
+	std::vector<WildcardMask> patterns;
+
+	ListFilter() : minusers(0), maxusers(0), hasage(false), minage(0), maxage(0) { }
+
+	/** Check whether a channel passes the filters
+	 * @param chan The channel to check
+	 * @return True if the channel matches
+	 */
+	bool Match(Channel* chan) const
+	{
+		long users = chan->GetUserCounter();
+		if ((minusers && (users <= minusers)) || (maxusers && (users >= maxusers)))
+			return false;
+
+		if (hasage && ((chan->age < minage) || (chan->age > maxage)))
+			return false;
+
+		if (patterns.empty())
+			return true;
+
+		for (std::vector<WildcardMask>::const_iterator i = patterns.begin(); i != patterns.end(); ++i)
+		{
+			if (i->Match(chan->name) || i->Match(chan->topic))
+				return true;
+		}
+		return false;
+	}
+};
+
+/** A LIST reply which is being sent a part at a time as the user's sendq drains
+ */
+struct ListState
+{
+	/** Names of the matching channels, they are looked up again when they are sent */
+	std::vector<std::string> channels;
+
+	/** Index of the next channel to send */
+	size_t pos;
+
+	ListState() : pos(0) { }
+};
+
 /** Handle /LIST. These command handlers can be reloaded by the core,
  * and handle basic RFC1459 commands. Commands within modules work
  * the same way, however, they can be fully unloaded, where these
@@ -30,13 +90,30 @@ class CommandList : public Command
 	ChanModeReference secretmode;
 	ChanModeReference privatemode;
 
+	/** Parse the filters given to LIST, see ELIST in the ISUPPORT numeric
+	 * @param param The comma separated filters
+	 * @param filter The filter to fill
+	 */
+	void ParseFilter(const std::string& param, ListFilter& filter);
+
+	/** Find the channels which may match the filters, looking them up in the channel indexes if possible
+	 * @param filter The filters
+	 * @param channels The list to fill with the names of the channels
+	 */
+	void GetCandidates(const ListFilter& filter, std::vector<std::string>& channels);
+
  public:
+	/** Reply which is still being sent to a user
+	 */
+	SimpleExtItem<ListState> liststate;
+
 	/** Constructor for list.
 	 */
 	CommandList(Module* parent)
 		: Command(parent,"LIST", 0, 0)
 		, secretmode(creator, "secret")
 		, privatemode(creator, "private")
+		, liststate("liststate", parent)
 	{
 		Penalty = 5;
 	}
@@ -48,68 +125,182 @@ class CommandList : public Command
 	 * @return A value from CmdResult to indicate command success or failure.
 	 */
 	CmdResult Handle(const std::vector<std::string>& parameters, User *user);
-};
 
+	/** Send more of a LIST reply. Sending stops once the sendq of a local user
+	 * reaches half of their soft limit, and continues when it has been written out.
+	 * @param user The user to send the reply to
+	 * @param state The reply, which is deleted when everything was sent
+	 */
+	void SendList(User* user, ListState* state);
+};
 
-/** Handle /LIST
- */
-CmdResult CommandList::Handle (const std::vector<std::string>& parameters, User *user)
+void CommandList::ParseFilter(const std::string& param, ListFilter& filter)
 {
-	int minusers = 0, maxusers = 0;
-
-	user->WriteNumeric(RPL_LISTSTART, "Channel :Users Name");
-
-	/* Work around mIRC suckyness. YOU SUCK, KHALED! */
-	if (parameters.size() == 1)
+	irc::commasepstream filters(param);
+	std::string token;
+	while (filters.GetToken(token))
 	{
-		if (parameters[0][0] == '<')
+		if (token.empty())
+			continue;
+
+		/* Work around mIRC suckyness. YOU SUCK, KHALED! */
+		if (token[0] == '<')
 		{
-			maxusers = atoi((parameters[0].c_str())+1);
+			filter.maxusers = atoi(token.c_str() + 1);
+		}
+		else if (token[0] == '>')
+		{
+			filter.minusers = atoi(token.c_str() + 1);
+		}
+		else if ((token.length() > 1) && (token[0] == 'C' || token[0] == 'c') && (token[1] == '<' || token[1] == '>'))
+		{
+			// Creation time in minutes ago
+			time_t limit = ServerInstance->Time() - atoi(token.c_str() + 2) * 60;
+			if (!filter.hasage)
+			{
+				filter.hasage = true;
+				filter.minage = 0;
+				filter.maxage = ServerInstance->Time();
+			}
+
+			if (token[1] == '<')
+				filter.minage = std::max(filter.minage, limit + 1);
+			else
+				filter.maxage = std::min(filter.maxage, limit - 1);
 		}
-		else if (parameters[0][0] == '>')
+		else
 		{
-			minusers = atoi((parameters[0].c_str())+1);
+			// The pattern is matched against every channel, compile it once
+			filter.patterns.push_back(WildcardMask(token));
 		}
 	}
+}
 
-	for (chan_hash::const_iterator i = ServerInstance->chanlist->begin(); i != ServerInstance->chanlist->end(); i++)
+void CommandList::GetCandidates(const ListFilter& filter, std::vector<std::string>& channels)
+{
+	std::vector<Channel*> found;
+	if (filter.minusers > 0)
+	{
+		// Lists of only the big channels are the common case and touch the fewest size buckets
+		ServerInstance->ChanIndex.FindBySize(filter.minusers + 1, (filter.maxusers > 0 ? filter.maxusers - 1 : LONG_MAX), found);
+	}
+	else if (filter.hasage)
+	{
+		ServerInstance->ChanIndex.FindByAge(filter.minage, filter.maxage, found);
+	}
+	else
 	{
-		// attempt to match a glob pattern
-		long users = i->second->GetUserCounter();
+		channels.reserve(ServerInstance->chanlist->size());
+		for (chan_hash::const_iterator i = ServerInstance->chanlist->begin(); i != ServerInstance->chanlist->end(); ++i)
+		{
+			if (filter.Match(i->second))
+				channels.push_back(i->second->name);
+		}
+		return;
+	}
 
-		bool too_few = (minusers && (users <= minusers));
-		bool too_many = (maxusers && (users >= maxusers));
+	for (std::vector<Channel*>::const_iterator i = found.begin(); i != found.end(); ++i)
+	{
+		if (filter.Match(*i))
+			channels.push_back((*i)->name);
+	}
+}
 
-		if (too_many || too_few)
-			continue;
+void CommandList::SendList(User* user, ListState* state)
+{
+	LocalUser* localuser = IS_LOCAL(user);
+	// OnBufferFlushed() only fires after something was written, so the limit must let at
+	// least one reply into an empty sendq even if the class has a tiny soft limit
+	const size_t sendqlimit = (localuser ? std::max<size_t>(localuser->MyClass->GetSendqSoftMax() / 2, ServerInstance->Config->NetBufferSize) : 0);
+	const bool auspex = user->HasPrivPermission("channels/auspex");
 
-		if (parameters.size() && !parameters[0].empty() && (parameters[0][0] != '<' && parameters[0][0] != '>'))
+	while (state->pos < state->channels.size())
+	{
+		if (localuser && localuser->eh.getSendQSize() >= sendqlimit)
 		{
-			if (!InspIRCd::Match(i->second->name, parameters[0]) && !InspIRCd::Match(i->second->topic, parameters[0]))
-				continue;
+			// Continue in OnBufferFlushed() once the sendq has been written out
+			if (liststate.get(user) != state)
+				liststate.set(user, state);
+			return;
 		}
 
+		// The channel may have been destroyed since the reply was started
+		Channel* chan = ServerInstance->FindChan(state->channels[state->pos++]);
+		if (!chan)
+			continue;
+
+		long users = chan->GetUserCounter();
+
 		// if the channel is not private/secret, OR the user is on the channel anyway
-		bool n = (i->second->HasUser(user) || user->HasPrivPermission("channels/auspex"));
+		bool n = (auspex || chan->HasUser(user));
 
-		if (!n && i->second->IsModeSet(privatemode))
+		if (!n && chan->IsModeSet(privatemode))
 		{
 			/* Channel is +p and user is outside/not privileged */
 			user->WriteNumeric(RPL_LIST, "* %ld :", users);
 		}
 		else
 		{
-			if (n || !i->second->IsModeSet(secretmode))
+			if (n || !chan->IsModeSet(secretmode))
 			{
 				/* User is in the channel/privileged, channel is not +s */
-				user->WriteNumeric(RPL_LIST, "%s %ld :[+%s] %s",i->second->name.c_str(),users,i->second->ChanModes(n),i->second->topic.c_str());
+				user->WriteNumeric(RPL_LIST, "%s %ld :[+%s] %s",chan->name.c_str(),users,chan->ChanModes(n),chan->topic.c_str());
 			}
 		}
 	}
+
 	user->WriteNumeric(RPL_LISTEND, ":End of channel list.");
+	if (liststate.get(user) == state)
+		liststate.unset(user);
+	else
+		delete state;
+}
+
+/** Handle /LIST
+ */
+CmdResult CommandList::Handle (const std::vector<std::string>& parameters, User *user)
+{
+	// A new LIST replaces one which is still being sent
+	if (liststate.get(user))
+	{
+		liststate.unset(user);
+		user->WriteNumeric(RPL_LISTEND, ":End of channel list.");
+	}
+
+	user->WriteNumeric(RPL_LISTSTART, "Channel :Users Name");
+
+	ListFilter filter;
+	if (parameters.size())
+		ParseFilter(parameters[0], filter);
+
+	ListState* state = new ListState;
+	GetCandidates(filter, state->channels);
+	SendList(user, state);
 
 	return CMD_SUCCESS;
 }
 
+class ModuleList : public Module
+{
+	CommandList cmd;
+
+ public:
+	ModuleList()
+		: cmd(this)
+	{
+	}
+
+	void OnBufferFlushed(LocalUser* user)
+	{
+		ListState* state = cmd.liststate.get(user);
+		if (state)
+			cmd.SendList(user, state);
+	}
+
+	Version GetVersion()
+	{
+		return Version("LIST", VF_VENDOR | VF_CORE);
+	}
+};
 
-COMMAND_INIT(CommandList)
+MODULE_INIT(ModuleList)
@@ -199,6 +199,49 @@ void CommandStats::DoStats(char statschar, User* user, string_list &results)
 			}
 		break;
 
+		/* stats h (event dispatch and module hook profiling) */
+		case 'h':
+		{
+			ModuleManager* mm = ServerInstance->Modules;
+			const bool profiling = ServerInstance->Config->HookProfiling;
+			for (size_t i = I_BEGIN + 1; i != I_END; ++i)
+			{
+				// Dispatches are only timed while profiling
+				const ModuleManager::EventStats& es = mm->EventCounters[i];
+				if (es.calls)
+					results.push_back("249 "+user->nick+" :Event "+ModuleManager::GetEventName((Implementation)i)+" dispatches "+ConvToStr(es.calls)+
+						(profiling ? " time "+ConvToStr(es.time / 1000)+"us" : ""));
+			}
+
+			if (!profiling)
+				results.push_back("249 "+user->nick+" :Hook profiling is disabled, enable <performance:hookprofiling> to profile modules");
+
+			// Slowest first
+			std::multimap<uint64_t, std::string, std::greater<uint64_t> > hooks;
+			const ModuleManager::ModuleMap& mods = mm->GetModules();
+			for (ModuleManager::ModuleMap::const_iterator m = mods.begin(); m != mods.end(); ++m)
+			{
+				const Module::HookStats* hs = m->second->GetHookStats();
+				if (!hs)
+					continue;
+
+				for (size_t i = I_BEGIN + 1; i != I_END; ++i)
+				{
+					// Most modules return at once from most events, only list the ones that took measurable time
+					const uint64_t total = mm->TicksToNanoseconds(hs[i].total);
+					if (total < 1000)
+						continue;
+
+					hooks.insert(std::make_pair(total, m->first+" "+ModuleManager::GetEventName((Implementation)i)+" calls "+ConvToStr(hs[i].calls)+
+						" total "+ConvToStr(total / 1000)+"us max "+ConvToStr(mm->TicksToNanoseconds(hs[i].max) / 1000)+"us exceptions "+ConvToStr(hs[i].exceptions)));
+				}
+			}
+
+			for (std::multimap<uint64_t, std::string, std::greater<uint64_t> >::const_iterator i = hooks.begin(); i != hooks.end(); ++i)
+				results.push_back("249 "+user->nick+" :Hook "+i->second);
+		}
+		break;
+
 		/* stats z (debug and memory info) */
 		case 'z':
 		{
@@ -206,6 +249,10 @@ void CommandStats::DoStats(char statschar, User* user, string_list &results)
 			results.push_back("249 "+user->nick+" :Channels: "+ConvToStr(ServerInstance->chanlist->size()));
 			results.push_back("249 "+user->nick+" :Commands: "+ConvToStr(ServerInstance->Parser->cmdlist.size()));
 
+			const XLineManager::ApplyStats& xstats = ServerInstance->XLines->GetApplyStats();
+			results.push_back("249 "+user->nick+" :X-line passes: "+ConvToStr(xstats.passes)+" (lines applied: "+ConvToStr(xstats.lines)+
+				", users checked: "+ConvToStr(xstats.users)+", in the last pass: "+ConvToStr(xstats.lastusers)+")");
+
 			float kbitpersec_in, kbitpersec_out, kbitpersec_total;
 			char kbitpersec_in_s[30], kbitpersec_out_s[30], kbitpersec_total_s[30];
 
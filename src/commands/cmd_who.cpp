@@ -39,6 +39,8 @@ class CommandWho : public Command
 	bool opt_local;
 	bool opt_far;
 	bool opt_time;
+	bool opt_range;
+	irc::sockets::cidr_mask whorange;
 	ChanModeReference secretmode;
 	ChanModeReference privatemode;
 	UserModeReference invisiblemode;
@@ -75,6 +77,18 @@ class CommandWho : public Command
 	 */
 	CmdResult Handle(const std::vector<std::string>& parameters, User *user);
 	bool whomatch(User* cuser, User* user, const char* matchtext);
+
+	/** Look up the users which whomatch() may match in the user indexes
+	 * @param user The user issuing the command
+	 * @param matchtext The mask
+	 * @param candidates The list to fill, sorted and without duplicates
+	 * @return False if the query can't be answered from the indexes and every user has to be checked
+	 */
+	bool GetCandidates(User* user, const std::string& matchtext, std::vector<User*>& candidates);
+
+	/** Send a WHO line about a user who matches the mask, if the user issuing the command may see them
+	 */
+	void MatchUser(User* user, User* target, const std::vector<std::string>& parameters, const std::string& matchtext, bool usingwildcards, const std::string& initial, std::vector<std::string>& whoresults);
 };
 
 bool CommandWho::whomatch(User* cuser, User* user, const char* matchtext)
@@ -127,7 +141,11 @@ bool CommandWho::whomatch(User* cuser, User* user, const char* matchtext)
 		else if (opt_realname)
 			match = InspIRCd::Match(user->fullname, matchtext);
 		else if (opt_showrealhost)
+		{
 			match = InspIRCd::Match(user->host, matchtext, ascii_case_insensitive_map);
+			if (!match && opt_range)
+				match = whorange.match(user->client_sa);
+		}
 		else if (opt_ident)
 			match = InspIRCd::Match(user->ident, matchtext, ascii_case_insensitive_map);
 		else if (opt_port)
@@ -173,6 +191,63 @@ bool CommandWho::whomatch(User* cuser, User* user, const char* matchtext)
 	}
 }
 
+bool CommandWho::GetCandidates(User* user, const std::string& matchtext, std::vector<User*>& candidates)
+{
+	// Only the real host can be looked up, the other flags have to check every user
+	if (opt_mode || opt_metadata || opt_realname || opt_ident || opt_port || opt_away || opt_time)
+		return false;
+
+	UserManager* users = ServerInstance->Users;
+	WildcardMask hostmask(matchtext, ascii_case_insensitive_map);
+	if (!users->dhosts.Find(hostmask, candidates))
+		return false;
+
+	if (opt_showrealhost)
+	{
+		users->hosts.Find(hostmask, candidates);
+		if (opt_range)
+			users->ips.Find(whorange, candidates);
+	}
+
+	// Nicks can't contain a dot, so masks such as "*.example.com" only need the host and server indexes
+	if (hostmask.GetKind() == WildcardMask::MASK_EXACT)
+	{
+		User* target = ServerInstance->FindNickOnly(matchtext);
+		if (target)
+			candidates.push_back(target);
+	}
+	else if (matchtext.find('.') == std::string::npos)
+		return false;
+
+	if (ServerInstance->Config->HideWhoisServer.empty() || user->HasPrivPermission("users/auspex"))
+	{
+		for (std::set<Server*>::const_iterator i = users->servers.begin(); i != users->servers.end(); ++i)
+		{
+			Server* server = *i;
+			if (InspIRCd::Match(server->GetName(), matchtext))
+				candidates.insert(candidates.end(), server->users.begin(), server->users.end());
+		}
+	}
+
+	std::sort(candidates.begin(), candidates.end());
+	candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+	return true;
+}
+
+void CommandWho::MatchUser(User* user, User* target, const std::vector<std::string>& parameters, const std::string& matchtext, bool usingwildcards, const std::string& initial, std::vector<std::string>& whoresults)
+{
+	if (!whomatch(user, target, matchtext.c_str()))
+		return;
+
+	if (!user->SharesChannelWith(target))
+	{
+		if (usingwildcards && (target->IsModeSet(invisiblemode)) && (!user->HasPrivPermission("users/auspex")))
+			return;
+	}
+
+	SendWhoLine(user, parameters, initial, NULL, target, whoresults);
+}
+
 bool CommandWho::CanView(Channel* chan, User* user)
 {
 	if (!user || !chan)
@@ -255,6 +330,7 @@ CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *
 	opt_local = false;
 	opt_far = false;
 	opt_time = false;
+	opt_range = false;
 
 	std::vector<std::string> whoresults;
 	std::string initial = "352 " + user->nick + " ";
@@ -315,6 +391,13 @@ CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *
 	}
 
 
+	// With the h flag, a mask such as 192.0.2.0/24 also matches users by their IP address
+	if (opt_showrealhost && matchtext.find('/') != std::string::npos && matchtext.find('@') == std::string::npos)
+	{
+		whorange = irc::sockets::cidr_mask(matchtext);
+		opt_range = (whorange.type == AF_INET || whorange.type == AF_INET6);
+	}
+
 	/* who on a channel? */
 	Channel* ch = ServerInstance->FindChan(matchtext);
 
@@ -369,18 +452,22 @@ CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *
 		}
 		else
 		{
-			for (user_hash::iterator i = ServerInstance->Users->clientlist->begin(); i != ServerInstance->Users->clientlist->end(); i++)
+			std::vector<User*> candidates;
+			if (GetCandidates(user, matchtext, candidates))
 			{
-				if (whomatch(user, i->second, matchtext.c_str()))
-				{
-					if (!user->SharesChannelWith(i->second))
-					{
-						if (usingwildcards && (i->second->IsModeSet(invisiblemode)) && (!user->HasPrivPermission("users/auspex")))
-							continue;
-					}
-
-					SendWhoLine(user, parameters, initial, NULL, i->second, whoresults);
-				}
+				for (std::vector<User*>::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
+					MatchUser(user, *i, parameters, matchtext, usingwildcards, initial, whoresults);
+			}
+			else if (opt_local)
+			{
+				const LocalUserList& list = ServerInstance->Users->local_users;
+				for (LocalUserList::const_iterator i = list.begin(); i != list.end(); ++i)
+					MatchUser(user, *i, parameters, matchtext, usingwildcards, initial, whoresults);
+			}
+			else
+			{
+				for (user_hash::iterator i = ServerInstance->Users->clientlist->begin(); i != ServerInstance->Users->clientlist->end(); i++)
+					MatchUser(user, i->second, parameters, matchtext, usingwildcards, initial, whoresults);
 			}
 		}
 	}
@@ -23,8 +23,19 @@
 #include "inspircd.h"
 #include "commands/cmd_whowas.h"
 
+namespace
+{
+	/** Get the string which follows another in the packed strings of a record
+	 */
+	const char* NextString(const char* str)
+	{
+		return str + strlen(str) + 1;
+	}
+}
+
 CommandWhowas::CommandWhowas( Module* parent)
 	: Command(parent, "WHOWAS", 1)
+	, capacity(0), first(0), used(0), entries(0), stringbytes(0)
 	, GroupSize(0), MaxGroups(0), MaxKeep(0)
 {
 	syntax = "<nick>{,<nick>}";
@@ -40,7 +51,7 @@ CmdResult CommandWhowas::Handle (const std::vector<std::string>& parameters, Use
 		return CMD_FAILURE;
 	}
 
-	whowas_users::iterator i = whowas.find(assign(parameters[0]));
+	WhoWas::GroupMap::const_iterator i = whowas.find(parameters[0]);
 
 	if (i == whowas.end())
 	{
@@ -48,28 +59,24 @@ CmdResult CommandWhowas::Handle (const std::vector<std::string>& parameters, Use
 	}
 	else
 	{
-		whowas_set* grp = i->second;
-		if (!grp->empty())
+		for (WhoWas::SlotIndex slot = i->second.oldest; slot != WhoWas::NO_SLOT; slot = ring[slot].newer)
 		{
-			for (whowas_set::iterator ux = grp->begin(); ux != grp->end(); ux++)
-			{
-				WhoWasGroup* u = *ux;
-
-				user->WriteNumeric(RPL_WHOWASUSER, "%s %s %s * :%s", parameters[0].c_str(),
-					u->ident.c_str(),u->dhost.c_str(),u->gecos.c_str());
-
-				if (user->HasPrivPermission("users/auspex"))
-					user->WriteNumeric(RPL_WHOWASIP, "%s :was connecting from *@%s",
-						parameters[0].c_str(), u->host.c_str());
-
-				std::string signon = InspIRCd::TimeString(u->signon);
-				bool hide_server = (!ServerInstance->Config->HideWhoisServer.empty() && !user->HasPrivPermission("servers/auspex"));
-				user->WriteNumeric(RPL_WHOISSERVER, "%s %s :%s", parameters[0].c_str(), (hide_server ? ServerInstance->Config->HideWhoisServer.c_str() : u->server.c_str()), signon.c_str());
-			}
-		}
-		else
-		{
-			user->WriteNumeric(ERR_WASNOSUCHNICK, "%s :There was no such nickname", parameters[0].c_str());
+			const WhoWas::Entry& u = ring[slot];
+			const char* ident = u.strings;
+			const char* host = NextString(ident);
+			const char* dhost = NextString(host);
+			const char* gecos = NextString(dhost);
+
+			user->WriteNumeric(RPL_WHOWASUSER, "%s %s %s * :%s", parameters[0].c_str(),
+				ident, dhost, gecos);
+
+			if (user->HasPrivPermission("users/auspex"))
+				user->WriteNumeric(RPL_WHOWASIP, "%s :was connecting from *@%s",
+					parameters[0].c_str(), host);
+
+			std::string signon = InspIRCd::TimeString(u.signon);
+			bool hide_server = (!ServerInstance->Config->HideWhoisServer.empty() && !user->HasPrivPermission("servers/auspex"));
+			user->WriteNumeric(RPL_WHOISSERVER, "%s %s :%s", parameters[0].c_str(), (hide_server ? ServerInstance->Config->HideWhoisServer.c_str() : u.server->c_str()), signon.c_str());
 		}
 	}
 
@@ -79,15 +86,16 @@ CmdResult CommandWhowas::Handle (const std::vector<std::string>& parameters, Use
 
 std::string CommandWhowas::GetStats()
 {
-	int whowas_size = 0;
-	int whowas_bytes = 0;
-	for (whowas_users::iterator i = whowas.begin(); i != whowas.end(); ++i)
-	{
-		whowas_set* n = i->second;
-		whowas_size += n->size();
-		whowas_bytes += (sizeof(whowas_set) + ( sizeof(WhoWasGroup) * n->size() ) );
-	}
-	return "Whowas entries: " +ConvToStr(whowas_size)+" ("+ConvToStr(whowas_bytes)+" bytes)";
+	size_t whowas_bytes = ring.capacity() * sizeof(WhoWas::Entry) + stringbytes;
+	for (WhoWas::GroupMap::const_iterator i = whowas.begin(); i != whowas.end(); ++i)
+		whowas_bytes += sizeof(WhoWas::GroupMap::value_type) + i->first.length();
+	for (TR1NS::unordered_map<std::string, unsigned int>::const_iterator i = servernames.begin(); i != servernames.end(); ++i)
+		whowas_bytes += sizeof(*i) + i->first.length();
+
+	std::string stats = "Whowas entries: " + ConvToStr(entries) + " (" + ConvToStr(whowas_bytes) + " bytes";
+	if (entries)
+		stats.append(", " + ConvToStr(whowas_bytes / entries) + " bytes per entry");
+	return stats + ")";
 }
 
 void CommandWhowas::AddToWhoWas(User* user)
@@ -98,92 +106,153 @@ void CommandWhowas::AddToWhoWas(User* user)
 		return;
 	}
 
-	// Insert nick if it doesn't exist
-	// 'first' will point to the newly inserted element or to the existing element with an equivalent key
-	std::pair<whowas_users::iterator, bool> ret = whowas.insert(std::make_pair(irc::string(user->nick.c_str()), static_cast<whowas_set*>(NULL)));
+	WhoWas::Entry record;
+	record.signon = user->signon;
+	record.added = ServerInstance->Time();
 
-	if (ret.second) // If inserted
+	std::pair<TR1NS::unordered_map<std::string, unsigned int>::iterator, bool> server = servernames.insert(std::make_pair(user->server->GetName(), 0));
+	server.first->second++;
+	record.server = &server.first->first;
+
+	// Pack the strings into one allocation, each followed by its NUL byte
+	const size_t length = user->ident.length() + user->host.length() + user->dhost.length() + user->fullname.length() + 4;
+	char* out = record.strings = new char[length];
+	const std::string* strings[] = { &user->ident, &user->host, &user->dhost, &user->fullname };
+	for (size_t i = 0; i < sizeof(strings) / sizeof(strings[0]); ++i)
 	{
-		// This nick is new, create a list for it and add the first record to it
-		whowas_set* n = new whowas_set;
-		n->push_back(new WhoWasGroup(user));
-		ret.first->second = n;
+		memcpy(out, strings[i]->c_str(), strings[i]->length() + 1);
+		out += strings[i]->length() + 1;
+	}
+	stringbytes += length;
 
-		// Add this nick to the fifo too
-		whowas_fifo.push_back(std::make_pair(ServerInstance->Time(), ret.first->first));
+	Insert(user->nick, record);
+}
 
-		if (whowas.size() > this->MaxGroups)
-		{
-			// Too many nicks, remove the nick which was inserted the longest time ago from both the map and the fifo
-			whowas_users::iterator it = whowas.find(whowas_fifo.front().second);
-			if (it != whowas.end())
-			{
-				whowas_set* set = it->second;
-				for (whowas_set::iterator i = set->begin(); i != set->end(); ++i)
-					delete *i;
-
-				delete set;
-				whowas.erase(it);
-			}
-			whowas_fifo.pop_front();
-		}
-	}
-	else
+void CommandWhowas::Insert(const std::string& nick, const WhoWas::Entry& record)
+{
+	// Reuse the oldest slot once the ring is full
+	if (used == capacity)
+		PopFront();
+
+	// If there are too many records for this nick, remove the oldest
+	WhoWas::GroupMap::iterator it = whowas.find(nick);
+	if (it != whowas.end() && it->second.count >= this->GroupSize)
+		FreeSlot(it->second.oldest);
+
+	// Insert nick if it doesn't exist
+	// 'first' will point to the newly inserted element or to the existing element with an equivalent key
+	std::pair<WhoWas::GroupMap::iterator, bool> ret = whowas.insert(std::make_pair(nick, WhoWas::Group()));
+	if (ret.second && whowas.size() > this->MaxGroups)
 	{
-		// We've met this nick before, add a new record to the list
-		whowas_set* set = ret.first->second;
-		set->push_back(new WhoWasGroup(user));
+		// Too many nicks, remove all records of the nick with the oldest record.
+		// Unused slots at the front are dropped on the way, so each slot is only passed once.
+		while (used && !ring[first].group)
+			PopFront();
 
-		// If there are too many records for this nick, remove the oldest (front)
-		if (set->size() > this->GroupSize)
+		if (used)
 		{
-			delete set->front();
-			set->pop_front();
+			WhoWas::Group& oldgroup = ring[first].group->second;
+			while (oldgroup.count > 1)
+				FreeSlot(oldgroup.newest);
+			FreeSlot(oldgroup.oldest);
 		}
 	}
+
+	WhoWas::SlotIndex slot = (first + used) % capacity;
+	if (slot == ring.size())
+		ring.push_back(record);
+	else
+		ring[slot] = record;
+	used++;
+	entries++;
+
+	WhoWas::Group& group = ret.first->second;
+	WhoWas::Entry& entry = ring[slot];
+	entry.group = &*ret.first;
+	entry.newer = WhoWas::NO_SLOT;
+	entry.older = group.newest;
+	if (group.newest != WhoWas::NO_SLOT)
+		ring[group.newest].newer = slot;
+	else
+		group.oldest = slot;
+	group.newest = slot;
+	group.count++;
+}
+
+void CommandWhowas::FreeRecord(WhoWas::Entry& entry)
+{
+	TR1NS::unordered_map<std::string, unsigned int>::iterator server = servernames.find(*entry.server);
+	if (!--server->second)
+		servernames.erase(server);
+
+	const char* end = entry.strings;
+	for (unsigned int i = 0; i < 4; ++i)
+		end = NextString(end);
+	stringbytes -= (end - entry.strings);
+
+	delete[] entry.strings;
+	entry.strings = NULL;
+}
+
+void CommandWhowas::FreeSlot(WhoWas::SlotIndex slot)
+{
+	WhoWas::Entry& entry = ring[slot];
+	if (!entry.group)
+		return;
+
+	WhoWas::Group& group = entry.group->second;
+	if (entry.older != WhoWas::NO_SLOT)
+		ring[entry.older].newer = entry.newer;
+	else
+		group.oldest = entry.newer;
+	if (entry.newer != WhoWas::NO_SLOT)
+		ring[entry.newer].older = entry.older;
+	else
+		group.newest = entry.older;
+
+	if (!--group.count)
+		whowas.erase(whowas.find(entry.group->first));
+
+	FreeRecord(entry);
+	entry.group = NULL;
+	entries--;
+}
+
+void CommandWhowas::PopFront()
+{
+	FreeSlot(first);
+	first = (first + 1) % capacity;
+	used--;
 }
 
 /* on rehash, refactor maps according to new conf values */
 void CommandWhowas::Prune()
 {
-	time_t min = ServerInstance->Time() - this->MaxKeep;
+	// Take the records out and add them again under the new limits, oldest first
+	std::vector<WhoWas::Entry> oldring;
+	oldring.swap(ring);
+	WhoWas::GroupMap oldgroups;
+	oldgroups.swap(whowas);
+	const WhoWas::SlotIndex oldfirst = first;
+	const WhoWas::SlotIndex oldused = used;
+
+	first = used = 0;
+	entries = 0;
+	capacity = this->MaxGroups * this->GroupSize;
+	if (this->GroupSize && this->MaxGroups > UINT_MAX / this->GroupSize)
+		capacity = UINT_MAX - 1;
 
-	/* first cut the list to new size (maxgroups) and also prune entries that are timed out. */
-	while (!whowas_fifo.empty())
+	time_t min = ServerInstance->Time() - this->MaxKeep;
+	for (WhoWas::SlotIndex i = 0; i < oldused; ++i)
 	{
-		if ((whowas_fifo.size() > this->MaxGroups) || (whowas_fifo.front().first < min))
-		{
-			whowas_users::iterator iter = whowas.find(whowas_fifo.front().second);
-
-			/* hopefully redundant integrity check, but added while debugging r6216 */
-			if (iter == whowas.end())
-			{
-				/* this should never happen, if it does maps are corrupt */
-				ServerInstance->Logs->Log("WHOWAS", LOG_DEFAULT, "BUG: Whowas maps got corrupted! (1)");
-				return;
-			}
-
-			whowas_set* set = iter->second;
-			for (whowas_set::iterator i = set->begin(); i != set->end(); ++i)
-				delete *i;
-
-			delete set;
-			whowas.erase(iter);
-			whowas_fifo.pop_front();
-		}
-		else
-			break;
-	}
+		WhoWas::Entry& entry = oldring[(oldfirst + i) % oldring.size()];
+		if (!entry.group)
+			continue;
 
-	/* Then cut the whowas sets to new size (groupsize) */
-	for (whowas_users::iterator i = whowas.begin(); i != whowas.end(); ++i)
-	{
-		whowas_set* n = i->second;
-		while (n->size() > this->GroupSize)
-		{
-			delete n->front();
-			n->pop_front();
-		}
+		if (capacity && entry.added >= min)
+			Insert(entry.group->first, entry);
+		else
+			FreeRecord(entry);
 	}
 }
 
@@ -191,34 +260,19 @@ void CommandWhowas::Prune()
 void CommandWhowas::Maintain()
 {
 	time_t min = ServerInstance->Time() - this->MaxKeep;
-	for (whowas_users::iterator i = whowas.begin(); i != whowas.end(); ++i)
-	{
-		whowas_set* set = i->second;
-		while (!set->empty() && set->front()->signon < min)
-		{
-			delete set->front();
-			set->pop_front();
-		}
-	}
+	while (used && (!ring[first].group || ring[first].added < min))
+		PopFront();
 }
 
 CommandWhowas::~CommandWhowas()
 {
-	for (whowas_users::iterator i = whowas.begin(); i != whowas.end(); ++i)
+	for (std::vector<WhoWas::Entry>::iterator i = ring.begin(); i != ring.end(); ++i)
 	{
-		whowas_set* set = i->second;
-		for (whowas_set::iterator j = set->begin(); j != set->end(); ++j)
-			delete *j;
-
-		delete set;
+		if (i->group)
+			delete[] i->strings;
 	}
 }
 
-WhoWasGroup::WhoWasGroup(User* user) : host(user->host), dhost(user->dhost), ident(user->ident),
-	server(user->server->GetName()), gecos(user->fullname), signon(user->signon)
-{
-}
-
 class ModuleWhoWas : public Module
 {
 	CommandWhowas cmd;
@@ -31,7 +31,7 @@
 
 ServerConfig::ServerConfig()
 {
-	RawLog = HideBans = HideSplits = UndernetMsgPrefix = false;
+	RawLog = HideBans = HideSplits = UndernetMsgPrefix = HookProfiling = NeighborCache = false;
 	WildcardIPv6 = InvBypassModes = true;
 	dns_timeout = 5;
 	MaxTargets = 20;
@@ -42,6 +42,8 @@ ServerConfig::ServerConfig()
 	OperMaxChans = 30;
 	c_ipv4_range = 32;
 	c_ipv6_range = 128;
+	c_ipv4_bancache = 32;
+	c_ipv6_bancache = 64;
 }
 
 static void ValidHost(const std::string& p, const std::string& msg)
@@ -407,6 +409,8 @@ void ServerConfig::Fill()
 	OperMaxChans = ConfValue("channels")->getInt("opers", 60);
 	c_ipv4_range = ConfValue("cidr")->getInt("ipv4clone", 32);
 	c_ipv6_range = ConfValue("cidr")->getInt("ipv6clone", 128);
+	c_ipv4_bancache = ConfValue("cidr")->getInt("ipv4bancache", 32, 0, 32);
+	c_ipv6_bancache = ConfValue("cidr")->getInt("ipv6bancache", 64, 0, 128);
 	Limits.NickMax = ConfValue("limits")->getInt("maxnick", 32);
 	Limits.ChanMax = ConfValue("limits")->getInt("maxchan", 64);
 	Limits.MaxModes = ConfValue("limits")->getInt("maxmodes", 20);
@@ -423,6 +427,8 @@ void ServerConfig::Fill()
 	Paths.Module = ConfValue("path")->getString("moduledir", MOD_PATH);
 	InvBypassModes = options->getBool("invitebypassmodes", true);
 	NoSnoticeStack = options->getBool("nosnoticestack", false);
+	HookProfiling = ConfValue("performance")->getBool("hookprofiling");
+	NeighborCache = ConfValue("performance")->getBool("neighborcache");
 
 	if (Network.find(' ') != std::string::npos)
 		throw CoreException(Network + " is not a valid network name. A network name must not contain spaces.");
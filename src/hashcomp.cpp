@@ -305,6 +305,84 @@ bool irc::tokenstream::GetToken(long &token)
 	return returnval;
 }
 
+void irc::linetokenizer::Parse(const std::string& line)
+{
+	const char* p = line.data();
+	const char* const end = p + line.length();
+
+	tags.data = source.data = command.data = p;
+	tags.length = source.length = command.length = 0;
+	params.clear();
+
+	// Message tags are only allowed before everything else
+	bool tagsallowed = true;
+	// The first word after the tags may be the source and never starts the trailing parameter
+	bool first = true;
+	bool havecommand = false;
+	while (true)
+	{
+		while ((p != end) && (*p == ' '))
+			p++;
+		if (p == end)
+			break;
+
+		token tok;
+		tok.data = p;
+		if ((*p == ':') && (!first))
+		{
+			// The last parameter is everything after the colon
+			tok.data++;
+			p = end;
+		}
+		else
+		{
+			const char* wordend = static_cast<const char*>(memchr(p, ' ', end - p));
+			p = (wordend ? wordend : end);
+		}
+		tok.length = p - tok.data;
+
+		// Words before the command are never empty
+		if (tagsallowed)
+		{
+			tagsallowed = false;
+			if (*tok.data == '@')
+			{
+				tags.data = tok.data + 1;
+				tags.length = tok.length - 1;
+				continue;
+			}
+		}
+
+		if (first)
+		{
+			first = false;
+			if (*tok.data == ':')
+			{
+				source.data = tok.data + 1;
+				source.length = tok.length - 1;
+				continue;
+			}
+		}
+
+		if (havecommand)
+		{
+			params.push_back(tok);
+		}
+		else
+		{
+			command = tok;
+			havecommand = true;
+		}
+	}
+}
+
+void irc::linetokenizer::GetParameters(std::vector<std::string>& out) const
+{
+	out.resize(params.size());
+	for (size_t i = 0; i < params.size(); i++)
+		out[i].assign(params[i].data, params[i].length);
+}
+
 irc::sepstream::sepstream(const std::string& source, char separator, bool allowempty)
 	: tokens(source), sep(separator), pos(0), allow_empty(allowempty)
 {
@@ -69,6 +69,7 @@ InspIRCd* ServerInstance = NULL;
  * e.g. for national character support.
  */
 unsigned const char *national_case_insensitive_map = rfc_case_insensitive_map;
+unsigned int national_case_insensitive_map_version = 0;
 
 
 /* Moved from exitcodes.h -- due to duplicate symbols -- Burlex
@@ -150,14 +150,67 @@ CullResult StreamSocket::cull()
 	return EventHandler::cull();
 }
 
+size_t RecvQueue::find(char c) const
+{
+	if (empty())
+		return std::string::npos;
+	const char* pos = static_cast<const char*>(memchr(data(), c, length()));
+	return pos ? pos - data() : std::string::npos;
+}
+
+char* RecvQueue::prepare(size_t len)
+{
+	if (capacity - tail >= len)
+		return buf + tail;
+
+	const size_t used = length();
+	if (capacity - used >= len)
+	{
+		// Enough room if the consumed space at the front is reclaimed
+		memmove(buf, buf + head, used);
+	}
+	else
+	{
+		size_t newcapacity = std::max(capacity * 2, used + len);
+		char* newbuf = new char[newcapacity];
+		if (used)
+			memcpy(newbuf, buf + head, used);
+		delete[] buf;
+		buf = newbuf;
+		capacity = newcapacity;
+	}
+	head = 0;
+	tail = used;
+	return buf + tail;
+}
+
+void RecvQueue::append(const char* newdata, size_t len)
+{
+	memcpy(prepare(len), newdata, len);
+	commit(len);
+}
+
+void RecvQueue::erase_front(size_t len)
+{
+	head += len;
+	if (head >= tail)
+		clear();
+}
+
+void RecvQueue::clear()
+{
+	delete[] buf;
+	buf = NULL;
+	head = tail = capacity = 0;
+}
+
 bool StreamSocket::GetNextLine(std::string& line, char delim)
 {
-	std::string::size_type i = recvq.find(delim);
+	size_t i = recvq.find(delim);
 	if (i == std::string::npos)
 		return false;
-	line = recvq.substr(0, i);
-	// TODO is this the most efficient way to split?
-	recvq = recvq.substr(i + 1);
+	line.assign(recvq.data(), i);
+	recvq.erase_front(i + 1);
 	return true;
 }
 
@@ -183,18 +236,18 @@ void StreamSocket::DoRead()
 	}
 	else
 	{
-		char* ReadBuffer = ServerInstance->GetReadBuffer();
-		int n = ServerInstance->SE->Recv(this, ReadBuffer, ServerInstance->Config->NetBufferSize, 0);
-		if (n == ServerInstance->Config->NetBufferSize)
+		const int bufsiz = ServerInstance->Config->NetBufferSize;
+		int n = ServerInstance->SE->Recv(this, recvq.prepare(bufsiz), bufsiz, 0);
+		if (n == bufsiz)
 		{
 			ServerInstance->SE->ChangeEventMask(this, FD_WANT_FAST_READ | FD_ADD_TRIAL_READ);
-			recvq.append(ReadBuffer, n);
+			recvq.commit(n);
 			OnDataReady();
 		}
 		else if (n > 0)
 		{
 			ServerInstance->SE->ChangeEventMask(this, FD_WANT_FAST_READ);
-			recvq.append(ReadBuffer, n);
+			recvq.commit(n);
 			OnDataReady();
 		}
 		else if (n == 0)
@@ -216,6 +269,10 @@ void StreamSocket::DoRead()
 			ServerInstance->SE->ChangeEventMask(this, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
 		}
 	}
+
+	// Don't hold on to a read buffer that nothing was read into
+	if (recvq.empty())
+		recvq.clear();
 }
 
 /* Don't try to prepare huge blobs of data to send to a blocked socket */
@@ -240,7 +297,7 @@ void StreamSocket::DoWrite()
 		{
 			while (error.empty() && !sendq.empty())
 			{
-				if (sendq.size() > 1 && sendq[0].length() < 1024)
+				if (sendq.size() > 1 && sendq[0].str().length() < 1024)
 				{
 					// Avoid multiple repeated SSL encryption invocations
 					// This adds a single copy of the queue, but avoids
@@ -253,16 +310,18 @@ void StreamSocket::DoWrite()
 					tmp.reserve(1280);
 					while (!sendq.empty() && tmp.length() < 1024)
 					{
-						tmp.append(sendq.front());
+						tmp.append(sendq.front().str());
 						sendq.pop_front();
 					}
-					sendq.push_front(tmp);
+					sendq.push_front(SendQueueItem());
+					sendq.front().owned.swap(tmp);
 				}
-				std::string& front = sendq.front();
-				int itemlen = front.length();
+				SendQueueItem& front = sendq.front();
+				int itemlen = front.str().length();
 				if (GetIOHook())
 				{
-					rv = GetIOHook()->OnStreamSocketWrite(this, front);
+					std::string& data = front.GetMutable();
+					rv = GetIOHook()->OnStreamSocketWrite(this, data);
 					if (rv > 0)
 					{
 						// consumed the entire string, and is ready for more
@@ -275,7 +334,7 @@ void StreamSocket::DoWrite()
 						// IOHook has requested unblock notification from the socketengine
 
 						// Since it is possible that a partial write took place, adjust sendq_len
-						sendq_len = sendq_len - itemlen + front.length();
+						sendq_len = sendq_len - itemlen + data.length();
 						return;
 					}
 					else
@@ -287,7 +346,7 @@ void StreamSocket::DoWrite()
 #ifdef DISABLE_WRITEV
 				else
 				{
-					rv = ServerInstance->SE->Send(this, front.data(), itemlen, 0);
+					rv = ServerInstance->SE->Send(this, front.str().data(), itemlen, 0);
 					if (rv == 0)
 					{
 						SetError("Connection closed");
@@ -304,7 +363,7 @@ void StreamSocket::DoWrite()
 					else if (rv < itemlen)
 					{
 						ServerInstance->SE->ChangeEventMask(this, FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK);
-						front = front.substr(rv);
+						front.GetMutable().erase(0, rv);
 						sendq_len -= rv;
 						return;
 					}
@@ -348,9 +407,10 @@ void StreamSocket::DoWrite()
 			iovec* iovecs = new iovec[bufcount];
 			for(int i=0; i < bufcount; i++)
 			{
-				iovecs[i].iov_base = const_cast<char*>(sendq[i].data());
-				iovecs[i].iov_len = sendq[i].length();
-				rv_max += sendq[i].length();
+				const std::string& data = sendq[i].str();
+				iovecs[i].iov_base = const_cast<char*>(data.data());
+				iovecs[i].iov_len = data.length();
+				rv_max += data.length();
 			}
 			int rv = writev(fd, iovecs, bufcount);
 			delete[] iovecs;
@@ -373,17 +433,18 @@ void StreamSocket::DoWrite()
 				sendq_len -= rv;
 				while (rv > 0 && !sendq.empty())
 				{
-					std::string& front = sendq.front();
-					if (front.length() <= (size_t)rv)
+					SendQueueItem& front = sendq.front();
+					size_t itemlen = front.str().length();
+					if (itemlen <= (size_t)rv)
 					{
 						// this string got fully written out
-						rv -= front.length();
+						rv -= itemlen;
 						sendq.pop_front();
 					}
 					else
 					{
 						// stopped in the middle of this string
-						front = front.substr(rv);
+						front.GetMutable().erase(0, rv);
 						rv = 0;
 					}
 				}
@@ -429,12 +490,28 @@ void StreamSocket::WriteData(const std::string &data)
 	}
 
 	/* Append the data to the back of the queue ready for writing */
-	sendq.push_back(data);
+	sendq.push_back(SendQueueItem());
+	sendq.back().owned = data;
 	sendq_len += data.length();
 
 	ServerInstance->SE->ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
 }
 
+void StreamSocket::WriteData(SharedMessage* msg)
+{
+	if (fd < 0)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Attempt to write data to dead socket: %s",
+			msg->data.c_str());
+		return;
+	}
+
+	sendq.push_back(SendQueueItem(msg));
+	sendq_len += msg->data.length();
+
+	ServerInstance->SE->ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
+}
+
 bool SocketTimeout::Tick(time_t)
 {
 	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "SocketTimeout::Tick");
@@ -26,17 +26,18 @@
 #include <netinet/tcp.h>
 #endif
 
-ListenSocket::ListenSocket(ConfigTag* tag, const irc::sockets::sockaddrs& bind_to)
-	: bind_tag(tag)
-	, iohookprov(NULL, std::string())
+/** Create a socket listening on the given address
+ * @param tag The bind tag of the socket
+ * @param bind_to The address to listen on
+ * @param reuseport Whether other sockets may be bound to the same address
+ * @return The fd of the new socket or -1 on error, errno is preserved
+ */
+static int CreateListener(ConfigTag* tag, const irc::sockets::sockaddrs& bind_to, bool reuseport)
 {
-	irc::sockets::satoap(bind_to, bind_addr, bind_port);
-	bind_desc = bind_to.str();
+	int fd = socket(bind_to.sa.sa_family, SOCK_STREAM, 0);
 
-	fd = socket(bind_to.sa.sa_family, SOCK_STREAM, 0);
-
-	if (this->fd == -1)
-		return;
+	if (fd == -1)
+		return -1;
 
 #ifdef IPV6_V6ONLY
 	/* This OS supports IPv6 sockets that can also listen for IPv4
@@ -57,9 +58,17 @@ ListenSocket::ListenSocket(ConfigTag* tag, const irc::sockets::sockaddrs& bind_t
 #endif
 
 	ServerInstance->SE->SetReuse(fd);
-	int rv = ServerInstance->SE->Bind(this->fd, bind_to);
+#ifdef SO_REUSEPORT
+	if (reuseport)
+	{
+		int on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+	}
+#endif
+
+	int rv = ServerInstance->SE->Bind(fd, bind_to);
 	if (rv >= 0)
-		rv = ServerInstance->SE->Listen(this->fd, ServerInstance->Config->MaxConn);
+		rv = ServerInstance->SE->Listen(fd, ServerInstance->Config->MaxConn);
 
 	int timeout = tag->getInt("defer", 0);
 	if (timeout && !rv)
@@ -77,22 +86,212 @@ ListenSocket::ListenSocket(ConfigTag* tag, const irc::sockets::sockaddrs& bind_t
 	if (rv < 0)
 	{
 		int errstore = errno;
-		ServerInstance->SE->Shutdown(this, 2);
-		ServerInstance->SE->Close(this);
-		this->fd = -1;
+		ServerInstance->SE->Shutdown(fd, 2);
+		ServerInstance->SE->Close(fd);
 		errno = errstore;
+		return -1;
 	}
-	else
+	return fd;
+}
+
+/** Get the local address of a new connection and turn 4in6 addresses into IPv4 ones.
+ * Safe to call from any thread.
+ * @return False if the local address could not be determined
+ */
+static bool FixConnectionAddresses(int incomingSockfd, const ListenSocket* ls, irc::sockets::sockaddrs& client, irc::sockets::sockaddrs& server)
+{
+	bool ret = true;
+	socklen_t sz = sizeof(server);
+	if (getsockname(incomingSockfd, &server.sa, &sz))
+	{
+		irc::sockets::aptosa(ls->bind_addr, ls->bind_port, server);
+		ret = false;
+	}
+
+	if (client.sa.sa_family == AF_INET6)
+	{
+		/*
+		 * This case is the be all and end all patch to catch and nuke 4in6
+		 * instead of special-casing shit all over the place and wreaking merry
+		 * havoc with crap, instead, we just recreate sockaddr and strip ::ffff: prefix
+		 * if it's a 4in6 IP.
+		 *
+		 * This is, of course, much improved over the older way of handling this
+		 * (pretend it doesn't exist + hack around it -- yes, both were done!)
+		 *
+		 * Big, big thanks to danieldg for his work on this.
+		 * -- w00t
+		 */
+		static const unsigned char prefix4in6[12] = { 0,0,0,0, 0,0,0,0, 0,0,0xFF,0xFF };
+		if (!memcmp(prefix4in6, &client.in6.sin6_addr, 12))
+		{
+			// recreate as a sockaddr_in using the IPv4 IP
+			uint16_t sport = client.in6.sin6_port;
+			client.in4.sin_family = AF_INET;
+			client.in4.sin_port = sport;
+			memcpy(&client.in4.sin_addr.s_addr, client.in6.sin6_addr.s6_addr + 12, sizeof(uint32_t));
+
+			sport = server.in6.sin6_port;
+			server.in4.sin_family = AF_INET;
+			server.in4.sin_port = sport;
+			memcpy(&server.in4.sin_addr.s_addr, server.in6.sin6_addr.s6_addr + 12, sizeof(uint32_t));
+		}
+	}
+	return ret;
+}
+
+#ifdef SO_REUSEPORT
+/** Accepts connections on its own SO_REUSEPORT socket. The kernel spreads new
+ * connections over all sockets bound to the address, the accepted connections are
+ * handed to the main thread in batches as only it may create users.
+ */
+class AcceptThread : public SocketThread
+{
+	struct Connection
+	{
+		int fd;
+		irc::sockets::sockaddrs client;
+		irc::sockets::sockaddrs server;
+	};
+
+	ListenSocket* const listener;
+	const int sockfd;
+
+	/** Connections not yet seen by the main thread, guarded by the queue lock
+	 */
+	std::vector<Connection> accepted;
+
+	/** Number of failed accept() calls, guarded by the queue lock
+	 */
+	unsigned long refused;
+
+ public:
+	AcceptThread(ListenSocket* ls, int fd)
+		: listener(ls)
+		, sockfd(fd)
+		, refused(0)
+	{
+	}
+
+	~AcceptThread()
+	{
+		ServerInstance->SE->Close(sockfd);
+	}
+
+	/** Stop the thread and close connections the main thread has not picked up
+	 */
+	void Stop()
+	{
+		SetExitFlag();
+		// Wakes up the thread if it is blocked in accept()
+		ServerInstance->SE->Shutdown(sockfd, 2);
+		join();
+
+		for (std::vector<Connection>::const_iterator i = accepted.begin(); i != accepted.end(); ++i)
+			ServerInstance->SE->Close(i->fd);
+		accepted.clear();
+	}
+
+	void Run()
+	{
+		while (!GetExitFlag())
+		{
+			Connection conn;
+			socklen_t length = sizeof(conn.client);
+			conn.fd = accept(sockfd, &conn.client.sa, &length);
+			int errstore = errno;
+			if (conn.fd >= 0)
+				FixConnectionAddresses(conn.fd, listener, conn.client, conn.server);
+			else if (GetExitFlag())
+				break;
+
+			LockQueue();
+			// If something is pending the main thread has not picked it up yet
+			if ((accepted.empty()) && (!refused))
+				NotifyParent();
+			if (conn.fd >= 0)
+				accepted.push_back(conn);
+			else
+				refused++;
+			UnlockQueue();
+
+			// Back off instead of spinning when we are out of fds
+			if ((conn.fd < 0) && ((errstore == EMFILE) || (errstore == ENFILE)))
+				usleep(100000);
+		}
+	}
+
+	void OnNotify()
+	{
+		std::vector<Connection> conns;
+		LockQueue();
+		conns.swap(accepted);
+		ServerInstance->stats->statsRefused += refused;
+		refused = 0;
+		UnlockQueue();
+
+		for (std::vector<Connection>::iterator i = conns.begin(); i != conns.end(); ++i)
+			listener->AcceptConnection(i->fd, i->client, i->server);
+	}
+};
+#endif
+
+ListenSocket::ListenSocket(ConfigTag* tag, const irc::sockets::sockaddrs& bind_to)
+	: bind_tag(tag)
+	, iohookprov(NULL, std::string())
+{
+	irc::sockets::satoap(bind_to, bind_addr, bind_port);
+	bind_desc = bind_to.str();
+
+	unsigned int threadcount = tag->getInt("acceptthreads", 0, 0, 64);
+	fd = CreateListener(tag, bind_to, (threadcount > 0));
+	if (this->fd == -1)
+		return;
+
+	ServerInstance->SE->NonBlocking(this->fd);
+	ServerInstance->SE->AddFd(this, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
+
+	this->ResetIOHookProvider();
+
+#ifdef SO_REUSEPORT
+	for (unsigned int i = 0; i < threadcount; i++)
 	{
-		ServerInstance->SE->NonBlocking(this->fd);
-		ServerInstance->SE->AddFd(this, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
+		int threadfd = CreateListener(tag, bind_to, true);
+		if (threadfd < 0)
+		{
+			ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "Unable to create an accept thread socket for %s: %s", bind_desc.c_str(), strerror(errno));
+			break;
+		}
 
-		this->ResetIOHookProvider();
+		AcceptThread* thread = new AcceptThread(this, threadfd);
+		try
+		{
+			ServerInstance->Threads->Start(thread);
+		}
+		catch (CoreException& ex)
+		{
+			ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "Unable to start an accept thread for %s: %s", bind_desc.c_str(), ex.GetReason().c_str());
+			delete thread;
+			break;
+		}
+		acceptthreads.push_back(thread);
 	}
+#else
+	if (threadcount)
+		ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "Ignoring acceptthreads for %s, SO_REUSEPORT is not supported on this platform", bind_desc.c_str());
+#endif
 }
 
 ListenSocket::~ListenSocket()
 {
+#ifdef SO_REUSEPORT
+	for (std::vector<AcceptThread*>::const_iterator i = acceptthreads.begin(); i != acceptthreads.end(); ++i)
+	{
+		(*i)->Stop();
+		delete *i;
+	}
+#endif
+
 	if (this->GetFd() > -1)
 	{
 		ServerInstance->SE->DelFd(this);
@@ -120,13 +319,14 @@ void ListenSocket::AcceptInternal()
 		return;
 	}
 
-	socklen_t sz = sizeof(server);
-	if (getsockname(incomingSockfd, &server.sa, &sz))
-	{
+	if (!FixConnectionAddresses(incomingSockfd, this, client, server))
 		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Can't get peername: %s", strerror(errno));
-		irc::sockets::aptosa(bind_addr, bind_port, server);
-	}
 
+	AcceptConnection(incomingSockfd, client, server);
+}
+
+void ListenSocket::AcceptConnection(int incomingSockfd, irc::sockets::sockaddrs& client, irc::sockets::sockaddrs& server)
+{
 	/*
 	 * XXX -
 	 * this is done as a safety check to keep the file descriptors within range of fd_ref_table.
@@ -146,36 +346,6 @@ void ListenSocket::AcceptInternal()
 		return;
 	}
 
-	if (client.sa.sa_family == AF_INET6)
-	{
-		/*
-		 * This case is the be all and end all patch to catch and nuke 4in6
-		 * instead of special-casing shit all over the place and wreaking merry
-		 * havoc with crap, instead, we just recreate sockaddr and strip ::ffff: prefix
-		 * if it's a 4in6 IP.
-		 *
-		 * This is, of course, much improved over the older way of handling this
-		 * (pretend it doesn't exist + hack around it -- yes, both were done!)
-		 *
-		 * Big, big thanks to danieldg for his work on this.
-		 * -- w00t
-		 */
-		static const unsigned char prefix4in6[12] = { 0,0,0,0, 0,0,0,0, 0,0,0xFF,0xFF };
-		if (!memcmp(prefix4in6, &client.in6.sin6_addr, 12))
-		{
-			// recreate as a sockaddr_in using the IPv4 IP
-			uint16_t sport = client.in6.sin6_port;
-			client.in4.sin_family = AF_INET;
-			client.in4.sin_port = sport;
-			memcpy(&client.in4.sin_addr.s_addr, client.in6.sin6_addr.s6_addr + 12, sizeof(uint32_t));
-
-			sport = server.in6.sin6_port;
-			server.in4.sin_family = AF_INET;
-			server.in4.sin_port = sport;
-			memcpy(&server.in4.sin_addr.s_addr, server.in6.sin6_addr.s6_addr + 12, sizeof(uint32_t));
-		}
-	}
-
 	ServerInstance->SE->NonBlocking(incomingSockfd);
 
 	ModResult res;
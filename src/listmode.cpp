@@ -19,6 +19,117 @@
 #include "inspircd.h"
 #include "listmode.h"
 
+namespace
+{
+	/** Setters of list mode items with the number of items which refer to them
+	 */
+	typedef TR1NS::unordered_map<std::string, unsigned int> SetterMap;
+	SetterMap setters;
+
+	/** Get the interned copy of a setter, adding a reference to it
+	 * @param setter The setter
+	 * @return The interned setter
+	 */
+	const std::string* AcquireSetter(const std::string& setter)
+	{
+		std::pair<SetterMap::iterator, bool> ret = setters.insert(std::make_pair(setter, 0));
+		ret.first->second++;
+		return &ret.first->first;
+	}
+
+	/** Remove a reference to an interned setter, freeing it if it was the last one
+	 * @param setter The interned setter
+	 */
+	void ReleaseSetter(const std::string* setter)
+	{
+		SetterMap::iterator it = setters.find(*setter);
+		if (!--it->second)
+			setters.erase(it);
+	}
+
+	/** Check whether a list item is an extban
+	 * @param mask The mask of the item
+	 * @return True if the mask is an extban
+	 */
+	bool IsExtBan(const std::string& mask)
+	{
+		return ((mask.length() > 2) && (mask[1] == ':'));
+	}
+}
+
+ListModeBase::ChanData::~ChanData()
+{
+	for (ModeList::const_iterator it = list.begin(); it != list.end(); ++it)
+	{
+		if (it->setter)
+			ReleaseSetter(it->setter);
+	}
+}
+
+void ListModeBase::ChanData::Add(const std::string& mask, const std::string& setter)
+{
+	const ModeList::size_type pos = list.size();
+	list.push_back(ListItem(mask, AcquireSetter(setter), ServerInstance->Time()));
+	index[mask] = pos;
+	if (IsExtBan(mask))
+		extbans[mask[0]].push_back(ExtBanItem(pos, mask.substr(2)));
+}
+
+void ListModeBase::ChanData::Remove(ModeList::size_type pos)
+{
+	ListItem& item = list[pos];
+	index.erase(item.mask);
+	ReleaseSetter(item.setter);
+	item.setter = NULL;
+	removed++;
+}
+
+void ListModeBase::ChanData::Compact()
+{
+	if (!removed)
+		return;
+
+	// New position of every item, or npos for the removed ones
+	std::vector<ModeList::size_type> positions(list.size(), std::string::npos);
+	ModeList::size_type to = 0;
+	for (ModeList::size_type from = 0; from < list.size(); from++)
+	{
+		if (!list[from].setter)
+			continue;
+
+		if (from != to)
+		{
+			list[to] = list[from];
+			index[list[to].mask] = to;
+		}
+		positions[from] = to++;
+	}
+	list.erase(list.begin() + to, list.end());
+	removed = 0;
+
+	for (std::map<char, ExtBanList>::iterator it = extbans.begin(); it != extbans.end(); )
+	{
+		ExtBanList& items = it->second;
+		ExtBanList::size_type keep = 0;
+		for (ExtBanList::size_type i = 0; i < items.size(); i++)
+		{
+			const ModeList::size_type pos = positions[items[i].pos];
+			if (pos == std::string::npos)
+				continue;
+
+			if (i != keep)
+				items[keep] = items[i];
+			items[keep++].pos = pos;
+		}
+		items.erase(items.begin() + keep, items.end());
+
+		if (items.empty())
+			extbans.erase(it++);
+		else
+			++it;
+	}
+}
+
 ListModeBase::ListModeBase(Module* Creator, const std::string& Name, char modechar, const std::string &eolstr, unsigned int lnum, unsigned int eolnum, bool autotidy, const std::string &ctag)
 	: ModeHandler(Creator, Name, modechar, PARAM_ALWAYS, MODETYPE_CHANNEL, MC_LIST),
 	listnumeric(lnum), endoflistnumeric(eolnum), endofliststring(eolstr), tidy(autotidy),
@@ -32,9 +143,10 @@ void ListModeBase::DisplayList(User* user, Channel* channel)
 	ChanData* cd = extItem.get(channel);
 	if (cd)
 	{
+		cd->Compact();
 		for (ModeList::reverse_iterator it = cd->list.rbegin(); it != cd->list.rend(); ++it)
 		{
-			user->WriteNumeric(listnumeric, "%s %s %s %lu", channel->name.c_str(), it->mask.c_str(), (!it->setter.empty() ? it->setter.c_str() : ServerInstance->Config->ServerName.c_str()), (unsigned long) it->time);
+			user->WriteNumeric(listnumeric, "%s %s %s %lu", channel->name.c_str(), it->mask.c_str(), (!it->setter->empty() ? it->setter->c_str() : ServerInstance->Config->ServerName.c_str()), (unsigned long) it->time);
 		}
 	}
 	user->WriteNumeric(endoflistnumeric, "%s :%s", channel->name.c_str(), endofliststring.c_str());
@@ -50,6 +162,7 @@ void ListModeBase::RemoveMode(Channel* channel, irc::modestacker& stack)
 	ChanData* cd = extItem.get(channel);
 	if (cd)
 	{
+		cd->Compact();
 		for (ModeList::iterator it = cd->list.begin(); it != cd->list.end(); it++)
 		{
 			stack.Push(this->GetModeChar(), it->mask);
@@ -140,19 +253,16 @@ ModeAction ListModeBase::OnModeChange(User* source, User*, Channel* channel, std
 		}
 
 		// Check if the item already exists in the list
-		for (ModeList::iterator it = cd->list.begin(); it != cd->list.end(); it++)
+		if (cd->index.find(parameter) != cd->index.end())
 		{
-			if (parameter == it->mask)
-			{
-				/* Give a subclass a chance to error about this */
-				TellAlreadyOnList(source, channel, parameter);
+			/* Give a subclass a chance to error about this */
+			TellAlreadyOnList(source, channel, parameter);
 
-				// it does, deny the change
-				return MODEACTION_DENY;
-			}
+			// it does, deny the change
+			return MODEACTION_DENY;
 		}
 
-		if ((IS_LOCAL(source)) && (cd->list.size() >= GetLimitInternal(channel->name, cd)))
+		if ((IS_LOCAL(source)) && (cd->GetCount() >= GetLimitInternal(channel->name, cd)))
 		{
 			/* List is full, give subclass a chance to send a custom message */
 			TellListTooLong(source, channel, parameter);
@@ -172,7 +282,8 @@ ModeAction ListModeBase::OnModeChange(User* source, User*, Channel* channel, std
 		if (ValidateParam(source, channel, parameter))
 		{
 			// And now add the mask onto the list...
-			cd->list.push_back(ListItem(parameter, source->nick, ServerInstance->Time()));
+			cd->Add(parameter, source->nick);
+			channel->InvalidateBanCache();
 			return MODEACTION_ALLOW;
 		}
 		else
@@ -186,13 +297,12 @@ ModeAction ListModeBase::OnModeChange(User* source, User*, Channel* channel, std
 		// We're taking the mode off
 		if (cd)
 		{
-			for (ModeList::iterator it = cd->list.begin(); it != cd->list.end(); ++it)
+			TR1NS::unordered_map<std::string, ModeList::size_type>::const_iterator it = cd->index.find(parameter);
+			if (it != cd->index.end())
 			{
-				if (parameter == it->mask)
-				{
-					cd->list.erase(it);
-					return MODEACTION_ALLOW;
-				}
+				cd->Remove(it->second);
+				channel->InvalidateBanCache();
+				return MODEACTION_ALLOW;
 			}
 		}
 
@@ -67,13 +67,14 @@ void Event::Send()
 
 // These declarations define the behavours of the base class Module (which does nothing at all)
 
-Module::Module() { }
+Module::Module() : hookstats(NULL) { }
 CullResult Module::cull()
 {
 	return classbase::cull();
 }
 Module::~Module()
 {
+	delete[] hookstats;
 }
 
 void Module::DetachEvent(Implementation i)
@@ -147,7 +148,7 @@ ModResult	Module::OnChannelPreDelete(Channel*) { DetachEvent(I_OnChannelPreDelet
 void		Module::OnChannelDelete(Channel*) { DetachEvent(I_OnChannelDelete); }
 ModResult	Module::OnSetAway(User*, const std::string &) { DetachEvent(I_OnSetAway); return MOD_RES_PASSTHRU; }
 ModResult	Module::OnWhoisLine(User*, User*, int&, std::string&) { DetachEvent(I_OnWhoisLine); return MOD_RES_PASSTHRU; }
-void		Module::OnBuildNeighborList(User*, IncludeChanList&, std::map<User*,bool>&) { DetachEvent(I_OnBuildNeighborList); }
+void		Module::OnBuildNeighborList(User*, IncludeChanList&, NeighborExceptions&) { DetachEvent(I_OnBuildNeighborList); }
 void		Module::OnGarbageCollect() { DetachEvent(I_OnGarbageCollect); }
 ModResult	Module::OnSetConnectClass(LocalUser* user, ConnectClass* myclass) { DetachEvent(I_OnSetConnectClass); return MOD_RES_PASSTHRU; }
 void 		Module::OnText(User*, void*, int, const std::string&, char, CUList&) { DetachEvent(I_OnText); }
@@ -157,6 +158,7 @@ ModResult	Module::OnNumeric(User*, unsigned int, const std::string&) { DetachEve
 ModResult   Module::OnAcceptConnection(int, ListenSocket*, irc::sockets::sockaddrs*, irc::sockets::sockaddrs*) { DetachEvent(I_OnAcceptConnection); return MOD_RES_PASSTHRU; }
 void		Module::OnSendWhoLine(User*, const std::vector<std::string>&, User*, Channel*, std::string&) { DetachEvent(I_OnSendWhoLine); }
 void		Module::OnSetUserIP(LocalUser*) { DetachEvent(I_OnSetUserIP); }
+void		Module::OnBufferFlushed(LocalUser*) { DetachEvent(I_OnBufferFlushed); }
 
 ServiceProvider::ServiceProvider(Module* Creator, const std::string& Name, ServiceType Type)
 	: creator(Creator), name(Name), service(Type)
@@ -176,12 +178,121 @@ void ServiceProvider::DisableAutoRegister()
 	}
 }
 
+/** Names of the events, indexed by Implementation
+ */
+static const char* const EventNames[] =
+{
+	"BEGIN",
+	"OnUserConnect", "OnUserQuit", "OnUserDisconnect", "OnUserJoin", "OnUserPart",
+	"OnSendSnotice", "OnUserPreJoin", "OnUserPreKick", "OnUserKick", "OnOper", "OnInfo", "OnWhois",
+	"OnUserPreInvite", "OnUserInvite", "OnUserPreMessage", "OnUserPreNick",
+	"OnUserMessage", "OnMode", "OnSyncUser",
+	"OnSyncChannel", "OnDecodeMetaData", "OnAcceptConnection", "OnUserInit",
+	"OnChangeHost", "OnChangeName", "OnAddLine", "OnDelLine", "OnExpireLine",
+	"OnUserPostNick", "OnPreMode", "On005Numeric", "OnKill", "OnLoadModule",
+	"OnUnloadModule", "OnBackgroundTimer", "OnPreCommand", "OnCheckReady", "OnCheckInvite",
+	"OnRawMode", "OnCheckKey", "OnCheckLimit", "OnCheckBan", "OnCheckChannelBan", "OnExtBanCheck",
+	"OnStats", "OnChangeLocalUserHost", "OnPreTopicChange",
+	"OnPostTopicChange", "OnEvent", "OnGlobalOper", "OnPostConnect",
+	"OnChangeLocalUserGECOS", "OnUserRegister", "OnChannelPreDelete", "OnChannelDelete",
+	"OnPostOper", "OnSyncNetwork", "OnSetAway", "OnPostCommand", "OnPostJoin",
+	"OnWhoisLine", "OnBuildNeighborList", "OnGarbageCollect", "OnSetConnectClass",
+	"OnText", "OnPassCompare", "OnRunTestSuite", "OnNamesListItem", "OnNumeric",
+	"OnPreRehash", "OnModuleRehash", "OnSendWhoLine", "OnChangeIdent", "OnSetUserIP",
+	"OnBufferFlushed",
+};
+
+/* Fails to compile if a name is missing */
+typedef char EventNamesComplete[(sizeof(EventNames) / sizeof(EventNames[0]) == I_END) ? 1 : -1];
+
+/** The table of events no module is attached to
+ */
+static Module* const EmptyEventTable[] = { NULL };
+
+/** An event table that was replaced, deleted at the end of the main loop iteration
+ */
+class RetiredEventTable : public classbase
+{
+	Module* const* const table;
+
+ public:
+	RetiredEventTable(Module* const* oldtable) : table(oldtable) { }
+	~RetiredEventTable() { delete[] table; }
+};
+
 ModuleManager::ModuleManager()
+	: startticks(GetTicks()), startclock(GetClock())
 {
+	for (size_t i = 0; i != I_END; ++i)
+		EventTables[i] = EmptyEventTable;
 }
 
 ModuleManager::~ModuleManager()
 {
+	for (size_t i = 0; i != I_END; ++i)
+	{
+		if (EventTables[i] != EmptyEventTable)
+			delete[] EventTables[i];
+	}
+}
+
+uint64_t ModuleManager::GetClock()
+{
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	if (!frequency.QuadPart)
+		QueryPerformanceFrequency(&frequency);
+
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return (now.QuadPart / frequency.QuadPart) * 1000000000 + (now.QuadPart % frequency.QuadPart) * 1000000000 / frequency.QuadPart;
+#elif defined HAS_CLOCK_GETTIME
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+#else
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_usec * 1000;
+#endif
+}
+
+uint64_t ModuleManager::TicksToNanoseconds(uint64_t ticks) const
+{
+	// Measure the rate of the ticks over the whole uptime
+	const uint64_t elapsedticks = GetTicks() - startticks;
+	const uint64_t elapsedclock = GetClock() - startclock;
+	if (!elapsedticks)
+		return ticks;
+	return static_cast<uint64_t>(ticks * (static_cast<double>(elapsedclock) / elapsedticks));
+}
+
+const char* ModuleManager::GetEventName(Implementation i)
+{
+	return EventNames[i];
+}
+
+void ModuleManager::RebuildEventTable(Implementation i)
+{
+	const IntModuleList& handlers = EventHandlers[i];
+	Module** table = NULL;
+	if (!handlers.empty())
+	{
+		table = new Module*[handlers.size() + 1];
+		std::reverse_copy(handlers.begin(), handlers.end(), table);
+		table[handlers.size()] = NULL;
+	}
+
+	if (EventTables[i] != EmptyEventTable)
+		ServerInstance->GlobalCulls.AddItem(new RetiredEventTable(EventTables[i]));
+	EventTables[i] = (table ? table : EmptyEventTable);
+
+	// The ban verdicts cached in memberships depend on the modules handling these events
+	if ((i == I_OnCheckBan) || (i == I_OnExtBanCheck) || (i == I_OnCheckChannelBan))
+	{
+		for (chan_hash::const_iterator c = ServerInstance->chanlist->begin(); c != ServerInstance->chanlist->end(); ++c)
+			c->second->InvalidateBanCache();
+	}
 }
 
 bool ModuleManager::Attach(Implementation i, Module* mod)
@@ -190,6 +301,7 @@ bool ModuleManager::Attach(Implementation i, Module* mod)
 		return false;
 
 	EventHandlers[i].push_back(mod);
+	RebuildEventTable(i);
 	return true;
 }
 
@@ -201,6 +313,7 @@ bool ModuleManager::Detach(Implementation i, Module* mod)
 		return false;
 
 	EventHandlers[i].erase(x);
+	RebuildEventTable(i);
 	return true;
 }
 
@@ -326,6 +439,7 @@ swap_now:
 
 			std::swap(EventHandlers[i][j], EventHandlers[i][j+incrmnt]);
 		}
+		RebuildEventTable(i);
 	}
 
 	return true;
@@ -806,7 +806,7 @@ info_done_dealloc:
 		CloseSession();
 	}
 
-	int OnStreamSocketRead(StreamSocket* user, std::string& recvq) CXX11_OVERRIDE
+	int OnStreamSocketRead(StreamSocket* user, RecvQueue& recvq) CXX11_OVERRIDE
 	{
 		if (!this->sess)
 		{
@@ -831,12 +831,12 @@ info_done_dealloc:
 
 		if (this->status == ISSL_HANDSHAKEN)
 		{
-			char* buffer = ServerInstance->GetReadBuffer();
 			size_t bufsiz = ServerInstance->Config->NetBufferSize;
+			char* buffer = recvq.prepare(bufsiz);
 			int ret = gnutls_record_recv(this->sess, buffer, bufsiz);
 			if (ret > 0)
 			{
-				recvq.append(buffer, ret);
+				recvq.commit(ret);
 				return 1;
 			}
 			else if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED)
@@ -62,6 +62,8 @@ char* get_error()
 
 static int OnVerify(int preverify_ok, X509_STORE_CTX* ctx);
 
+class OpenSSLIOHook;
+
 namespace OpenSSL
 {
 	class Exception : public ModuleException
@@ -233,6 +235,95 @@ namespace OpenSSL
 		SSL* CreateClientSession() { return clictx.CreateSession(); }
 		const EVP_MD* GetDigest() { return digest; }
 	};
+
+	/** Encrypts and sends data of open sessions off the main thread.
+	 * A session is handed to the worker by putting it on the queue. From then on the SSL
+	 * object and the pending plaintext of the session belong to the worker until the main
+	 * thread picks the session up from the done list in OnNotify().
+	 */
+	class Worker : public SocketThread
+	{
+		/** Sessions waiting to be written, guarded by the queue lock
+		 */
+		std::deque<OpenSSLIOHook*> queue;
+
+		/** Sessions written by the worker but not yet seen by the main thread, guarded by the queue lock
+		 */
+		std::vector<OpenSSLIOHook*> done;
+
+		/** Held by the worker while it is writing a session
+		 */
+		Mutex writelock;
+
+		/** All sessions using this worker, main thread only
+		 */
+		std::set<OpenSSLIOHook*> sessions;
+
+	 public:
+		/** Register a new session with this worker
+		 */
+		void Attach(OpenSSLIOHook* hook) { sessions.insert(hook); }
+
+		/** Queue a session for writing. The queue lock must be held, it is released by this call.
+		 */
+		void Submit(OpenSSLIOHook* hook);
+
+		/** Take a session away from the worker, waiting for it if it is writing the session right now
+		 */
+		void Detach(OpenSSLIOHook* hook);
+
+		/** Detach all sessions, called after the thread has been stopped
+		 */
+		void DetachAll();
+
+		void Run();
+		void OnNotify();
+	};
+
+	/** Set of workers that sessions are distributed over
+	 */
+	class WorkerPool
+	{
+		std::vector<Worker*> workers;
+		unsigned int next;
+
+	 public:
+		WorkerPool() : next(0) { }
+		~WorkerPool() { Stop(); }
+
+		/** Start the given number of worker threads
+		 */
+		void Start(unsigned int count);
+
+		/** Stop all workers, sessions using them go back to doing their writes on the main thread
+		 */
+		void Stop();
+
+		/** Get the worker to use for a new session
+		 * @return A worker, or NULL if there are no workers
+		 */
+		Worker* Get()
+		{
+			if (workers.empty())
+				return NULL;
+			next = (next + 1) % workers.size();
+			return workers[next];
+		}
+	};
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	/** Locks used by OpenSSL versions before 1.1.0 to protect their internal state
+	 */
+	static Mutex* locks = NULL;
+
+	static void LockingCallback(int mode, int n, const char* file, int line)
+	{
+		if (mode & CRYPTO_LOCK)
+			locks[n].Lock();
+		else
+			locks[n].Unlock();
+	}
+#endif
 }
 
 static int OnVerify(int preverify_ok, X509_STORE_CTX *ctx)
@@ -252,11 +343,37 @@ static int OnVerify(int preverify_ok, X509_STORE_CTX *ctx)
 class OpenSSLIOHook : public SSLIOHook
 {
  private:
+	friend class OpenSSL::Worker;
+
+	enum OffloadState { OFFLOAD_IDLE, OFFLOAD_QUEUED, OFFLOAD_BUSY, OFFLOAD_DONE };
+	enum OffloadResult { OFFLOAD_OK, OFFLOAD_WANT_WRITE, OFFLOAD_WANT_READ, OFFLOAD_ERROR };
+
 	SSL* sess;
 	issl_status status;
 	const bool outbound;
 	bool data_to_write;
 	reference<OpenSSL::Profile> profile;
+	StreamSocket* const sock;
+
+	/** Worker doing our writes, NULL if they are done on the main thread
+	 */
+	OpenSSL::Worker* worker;
+
+	/** Plaintext given to the worker, or left over after it could not send all of it
+	 */
+	std::string offload_buf;
+
+	/** Where the session is in the worker, guarded by the queue lock of the worker
+	 */
+	OffloadState offload_state;
+
+	/** Outcome of the last write done by the worker
+	 */
+	OffloadResult offload_result;
+
+	/** True if reading was stopped because the worker was using the session
+	 */
+	bool read_deferred;
 
 	bool Handshake(StreamSocket* user)
 	{
@@ -372,14 +489,117 @@ class OpenSSLIOHook : public SSLIOHook
 		X509_free(cert);
 	}
 
+	/** Hand the next piece of data to the worker
+	 * @return 1 if everything has been written, 0 if the worker is still busy, -1 on error
+	 */
+	int OffloadWrite(StreamSocket* user, std::string& buffer)
+	{
+		worker->LockQueue();
+		if (offload_state != OFFLOAD_IDLE)
+		{
+			// The worker is still busy with our session, it will tell us when it is done
+			worker->UnlockQueue();
+			return 0;
+		}
+
+		if (offload_result == OFFLOAD_ERROR)
+		{
+			worker->UnlockQueue();
+			CloseSession();
+			return -1;
+		}
+
+		if ((offload_buf.empty()) && (buffer.empty()))
+		{
+			// This is the empty item we left behind when we took the data, the worker has sent it
+			worker->UnlockQueue();
+			data_to_write = false;
+			ServerInstance->SE->ChangeEventMask(user, FD_WANT_NO_WRITE);
+			return 1;
+		}
+
+		// Leftovers from the last write go first, otherwise take the data and leave an empty
+		// item in the sendq so we are called again once the worker is done with it
+		if (offload_buf.empty())
+			offload_buf.swap(buffer);
+
+		ServerInstance->SE->ChangeEventMask(user, FD_WANT_NO_WRITE);
+		worker->Submit(this);
+		return 0;
+	}
+
+	/** Write the data in offload_buf, runs on the thread of the worker
+	 */
+	void RunOffloadedWrite()
+	{
+		while (!offload_buf.empty())
+		{
+			ERR_clear_error();
+			int ret = SSL_write(sess, offload_buf.data(), offload_buf.size());
+			if (ret > 0)
+			{
+				offload_buf.erase(0, ret);
+				continue;
+			}
+
+			int err = SSL_get_error(sess, ret);
+			if ((ret < 0) && (err == SSL_ERROR_WANT_WRITE))
+				offload_result = OFFLOAD_WANT_WRITE;
+			else if ((ret < 0) && (err == SSL_ERROR_WANT_READ))
+				offload_result = OFFLOAD_WANT_READ;
+			else
+				offload_result = OFFLOAD_ERROR;
+			return;
+		}
+		offload_result = OFFLOAD_OK;
+	}
+
+	/** Called on the main thread after the worker has finished writing
+	 */
+	void OnOffloadedWriteDone()
+	{
+		int mask;
+		if (offload_result == OFFLOAD_WANT_WRITE)
+			mask = FD_WANT_SINGLE_WRITE;
+		else if (offload_result == OFFLOAD_WANT_READ)
+			mask = FD_WANT_POLL_READ;
+		else
+			mask = FD_ADD_TRIAL_WRITE;
+
+		if (read_deferred)
+		{
+			read_deferred = false;
+			mask |= FD_WANT_POLL_READ | FD_ADD_TRIAL_READ;
+		}
+		ServerInstance->SE->ChangeEventMask(sock, mask);
+	}
+
+	/** Called when the worker lets go of this session for good
+	 */
+	void DetachWorker()
+	{
+		worker = NULL;
+		offload_state = OFFLOAD_IDLE;
+		if (read_deferred)
+		{
+			read_deferred = false;
+			ServerInstance->SE->ChangeEventMask(sock, FD_WANT_POLL_READ | FD_ADD_TRIAL_READ);
+		}
+	}
+
  public:
-	OpenSSLIOHook(IOHookProvider* hookprov, StreamSocket* sock, bool is_outbound, SSL* session, const reference<OpenSSL::Profile>& sslprofile)
+	OpenSSLIOHook(IOHookProvider* hookprov, StreamSocket* streamsock, bool is_outbound, SSL* session, const reference<OpenSSL::Profile>& sslprofile, OpenSSL::Worker* sslworker)
 		: SSLIOHook(hookprov)
 		, sess(session)
 		, status(ISSL_NONE)
 		, outbound(is_outbound)
 		, data_to_write(false)
 		, profile(sslprofile)
+		, sock(streamsock)
+		, worker(NULL)
+		, offload_state(OFFLOAD_IDLE)
+		, offload_result(OFFLOAD_OK)
+		, read_deferred(false)
 	{
 		if (sess == NULL)
 			return;
@@ -387,15 +607,24 @@ class OpenSSLIOHook : public SSLIOHook
 			throw ModuleException("Can't set fd with SSL_set_fd: " + ConvToStr(sock->GetFd()));
 
 		sock->AddIOHook(this);
+		worker = sslworker;
+		if (worker)
+			worker->Attach(this);
 		Handshake(sock);
 	}
 
 	void OnStreamSocketClose(StreamSocket* user) CXX11_OVERRIDE
 	{
+		if (worker)
+			worker->Detach(this);
+
+		// Last chance to send what the worker could not
+		if ((status == ISSL_OPEN) && (!offload_buf.empty()))
+			SSL_write(sess, offload_buf.data(), offload_buf.size());
 		CloseSession();
 	}
 
-	int OnStreamSocketRead(StreamSocket* user, std::string& recvq) CXX11_OVERRIDE
+	int OnStreamSocketRead(StreamSocket* user, RecvQueue& recvq) CXX11_OVERRIDE
 	{
 		if (!sess)
 		{
@@ -417,15 +646,31 @@ class OpenSSLIOHook : public SSLIOHook
 
 		// If we resumed the handshake then this->status will be ISSL_OPEN
 
+		if ((status == ISSL_OPEN) && (worker))
+		{
+			// The SSL object cannot be used while the worker has it
+			worker->LockQueue();
+			bool busy = (offload_state != OFFLOAD_IDLE);
+			if (busy)
+				read_deferred = true;
+			worker->UnlockQueue();
+
+			if (busy)
+			{
+				ServerInstance->SE->ChangeEventMask(user, FD_WANT_NO_READ);
+				return 0;
+			}
+		}
+
 		if (status == ISSL_OPEN)
 		{
-			char* buffer = ServerInstance->GetReadBuffer();
 			size_t bufsiz = ServerInstance->Config->NetBufferSize;
+			char* buffer = recvq.prepare(bufsiz);
 			int ret = SSL_read(sess, buffer, bufsiz);
 
 			if (ret > 0)
 			{
-				recvq.append(buffer, ret);
+				recvq.commit(ret);
 				if (data_to_write)
 					ServerInstance->SE->ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_SINGLE_WRITE);
 				return 1;
@@ -485,6 +730,16 @@ class OpenSSLIOHook : public SSLIOHook
 
 		if (status == ISSL_OPEN)
 		{
+			if (worker)
+				return OffloadWrite(user, buffer);
+
+			if (!offload_buf.empty())
+			{
+				// Leftovers from a worker that has been stopped
+				buffer.insert(0, offload_buf);
+				offload_buf.clear();
+			}
+
 			int ret = SSL_write(sess, buffer.data(), buffer.size());
 			if (ret == (int)buffer.length())
 			{
@@ -541,14 +796,153 @@ class OpenSSLIOHook : public SSLIOHook
 	}
 };
 
+void OpenSSL::Worker::Submit(OpenSSLIOHook* hook)
+{
+	hook->offload_state = OpenSSLIOHook::OFFLOAD_QUEUED;
+	queue.push_back(hook);
+	UnlockQueueWakeup();
+}
+
+void OpenSSL::Worker::Detach(OpenSSLIOHook* hook)
+{
+	LockQueue();
+	if (hook->offload_state == OpenSSLIOHook::OFFLOAD_BUSY)
+	{
+		// Wait until the worker is done writing
+		UnlockQueue();
+		writelock.Lock();
+		writelock.Unlock();
+		LockQueue();
+	}
+
+	std::deque<OpenSSLIOHook*>::iterator i = std::find(queue.begin(), queue.end(), hook);
+	if (i != queue.end())
+		queue.erase(i);
+	std::vector<OpenSSLIOHook*>::iterator j = std::find(done.begin(), done.end(), hook);
+	if (j != done.end())
+		done.erase(j);
+	UnlockQueue();
+
+	sessions.erase(hook);
+	hook->DetachWorker();
+}
+
+void OpenSSL::Worker::DetachAll()
+{
+	queue.clear();
+	done.clear();
+	for (std::set<OpenSSLIOHook*>::const_iterator i = sessions.begin(); i != sessions.end(); ++i)
+	{
+		OpenSSLIOHook* hook = *i;
+		hook->DetachWorker();
+		ServerInstance->SE->ChangeEventMask(hook->sock, FD_ADD_TRIAL_WRITE);
+	}
+	sessions.clear();
+}
+
+void OpenSSL::Worker::Run()
+{
+	LockQueue();
+	while (!GetExitFlag())
+	{
+		if (queue.empty())
+		{
+			WaitForQueue();
+			continue;
+		}
+
+		OpenSSLIOHook* hook = queue.front();
+		queue.pop_front();
+		hook->offload_state = OpenSSLIOHook::OFFLOAD_BUSY;
+		writelock.Lock();
+		UnlockQueue();
+
+		hook->RunOffloadedWrite();
+
+		LockQueue();
+		hook->offload_state = OpenSSLIOHook::OFFLOAD_DONE;
+		writelock.Unlock();
+
+		// If the list was not empty the main thread has not been woken up yet
+		if (done.empty())
+			NotifyParent();
+		done.push_back(hook);
+	}
+	UnlockQueue();
+}
+
+void OpenSSL::Worker::OnNotify()
+{
+	std::vector<OpenSSLIOHook*> finished;
+	LockQueue();
+	finished.swap(done);
+	for (std::vector<OpenSSLIOHook*>::const_iterator i = finished.begin(); i != finished.end(); ++i)
+		(*i)->offload_state = OpenSSLIOHook::OFFLOAD_IDLE;
+	UnlockQueue();
+
+	for (std::vector<OpenSSLIOHook*>::const_iterator i = finished.begin(); i != finished.end(); ++i)
+		(*i)->OnOffloadedWriteDone();
+}
+
+void OpenSSL::WorkerPool::Start(unsigned int count)
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	if ((count) && (!locks))
+	{
+		locks = new Mutex[CRYPTO_num_locks()];
+		CRYPTO_set_locking_callback(LockingCallback);
+	}
+#endif
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		Worker* worker = new Worker;
+		try
+		{
+			ServerInstance->Threads->Start(worker);
+		}
+		catch (CoreException& ex)
+		{
+			delete worker;
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to start SSL worker thread: " + ex.GetReason());
+			break;
+		}
+		workers.push_back(worker);
+	}
+}
+
+void OpenSSL::WorkerPool::Stop()
+{
+	for (std::vector<Worker*>::const_iterator i = workers.begin(); i != workers.end(); ++i)
+	{
+		Worker* worker = *i;
+		worker->join();
+		worker->OnNotify();
+		worker->DetachAll();
+		delete worker;
+	}
+	workers.clear();
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	if (locks)
+	{
+		CRYPTO_set_locking_callback(NULL);
+		delete[] locks;
+		locks = NULL;
+	}
+#endif
+}
+
 class OpenSSLIOHookProvider : public refcountbase, public IOHookProvider
 {
 	reference<OpenSSL::Profile> profile;
+	OpenSSL::WorkerPool& workers;
 
  public:
-	OpenSSLIOHookProvider(Module* mod, reference<OpenSSL::Profile>& prof)
+	OpenSSLIOHookProvider(Module* mod, reference<OpenSSL::Profile>& prof, OpenSSL::WorkerPool& pool)
 		: IOHookProvider(mod, "ssl/" + prof->GetName(), IOHookProvider::IOH_SSL)
 		, profile(prof)
+		, workers(pool)
 	{
 		ServerInstance->Modules->AddService(*this);
 	}
@@ -560,12 +954,12 @@ class OpenSSLIOHookProvider : public refcountbase, public IOHookProvider
 
 	void OnAccept(StreamSocket* sock, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server) CXX11_OVERRIDE
 	{
-		new OpenSSLIOHook(this, sock, false, profile->CreateServerSession(), profile);
+		new OpenSSLIOHook(this, sock, false, profile->CreateServerSession(), profile, workers.Get());
 	}
 
 	void OnConnect(StreamSocket* sock) CXX11_OVERRIDE
 	{
-		new OpenSSLIOHook(this, sock, true, profile->CreateClientSession(), profile);
+		new OpenSSLIOHook(this, sock, true, profile->CreateClientSession(), profile, workers.Get());
 	}
 };
 
@@ -575,6 +969,7 @@ class ModuleSSLOpenSSL : public Module
 
 	std::string sslports;
 	ProfileList profiles;
+	OpenSSL::WorkerPool workers;
 
 	void ReadProfiles()
 	{
@@ -590,7 +985,7 @@ class ModuleSSLOpenSSL : public Module
 			try
 			{
 				reference<OpenSSL::Profile> profile(new OpenSSL::Profile(defname, tag));
-				newprofiles.push_back(new OpenSSLIOHookProvider(this, profile));
+				newprofiles.push_back(new OpenSSLIOHookProvider(this, profile, workers));
 			}
 			catch (OpenSSL::Exception& ex)
 			{
@@ -621,7 +1016,7 @@ class ModuleSSLOpenSSL : public Module
 				throw ModuleException("Error while initializing SSL profile \"" + name + "\" at " + tag->getTagLocation() + " - " + ex.GetReason());
 			}
 
-			newprofiles.push_back(new OpenSSLIOHookProvider(this, profile));
+			newprofiles.push_back(new OpenSSLIOHookProvider(this, profile, workers));
 		}
 
 		profiles.swap(newprofiles);
@@ -637,6 +1032,10 @@ class ModuleSSLOpenSSL : public Module
 
 	void init() CXX11_OVERRIDE
 	{
+		// Changing the number of threads requires a reload
+		ConfigTag* Conf = ServerInstance->Config->ConfValue("openssl");
+		workers.Start(Conf->getInt("threads", 0, 0, 64));
+
 		ReadProfiles();
 	}
 
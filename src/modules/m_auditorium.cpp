@@ -129,7 +129,7 @@ class ModuleAuditorium : public Module
 		BuildExcept(memb, excepts);
 	}
 
-	void OnBuildNeighborList(User* source, IncludeChanList& include, std::map<User*, bool>& exception) CXX11_OVERRIDE
+	void OnBuildNeighborList(User* source, IncludeChanList& include, NeighborExceptions& exception) CXX11_OVERRIDE
 	{
 		for (IncludeChanList::iterator i = include.begin(); i != include.end(); )
 		{
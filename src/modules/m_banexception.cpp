@@ -58,16 +58,13 @@ class ModuleBanException : public Module
 
 	ModResult OnExtBanCheck(User *user, Channel *chan, char type) CXX11_OVERRIDE
 	{
-		ListModeBase::ModeList* list = be.GetList(chan);
-		if (!list)
+		const ListModeBase::ExtBanList* extbans = be.GetExtBans(chan, type);
+		if (!extbans)
 			return MOD_RES_PASSTHRU;
 
-		for (ListModeBase::ModeList::iterator it = list->begin(); it != list->end(); it++)
+		for (ListModeBase::ExtBanList::const_iterator it = extbans->begin(); it != extbans->end(); ++it)
 		{
-			if (it->mask[0] != type || it->mask[1] != ':')
-				continue;
-
-			if (chan->CheckBan(user, it->mask.substr(2)))
+			if (chan->CheckBan(user, it->mask, it->banmask))
 			{
 				// They match an entry on the list, so let them pass this.
 				return MOD_RES_ALLOW;
@@ -88,7 +85,7 @@ class ModuleBanException : public Module
 
 		for (ListModeBase::ModeList::iterator it = list->begin(); it != list->end(); it++)
 		{
-			if (chan->CheckBan(user, it->mask))
+			if (chan->CheckBan(user, it->mask, it->banmask))
 			{
 				// They match an entry on the list, so let them in.
 				return MOD_RES_ALLOW;
@@ -83,18 +83,16 @@ class ModuleChannelNames : public Module
 
 				ServerInstance->Modes->Process(modes, ServerInstance->FakeClient);
 			}
+			// KickUser invalidates iterators of the member list, collect the victims first
+			std::vector<User*> victims;
 			const UserMembList* users = c->GetUsers();
-			for(UserMembCIter j = users->begin(); j != users->end(); )
+			for (UserMembCIter j = users->begin(); j != users->end(); ++j)
 			{
 				if (IS_LOCAL(j->first))
-				{
-					// KickUser invalidates the iterator
-					UserMembCIter it = j++;
-					c->KickUser(ServerInstance->FakeClient, it->first, "Channel name no longer valid");
-				}
-				else
-					++j;
+					victims.push_back(j->first);
 			}
+			for (std::vector<User*>::const_iterator j = victims.begin(); j != victims.end(); ++j)
+				c->KickUser(ServerInstance->FakeClient, *j, "Channel name no longer valid");
 		}
 		badchan = false;
 	}
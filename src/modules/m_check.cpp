@@ -80,7 +80,8 @@ class CommandCheck : public Command
 	void dumpExt(User* user, const std::string& checkstr, Extensible* ext)
 	{
 		std::stringstream dumpkeys;
-		for(Extensible::ExtensibleStore::const_iterator i = ext->GetExtList().begin(); i != ext->GetExtList().end(); i++)
+		const Extensible::ExtensibleStore& exts = ext->GetExtList();
+		for(Extensible::ExtensibleStore::const_iterator i = exts.begin(); i != exts.end(); ++i)
 		{
 			ExtensionItem* item = i->first;
 			std::string value = item->serialize(FORMAT_USER, ext, i->second);
@@ -92,15 +92,20 @@ class CommandClearChan : public Command
 		ServerInstance->Modules->Attach(hook, creator);
 
 		std::string mask;
-		// Now remove all local non-opers from the channel
+		// Now remove all local non-opers from the channel. Kicking or quitting a user
+		// invalidates iterators of the member list, so collect the victims first.
+		std::vector<User*> victims;
 		const UserMembList* users = chan->GetUsers();
-		for (UserMembCIter i = users->begin(); i != users->end(); )
+		for (UserMembCIter i = users->begin(); i != users->end(); ++i)
 		{
 			User* curr = i->first;
-			++i;
+			if (IS_LOCAL(curr) && !curr->IsOper())
+				victims.push_back(curr);
+		}
 
-			if (!IS_LOCAL(curr) || curr->IsOper())
-				continue;
+		for (std::vector<User*>::const_iterator i = victims.begin(); i != victims.end(); ++i)
+		{
+			User* curr = *i;
 
 			// If kicking users, remove them and skip the QuitUser()
 			if (kick)
@@ -155,7 +160,7 @@ class ModuleClearChan : public Module
 		ServerInstance->Modules->DetachAll(this);
 	}
 
-	void OnBuildNeighborList(User* source, IncludeChanList& include, std::map<User*, bool>& exception) CXX11_OVERRIDE
+	void OnBuildNeighborList(User* source, IncludeChanList& include, NeighborExceptions& exception) CXX11_OVERRIDE
 	{
 		bool found = false;
 		for (IncludeChanList::iterator i = include.begin(); i != include.end(); ++i)
@@ -61,9 +61,9 @@ class DNSBLResolver : public DNS::Request
 	/* Note: This may be called multiple times for multiple A record results */
 	void OnLookupComplete(const DNS::Query *r) CXX11_OVERRIDE
 	{
-		/* Check the user still exists */
+		/* Check the user still exists, a cached answer for another DNSBL in the same batch may have removed them */
 		LocalUser* them = (LocalUser*)ServerInstance->FindUUID(theiruid);
-		if (!them)
+		if ((!them) || (them->quitting))
 			return;
 
 		const DNS::ResourceRecord &ans_record = r->answers[0];
@@ -341,26 +341,17 @@ class ModuleDNSBL : public Module
 		countExt.set(user, DNSBLConfEntries.size());
 
 		// For each DNSBL, we will run through this lookup
+		std::vector<DNS::Request*> lookups;
+		lookups.reserve(DNSBLConfEntries.size());
 		for (unsigned i = 0; i < DNSBLConfEntries.size(); ++i)
 		{
 			// Fill hostname with a dnsbl style host (d.c.b.a.domain.tld)
 			std::string hostname = reversedip + "." + DNSBLConfEntries[i]->domain;
-
-			/* now we'd need to fire off lookups for `hostname'. */
-			DNSBLResolver *r = new DNSBLResolver(*this->DNS, this, nameExt, countExt, hostname, user, DNSBLConfEntries[i]);
-			try
-			{
-				this->DNS->Process(r);
-			}
-			catch (DNS::Exception &ex)
-			{
-				delete r;
-				ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, ex.GetReason());
-			}
-
-			if (user->quitting)
-				break;
+			lookups.push_back(new DNSBLResolver(*this->DNS, this, nameExt, countExt, hostname, user, DNSBLConfEntries[i]));
 		}
+
+		// Send all lookups for the user at once
+		this->DNS->ProcessBatch(lookups);
 	}
 
 	ModResult OnSetConnectClass(LocalUser* user, ConnectClass* myclass) CXX11_OVERRIDE
@@ -51,7 +51,7 @@ class FlashPDSocket : public BufferedSocket
 
 	void OnDataReady() CXX11_OVERRIDE
 	{
-		if (recvq == expected_request)
+		if (recvq.str() == expected_request)
 			WriteData(policy_reply);
 		AddToCull();
 	}
@@ -33,11 +33,11 @@ class ModuleHostCycle : public Module
 		already_sent_t seen_id = ++LocalUser::already_sent_id;
 
 		IncludeChanList include_chans(user->chans.begin(), user->chans.end());
-		std::map<User*,bool> exceptions;
+		NeighborExceptions exceptions;
 
 		FOREACH_MOD(OnBuildNeighborList, (user, include_chans, exceptions));
 
-		for (std::map<User*,bool>::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
+		for (NeighborExceptions::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
 		{
 			LocalUser* u = IS_LOCAL(i->first);
 			if (u && !u->quitting)
@@ -72,24 +72,27 @@ class ModuleHostCycle : public Module
 					modeline.append(" ").append(user->nick);
 			}
 
-			const UserMembList* ulist = c->GetUsers();
-			for (UserMembList::const_iterator j = ulist->begin(); j != ulist->end(); ++j)
+			const Channel::LocalMemberBuckets& buckets = c->GetLocalMembers();
+			for (Channel::LocalMemberBuckets::const_iterator b = buckets.begin(); b != buckets.end(); ++b)
 			{
-				LocalUser* u = IS_LOCAL(j->first);
-				if (u == NULL || u == user)
-					continue;
-				if (u->already_sent == silent_id)
-					continue;
-
-				if (u->already_sent != seen_id)
+				for (std::vector<Membership*>::const_iterator j = b->second.begin(); j != b->second.end(); ++j)
 				{
-					u->Write(quitline);
-					u->already_sent = seen_id;
+					LocalUser* u = static_cast<LocalUser*>((*j)->user);
+					if (u == user)
+						continue;
+					if (u->already_sent == silent_id)
+						continue;
+
+					if (u->already_sent != seen_id)
+					{
+						u->Write(quitline);
+						u->already_sent = seen_id;
+					}
+
+					u->Write(joinline);
+					if (!memb->modes.empty())
+						u->Write(modeline);
 				}
-
-				u->Write(joinline);
-				if (!memb->modes.empty())
-					u->Write(modeline);
 			}
 		}
 	}
@@ -212,13 +212,13 @@ class HttpServerSocket : public BufferedSocket
 	{
 		if (InternalState == HTTP_SERVE_RECV_POSTDATA)
 		{
-			postdata.append(recvq);
+			postdata.append(recvq.data(), recvq.length());
 			if (postdata.length() >= postsize)
 				ServeData();
 		}
 		else
 		{
-			reqbuffer.append(recvq);
+			reqbuffer.append(recvq.data(), recvq.length());
 
 			if (reqbuffer.length() >= 8192)
 			{
@@ -76,7 +76,8 @@ class ModuleHttpStats : public Module
 	void DumpMeta(std::stringstream& data, Extensible* ext)
 	{
 		data << "<metadata>";
-		for(Extensible::ExtensibleStore::const_iterator i = ext->GetExtList().begin(); i != ext->GetExtList().end(); i++)
+		const Extensible::ExtensibleStore& exts = ext->GetExtList();
+		for(Extensible::ExtensibleStore::const_iterator i = exts.begin(); i != exts.end(); ++i)
 		{
 			ExtensionItem* item = i->first;
 			std::string value = item->serialize(FORMAT_USER, ext, i->second);
@@ -140,13 +141,38 @@ class ModuleHttpStats : public Module
 					}
 				}
 
-				data << "</xlines><modulelist>";
-				const ModuleManager::ModuleMap& mods = ServerInstance->Modules->GetModules();
+				data << "</xlines><eventlist>";
+				ModuleManager* mm = ServerInstance->Modules;
+				for (size_t i = I_BEGIN + 1; i != I_END; ++i)
+				{
+					const ModuleManager::EventStats& es = mm->EventCounters[i];
+					if (es.calls)
+						data << "<event><name>" << ModuleManager::GetEventName((Implementation)i) << "</name><dispatches>" << es.calls
+							<< "</dispatches><timens>" << es.time << "</timens></event>";
+				}
+
+				data << "</eventlist><modulelist>";
+				const ModuleManager::ModuleMap& mods = mm->GetModules();
 
 				for (ModuleManager::ModuleMap::const_iterator i = mods.begin(); i != mods.end(); ++i)
 				{
 					Version v = i->second->GetVersion();
-					data << "<module><name>" << i->first << "</name><description>" << Sanitize(v.description) << "</description></module>";
+					data << "<module><name>" << i->first << "</name><description>" << Sanitize(v.description) << "</description>";
+
+					const Module::HookStats* hs = i->second->GetHookStats();
+					if (hs)
+					{
+						data << "<hooks>";
+						for (size_t n = I_BEGIN + 1; n != I_END; ++n)
+						{
+							if (hs[n].calls)
+								data << "<hook><event>" << ModuleManager::GetEventName((Implementation)n) << "</event><calls>" << hs[n].calls
+									<< "</calls><totalns>" << mm->TicksToNanoseconds(hs[n].total) << "</totalns><maxns>"
+									<< mm->TicksToNanoseconds(hs[n].max) << "</maxns><exceptions>" << hs[n].exceptions << "</exceptions></hook>";
+						}
+						data << "</hooks>";
+					}
+					data << "</module>";
 				}
 				data << "</modulelist><channellist>";
 
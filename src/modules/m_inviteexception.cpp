@@ -63,7 +63,7 @@ public:
 		{
 			for (ListModeBase::ModeList::iterator it = list->begin(); it != list->end(); it++)
 			{
-				if (chan->CheckBan(user, it->mask))
+				if (chan->CheckBan(user, it->mask, it->banmask))
 				{
 					return MOD_RES_ALLOW;
 				}
@@ -35,36 +35,43 @@ class ModuleIRCv3 : public Module
 	{
 		IncludeChanList chans(user->chans.begin(), user->chans.end());
 
-		std::map<User*, bool> exceptions;
+		NeighborExceptions exceptions;
 		FOREACH_MOD(OnBuildNeighborList, (user, chans, exceptions));
 
+		already_sent_t sent_id = ++LocalUser::already_sent_id;
+
 		// Send it to all local users who were explicitly marked as neighbours by modules and have the required ext
-		for (std::map<User*, bool>::const_iterator i = exceptions.begin(); i != exceptions.end(); ++i)
+		for (NeighborExceptions::const_iterator i = exceptions.begin(); i != exceptions.end(); ++i)
 		{
 			LocalUser* u = IS_LOCAL(i->first);
-			if ((u) && (i->second) && (ext.get(u)))
+			if (!u)
+				continue;
+
+			// Users on the except list are not considered again below
+			u->already_sent = sent_id;
+			if ((i->second) && (ext.get(u)))
 				u->Write(line);
 		}
 
-		// Now consider sending it to all other users who has at least a common channel with the user
-		std::set<User*> already_sent;
+		LocalUser* localuser = IS_LOCAL(user);
+		if (localuser)
+			localuser->already_sent = sent_id;
+
+		// Now consider sending it to all other local users who have at least a common channel with the user
 		for (IncludeChanList::const_iterator i = chans.begin(); i != chans.end(); ++i)
 		{
-			const UserMembList* userlist = (*i)->chan->GetUsers();
-			for (UserMembList::const_iterator m = userlist->begin(); m != userlist->end(); ++m)
+			const Channel::LocalMemberBuckets& buckets = (*i)->chan->GetLocalMembers();
+			for (Channel::LocalMemberBuckets::const_iterator b = buckets.begin(); b != buckets.end(); ++b)
 			{
-				/*
-				 * Send the line if the channel member in question meets all of the following criteria:
-				 * - local
-				 * - not the user who is doing the action (i.e. whose channels we're iterating)
-				 * - has the given extension
-				 * - not on the except list built by modules
-				 * - we haven't sent the line to the member yet
-				 *
-				 */
-				LocalUser* member = IS_LOCAL(m->first);
-				if ((member) && (member != user) && (ext.get(member)) && (exceptions.find(member) == exceptions.end()) && (already_sent.insert(member).second))
-					member->Write(line);
+				for (std::vector<Membership*>::const_iterator m = b->second.begin(); m != b->second.end(); ++m)
+				{
+					LocalUser* member = static_cast<LocalUser*>((*m)->user);
+					if ((member->already_sent != sent_id) && (ext.get(member)))
+					{
+						member->already_sent = sent_id;
+						member->Write(line);
+					}
+				}
 			}
 		}
 	}
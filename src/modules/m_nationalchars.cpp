@@ -235,6 +235,7 @@ class ModuleNationalChars : public Module
 	{
 		memcpy(m_lower, rfc_case_insensitive_map, 256);
 		national_case_insensitive_map = m_lower;
+		national_case_insensitive_map_version++;
 
 		ServerInstance->IsNick = &myhandler;
 	}
@@ -252,7 +253,12 @@ class ModuleNationalChars : public Module
 		if(charset[0] != '/')
 			charset.insert(0, "../locales/");
 		unsigned char * tables[8] = { m_additional, m_additionalMB, m_additionalUp, m_lower, m_upper, m_additionalUtf8, m_additionalUtf8range, m_additionalUtf8interval };
+		unsigned char oldlower[256];
+		memcpy(oldlower, m_lower, 256);
 		loadtables(charset, tables, 8, 5);
+		// Masks compiled with the old map have to know that it was rewritten in place
+		if (memcmp(oldlower, m_lower, 256))
+			national_case_insensitive_map_version++;
 		forcequit = tag->getBool("forcequit");
 		CheckForceQuit("National character set changed");
 	}
@@ -275,6 +281,7 @@ class ModuleNationalChars : public Module
 	{
 		ServerInstance->IsNick = rememberer;
 		national_case_insensitive_map = lowermap_rememberer;
+		national_case_insensitive_map_version++;
 		CheckForceQuit("National characters module unloaded");
 	}
 
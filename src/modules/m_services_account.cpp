@@ -135,6 +135,8 @@ class AccountExtItemImpl : public AccountExtItem
 			return;
 
 		StringExtItem::unserialize(format, container, value);
+		// Extbans can match on the account of a user
+		user->InvalidateBanCache();
 		if (!value.empty())
 		{
 			// Logged in
@@ -248,7 +248,7 @@ void CommandFJoin::LowerTS(Channel* chan, time_t TS, const std::string& newname)
 
 	// While the name is equal in case-insensitive compare, it might differ in case; use the remote version
 	chan->name = newname;
-	chan->age = TS;
+	ServerInstance->ChanIndex.ChangeAge(chan, TS);
 
 	// Remove all pending invites
 	chan->ClearInvites();
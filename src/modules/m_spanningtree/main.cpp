@@ -35,6 +35,8 @@
 #include "commands.h"
 #include "protocolinterface.h"
 
+#include <iostream>
+
 ModuleSpanningTree::ModuleSpanningTree()
 	: rconnect(this), rsquit(this), map(this)
 	, commands(NULL), DNS(this, "DNS")
@@ -478,7 +480,8 @@ void ModuleSpanningTree::OnUserConnect(LocalUser* user)
 	if (user->IsOper())
 		CommandOpertype::Builder(user).Broadcast();
 
-	for(Extensible::ExtensibleStore::const_iterator i = user->GetExtList().begin(); i != user->GetExtList().end(); i++)
+	const Extensible::ExtensibleStore& exts = user->GetExtList();
+	for(Extensible::ExtensibleStore::const_iterator i = exts.begin(); i != exts.end(); ++i)
 	{
 		ExtensionItem* item = i->first;
 		std::string value = item->serialize(FORMAT_NETWORK, user, i->second);
@@ -491,6 +494,8 @@ void ModuleSpanningTree::OnUserConnect(LocalUser* user)
 
 void ModuleSpanningTree::OnUserJoin(Membership* memb, bool sync, bool created_by_local, CUList& excepts)
 {
+	Utils->AddRouteMember(memb);
+
 	// Only do this for local users
 	if (!IS_LOCAL(memb->user))
 		return;
@@ -543,6 +548,8 @@ void ModuleSpanningTree::OnChangeIdent(User* user, const std::string &ident)
 
 void ModuleSpanningTree::OnUserPart(Membership* memb, std::string &partmessage, CUList& excepts)
 {
+	Utils->RemoveRouteMember(memb);
+
 	if (IS_LOCAL(memb->user))
 	{
 		CmdBuilder params(memb->user, "PART");
@@ -577,6 +584,10 @@ void ModuleSpanningTree::OnUserQuit(User* user, const std::string &reason, const
 
 	// Regardless, We need to modify the user Counts..
 	TreeServer::Get(user)->UserCount--;
+
+	// The user leaves their channels without PART or KICK events
+	for (UCListIter i = user->chans.begin(); i != user->chans.end(); ++i)
+		Utils->RemoveRouteMember(*i);
 }
 
 void ModuleSpanningTree::OnUserPostNick(User* user, const std::string &oldnick)
@@ -606,6 +617,8 @@ void ModuleSpanningTree::OnUserPostNick(User* user, const std::string &oldnick)
 
 void ModuleSpanningTree::OnUserKick(User* source, Membership* memb, const std::string &reason, CUList& excepts)
 {
+	Utils->RemoveRouteMember(memb);
+
 	if ((!IS_LOCAL(source)) && (source != ServerInstance->FakeClient))
 		return;
 
@@ -616,6 +629,24 @@ void ModuleSpanningTree::OnUserKick(User* source, Membership* memb, const std::s
 	params.Broadcast();
 }
 
+void ModuleSpanningTree::OnMode(User* source, User* usertarget, Channel* chantarget, const std::vector<std::string>& modes, const std::vector<TranslateType>& translate)
+{
+	if (!chantarget)
+		return;
+
+	// Members whose prefix modes changed move to another rank in the route counts
+	for (size_t i = 1; i < modes.size(); ++i)
+	{
+		if (translate[i] != TR_NICK)
+			continue;
+
+		User* target = ServerInstance->FindNick(modes[i]);
+		Membership* memb = (target ? chantarget->GetUser(target) : NULL);
+		if (memb)
+			Utils->UpdateRouteMember(memb);
+	}
+}
+
 void ModuleSpanningTree::OnPreRehash(User* user, const std::string &parameter)
 {
 	if (loopCall)
@@ -735,6 +766,79 @@ ModResult ModuleSpanningTree::OnSetAway(User* user, const std::string &awaymsg)
 	return MOD_RES_PASSTHRU;
 }
 
+/* Introduce users from a server that has no socket, then split it and check that nobody is left behind */
+void ModuleSpanningTree::OnRunTestSuite()
+{
+	std::cout << "\n\nSpanning tree netsplit tests\n\n";
+
+	const std::string sid = "0ZZ";
+	if (Utils->FindServerID(sid))
+	{
+		std::cout << "SPLIT: Server ID " << sid << " is in use, skipping\n";
+		return;
+	}
+
+	char badmode = 0;
+	for (char c = 'A'; (c <= 'z') && (!badmode); c++)
+	{
+		if ((isalpha(c)) && (!ServerInstance->Modes->FindMode(c, MODETYPE_USER)))
+			badmode = c;
+	}
+
+	TreeServer* server = new TreeServer("split.test.invalid", "Netsplit test server", sid, Utils->TreeRoot, NULL, false);
+	Utils->TreeRoot->AddChild(server);
+
+	// { uuid, nick, modes, mode parameter, whether the UID is accepted }
+	const std::string now = ConvToStr(ServerInstance->Time());
+	const std::string clients[][5] = {
+		{ sid + "AAAAAA", "SplitTestGood", "+i", "", "y" },
+		{ sid + "AAAAAB", "SplitTestBadMode", std::string("+i") + badmode, "", "" },
+		{ sid + "AAAAAC", "SplitTestNoParam", "+s", "", "" },
+		{ sid + "AAAAAD", "SplitTestParam", "+s", "+c", "y" }
+	};
+	const unsigned int count = sizeof(clients) / sizeof(clients[0]);
+
+	bool passed = true;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		std::vector<std::string> params;
+		params.push_back(clients[i][0]);
+		params.push_back(now);
+		params.push_back(clients[i][1]);
+		params.push_back("split.test.invalid");
+		params.push_back("split.test.invalid");
+		params.push_back("test");
+		params.push_back("127.0.0.1");
+		params.push_back(now);
+		params.push_back(clients[i][2]);
+		if (!clients[i][3].empty())
+			params.push_back(clients[i][3]);
+		params.push_back("Netsplit test user");
+
+		const bool accepted = (commands->uid.HandleServer(server, params) == CMD_SUCCESS);
+		const bool ok = (accepted == !clients[i][4].empty());
+		std::cout << "UID " << clients[i][1] << " with modes " << clients[i][2] << (accepted ? " accepted " : " rejected ") << (ok ? "SUCCESS!\n" : "FAILURE\n");
+		passed = ((passed) && (ok));
+	}
+
+	std::string from = Utils->TreeRoot->GetName() + " " + server->GetName();
+	const int lost = server->QuitUsers(from);
+	Utils->TreeRoot->DelChild(server);
+	server->cull();
+	delete server;
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		const bool ok = ((!ServerInstance->FindNickOnly(clients[i][1])) && (!ServerInstance->FindUUID(clients[i][0])));
+		std::cout << clients[i][1] << " gone after the split " << (ok ? "SUCCESS!\n" : "FAILURE\n");
+		passed = ((passed) && (ok));
+	}
+
+	std::cout << "Netsplit lost " << lost << " users " << ((lost == 2) ? "SUCCESS!\n" : "FAILURE\n");
+	passed = ((passed) && (lost == 2));
+	std::cout << (passed ? "\nSUCCESS!\n" : "\nFAILURE\n");
+}
+
 CullResult ModuleSpanningTree::cull()
 {
 	if (Utils)
@@ -249,7 +249,8 @@ void TreeSocket::SyncChannel(Channel* chan, BurstState& bs)
 
 	SendListModes(chan);
 
-	for (Extensible::ExtensibleStore::const_iterator i = chan->GetExtList().begin(); i != chan->GetExtList().end(); i++)
+	const Extensible::ExtensibleStore& exts = chan->GetExtList();
+	for (Extensible::ExtensibleStore::const_iterator i = exts.begin(); i != exts.end(); ++i)
 	{
 		ExtensionItem* item = i->first;
 		std::string value = item->serialize(FORMAT_NETWORK, chan, i->second);
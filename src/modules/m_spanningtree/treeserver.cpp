@@ -144,17 +144,16 @@ int TreeServer::QuitUsers(const std::string &reason)
 {
 	std::string publicreason = ServerInstance->Config->HideSplits ? "*.net *.split" : reason;
 
-	const user_hash& users = *ServerInstance->Users->clientlist;
-	unsigned int original_size = users.size();
-	for (user_hash::const_iterator i = users.begin(); i != users.end(); )
+	int lost = 0;
+	for (ServerUserList::iterator i = users.begin(); i != users.end(); )
 	{
-		User* user = i->second;
+		User* user = *i;
 		// Increment the iterator now because QuitUser() removes the user from the container
 		++i;
-		if (user->server == this)
-			ServerInstance->Users->QuitUser(user, publicreason, &reason);
+		ServerInstance->Users->QuitUser(user, publicreason, &reason);
+		lost++;
 	}
-	return original_size - users.size();
+	return lost;
 }
 
 void TreeServer::CheckULine()
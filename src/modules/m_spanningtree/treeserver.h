@@ -76,6 +76,10 @@ class TreeServer : public Server
 	 */
 	TreeServer(const std::string& Name, const std::string& Desc, const std::string& id, TreeServer* Above, TreeSocket* Sock, bool Hide);
 
+	/** Quit all users on this server, walking the server's own user list
+	 * @param reason The quit reason shown to opers
+	 * @return The number of users quit
+	 */
 	int QuitUsers(const std::string &reason);
 
 	/** Get route.
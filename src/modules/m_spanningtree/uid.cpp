@@ -47,6 +47,27 @@ CmdResult CommandUID::HandleServer(TreeServer* remoteserver, std::vector<std::st
 	if (modestr[0] != '+')
 		return CMD_INVALID;
 
+	/* Check the modes and their parameters before anything is done with the client, as a
+	 * client that is half introduced would not be found again when its server splits
+	 */
+	unsigned int paramcount = 9;
+	for (std::string::const_iterator v = modestr.begin(); v != modestr.end(); ++v)
+	{
+		// Accept more '+' chars, for now
+		if (*v == '+')
+			continue;
+
+		ModeHandler* mh = ServerInstance->Modes->FindMode(*v, MODETYPE_USER);
+		if (!mh)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unrecognised mode '%c' for a user in UID, dropping link", *v);
+			return CMD_INVALID;
+		}
+
+		if ((mh->GetNumParams(true)) && (paramcount++ >= params.size() - 1))
+			return CMD_INVALID;
+	}
+
 	/* check for collision */
 	user_hash::iterator iter = ServerInstance->Users->clientlist->find(params[2]);
 
@@ -96,18 +117,12 @@ CmdResult CommandUID::HandleServer(TreeServer* remoteserver, std::vector<std::st
 		if (*v == '+')
 			continue;
 
-		/* For each mode thats set, find the mode handler and set it on the new user */
+		/* For each mode thats set, find the mode handler and set it on the new user,
+		 * these were all checked above
+		 */
 		ModeHandler* mh = ServerInstance->Modes->FindMode(*v, MODETYPE_USER);
-		if (!mh)
-		{
-			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unrecognised mode '%c' for a user in UID, dropping link", *v);
-			return CMD_INVALID;
-		}
-
 		if (mh->GetNumParams(true))
 		{
-			if (paramptr >= params.size() - 1)
-				return CMD_INVALID;
 			std::string mp = params[paramptr++];
 			/* IMPORTANT NOTE:
 			 * All modes are assumed to succeed here as they are being set by a remote server.
@@ -128,6 +143,7 @@ CmdResult CommandUID::HandleServer(TreeServer* remoteserver, std::vector<std::st
 	_new->SetClientIP(params[6].c_str());
 
 	ServerInstance->Users->AddGlobalClone(_new);
+	ServerInstance->Users->AddToIndexes(_new);
 	remoteserver->UserCount++;
 
 	bool dosend = true;
@@ -127,6 +127,8 @@ TreeServer* SpanningTreeUtilities::FindServerID(const std::string &id)
 
 SpanningTreeUtilities::SpanningTreeUtilities(ModuleSpanningTree* C)
 	: Creator(C), TreeRoot(NULL)
+	, channelroutes("spanningtree_routes", C)
+	, routerank("spanningtree_routerank", C)
 {
 	ServerInstance->Timers->AddTimer(&RefreshTimer);
 }
@@ -155,6 +157,85 @@ SpanningTreeUtilities::~SpanningTreeUtilities()
 	delete TreeRoot;
 }
 
+/* drops a member from the counts, forgetting ranks and routes left without members */
+void ChannelRoutes::Remove(TreeServer* route, unsigned int rank)
+{
+	RouteMap::iterator r = routes.find(route);
+	if (r == routes.end())
+		return;
+
+	RankCounts::iterator count = r->second.find(rank);
+	if (count == r->second.end())
+		return;
+
+	if (!--count->second)
+	{
+		r->second.erase(count);
+		if (r->second.empty())
+			routes.erase(r);
+	}
+}
+
+ChannelRoutes* SpanningTreeUtilities::GetChannelRoutes(Channel* c)
+{
+	ChannelRoutes* routes = channelroutes.get(c);
+	if (routes)
+		return routes;
+
+	routes = new ChannelRoutes;
+	channelroutes.set(c, routes);
+
+	const UserMembList* ulist = c->GetUsers();
+	for (UserMembCIter i = ulist->begin(); i != ulist->end(); ++i)
+	{
+		if (IS_LOCAL(i->first))
+			continue;
+
+		const unsigned int rank = i->second->getRank();
+		routes->Add(TreeServer::Get(i->first)->GetRoute(), rank);
+		routerank.set(i->second, rank + 1);
+	}
+	return routes;
+}
+
+void SpanningTreeUtilities::AddRouteMember(Membership* memb)
+{
+	ChannelRoutes* routes = channelroutes.get(memb->chan);
+	if ((!routes) || (IS_LOCAL(memb->user)))
+		return;
+
+	const unsigned int rank = memb->getRank();
+	routes->Add(TreeServer::Get(memb->user)->GetRoute(), rank);
+	routerank.set(memb, rank + 1);
+}
+
+void SpanningTreeUtilities::RemoveRouteMember(Membership* memb)
+{
+	ChannelRoutes* routes = channelroutes.get(memb->chan);
+	const intptr_t counted = routerank.set(memb, 0);
+	if ((!routes) || (!counted))
+		return;
+
+	routes->Remove(TreeServer::Get(memb->user)->GetRoute(), counted - 1);
+}
+
+void SpanningTreeUtilities::UpdateRouteMember(Membership* memb)
+{
+	ChannelRoutes* routes = channelroutes.get(memb->chan);
+	const intptr_t counted = routerank.get(memb);
+	if ((!routes) || (!counted))
+		return;
+
+	const unsigned int rank = memb->getRank();
+	if (rank == static_cast<unsigned int>(counted - 1))
+		return;
+
+	TreeServer* route = TreeServer::Get(memb->user)->GetRoute();
+	routes->Remove(route, counted - 1);
+	routes->Add(route, rank);
+	routerank.set(memb, rank + 1);
+}
+
 /* returns a list of DIRECT servernames for a specific channel */
 void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeSocketSet& list, char status, const CUList& exempt_list)
 {
@@ -166,23 +247,35 @@ void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeSocketSet
 			minrank = mh->GetPrefixRank();
 	}
 
-	const UserMembList *ulist = c->GetUsers();
+	const ChannelRoutes* routes = GetChannelRoutes(c);
 
-	for (UserMembCIter i = ulist->begin(); i != ulist->end(); i++)
+	// Exempt members only keep a route out of the list if every member behind it is exempt
+	std::map<TreeServer*, unsigned int> exempt;
+	for (CUList::const_iterator i = exempt_list.begin(); i != exempt_list.end(); ++i)
 	{
-		if (IS_LOCAL(i->first))
+		User* user = *i;
+		if (IS_LOCAL(user))
 			continue;
 
-		if (minrank && i->second->getRank() < minrank)
+		Membership* memb = c->GetUser(user);
+		const intptr_t counted = (memb ? routerank.get(memb) : 0);
+		if ((counted) && (static_cast<unsigned int>(counted - 1) >= minrank))
+			exempt[TreeServer::Get(user)->GetRoute()]++;
+	}
+
+	for (ChannelRoutes::RouteMap::const_iterator i = routes->routes.begin(); i != routes->routes.end(); ++i)
+	{
+		unsigned int members = 0;
+		for (ChannelRoutes::RankCounts::const_iterator count = i->second.lower_bound(minrank); count != i->second.end(); ++count)
+			members += count->second;
+
+		if (!members)
 			continue;
 
-		if (exempt_list.find(i->first) == exempt_list.end())
-		{
-			TreeServer* best = TreeServer::Get(i->first);
-			list.insert(best->GetSocket());
-		}
+		std::map<TreeServer*, unsigned int>::const_iterator ex = exempt.find(i->first);
+		if ((ex == exempt.end()) || (members > ex->second))
+			list.insert(i->first->GetSocket());
 	}
-	return;
 }
 
 void SpanningTreeUtilities::DoOneToAllButSender(const CmdBuilder& params, TreeServer* omitroute)
@@ -220,6 +313,7 @@ void SpanningTreeUtilities::DoOneToOne(const CmdBuilder& params, Server* server)
 void SpanningTreeUtilities::RefreshIPCache()
 {
 	ValidIPs.clear();
+	std::vector<DNS::Request*> lookups;
 	for (std::vector<reference<Link> >::iterator i = LinkBlocks.begin(); i != LinkBlocks.end(); ++i)
 	{
 		Link* L = *i;
@@ -237,18 +331,11 @@ void SpanningTreeUtilities::RefreshIPCache()
 		if ((L->IPAddr == "*") || (ipvalid))
 			ValidIPs.push_back(L->IPAddr);
 		else if (this->Creator->DNS)
-		{
-			SecurityIPResolver* sr = new SecurityIPResolver(Creator, *this->Creator->DNS, L->IPAddr, L, DNS::QUERY_AAAA);
-			try
-			{
-				this->Creator->DNS->Process(sr);
-			}
-			catch (DNS::Exception &)
-			{
-				delete sr;
-			}
-		}
+			lookups.push_back(new SecurityIPResolver(Creator, *this->Creator->DNS, L->IPAddr, L, DNS::QUERY_AAAA));
 	}
+
+	if (!lookups.empty())
+		this->Creator->DNS->ProcessBatch(lookups);
 }
 
 void SpanningTreeUtilities::ReadConfiguration()
@@ -41,6 +41,34 @@ extern SpanningTreeUtilities* Utils;
  */
 typedef TR1NS::unordered_map<std::string, TreeServer*, irc::insensitive, irc::StrHashComp> server_hash;
 
+/** Remote members of a channel counted by the route they are reached through and by their prefix rank
+ */
+class ChannelRoutes
+{
+ public:
+	/** Number of members by prefix rank
+	 */
+	typedef std::map<unsigned int, unsigned int> RankCounts;
+
+	/** Member counts by route
+	 */
+	typedef std::map<TreeServer*, RankCounts> RouteMap;
+
+	RouteMap routes;
+
+	/** Count a member
+	 * @param route The route to the server of the member
+	 * @param rank The prefix rank of the member
+	 */
+	void Add(TreeServer* route, unsigned int rank) { routes[route][rank]++; }
+
+	/** Stop counting a member
+	 * @param route The route to the server of the member
+	 * @param rank The prefix rank the member was counted with
+	 */
+	void Remove(TreeServer* route, unsigned int rank);
+};
+
 /** Contains helper functions and variables for this module,
  * and keeps them out of the global namespace
  */
@@ -147,6 +175,31 @@ class SpanningTreeUtilities : public classbase
 	 */
 	int DoCollision(User* u, TreeServer* server, time_t remotets, const std::string& remoteident, const std::string& remoteip, const std::string& remoteuid);
 
+	/** Remote members of channels by route, created when a message is first routed to the channel
+	 * and kept up to date as members join, leave and change prefix modes from then on
+	 */
+	SimpleExtItem<ChannelRoutes> channelroutes;
+
+	/** The prefix rank plus one a membership is counted with in ChannelRoutes
+	 */
+	LocalIntExt routerank;
+
+	/** Get the remote members of a channel by route, counting them if they aren't counted yet
+	 */
+	ChannelRoutes* GetChannelRoutes(Channel* c);
+
+	/** Count a new remote member of a channel in ChannelRoutes
+	 */
+	void AddRouteMember(Membership* memb);
+
+	/** Stop counting a remote member of a channel who is leaving in ChannelRoutes
+	 */
+	void RemoveRouteMember(Membership* memb);
+
+	/** Move a remote member to their current prefix rank in ChannelRoutes
+	 */
+	void UpdateRouteMember(Membership* memb);
+
 	/** Compile a list of servers which contain members of channel c
 	 */
 	void GetListOfServersForChannel(Channel* c, TreeSocketSet& list, char status, const CUList& exempt_list);
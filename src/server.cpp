@@ -172,7 +172,7 @@ void ISupportManager::Build()
 	tokens["CHANMODES"] = ServerInstance->Modes->GiveModeList(MASK_CHANNEL);
 	tokens["CHANNELLEN"] = ConvToStr(ServerInstance->Config->Limits.ChanMax);
 	tokens["CHANTYPES"] = "#";
-	tokens["ELIST"] = "MU";
+	tokens["ELIST"] = "CMU";
 	tokens["KICKLEN"] = ConvToStr(ServerInstance->Config->Limits.MaxKick);
 	tokens["MAXBANS"] = "64"; // TODO: make this a config setting.
 	tokens["MAXCHANNELS"] = ConvToStr(ServerInstance->Config->MaxChans);
@@ -218,6 +218,51 @@ int SocketEngine::SendTo(EventHandler* fd, const void *buf, size_t len, int flag
 	return nbSent;
 }
 
+int SocketEngine::SendToMany(EventHandler* fd, const std::vector<std::string>& bufs, int flags, const sockaddr *to, socklen_t tolen)
+{
+	size_t sent = 0;
+	size_t bytes = 0;
+#ifdef HAS_SENDMMSG
+	std::vector<iovec> iovs(bufs.size());
+	std::vector<mmsghdr> msgs(bufs.size());
+	for (size_t i = 0; i < bufs.size(); ++i)
+	{
+		iovs[i].iov_base = const_cast<char*>(bufs[i].data());
+		iovs[i].iov_len = bufs[i].length();
+
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_name = const_cast<sockaddr*>(to);
+		msgs[i].msg_hdr.msg_namelen = tolen;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	// sendmmsg() may send fewer datagrams than asked for, carry on from where it stopped
+	while (sent < msgs.size())
+	{
+		int ret = sendmmsg(fd->GetFd(), &msgs[sent], msgs.size() - sent, flags);
+		if (ret <= 0)
+			break;
+
+		for (int i = 0; i < ret; ++i)
+			bytes += msgs[sent + i].msg_len;
+		sent += ret;
+	}
+#else
+	for (; sent < bufs.size(); ++sent)
+	{
+		int ret = sendto(fd->GetFd(), bufs[sent].data(), bufs[sent].length(), flags, to, tolen);
+		if (ret < 0)
+			break;
+		bytes += ret;
+	}
+#endif
+
+	if (bytes)
+		this->UpdateStats(0, bytes);
+	return ((sent || bufs.empty()) ? sent : -1);
+}
+
 int SocketEngine::Connect(EventHandler* fd, const sockaddr *serv_addr, socklen_t addrlen)
 {
 	int ret = connect(fd->GetFd(), serv_addr, addrlen);
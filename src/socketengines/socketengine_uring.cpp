@@ -0,0 +1,492 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include "exitcodes.h"
+#include "inspircd.h"
+#include "socketengine.h"
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+/** user_data of the timeout request which bounds how long DispatchEvents() waits */
+static const __u64 URING_TIMEOUT_DATA = static_cast<__u64>(-1);
+/** user_data of poll removal requests, whose completions carry no information we need */
+static const __u64 URING_REMOVE_DATA = static_cast<__u64>(-2);
+
+/** A specialisation of the SocketEngine class, designed to use the Linux io_uring interface.
+ *
+ * Readiness is monitored with one-shot poll requests. Arming, re-arming and removing the
+ * polls for every descriptor whose event mask changed, along with waiting for events, is
+ * done with a single io_uring_enter() call per DispatchEvents() instead of one epoll_ctl()
+ * call per change. Only readiness goes through the ring; reads, writes, accepts and closes
+ * are still issued as ordinary system calls by the socket code, as with the other engines.
+ */
+class UringEngine : public SocketEngine
+{
+private:
+	/** The io_uring instance */
+	int EngineHandle;
+
+	/** Submission queue ring */
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_entries;
+	unsigned* sq_flags;
+	unsigned* sq_array;
+	io_uring_sqe* sqes;
+
+	/** Completion queue ring */
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	io_uring_cqe* cqes;
+
+	/** Mapped ring regions, for unmapping */
+	void* sq_ring;
+	size_t sq_ring_size;
+	void* cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	/** Number of requests queued but not yet passed to the kernel */
+	unsigned to_submit;
+
+	/** True if a timeout request is queued or in flight */
+	bool timeout_pending;
+	struct __kernel_timespec timeout;
+
+	/** Poll events currently armed for each fd, or 0 if none */
+	std::vector<short> armed;
+	/** Generation of the armed poll for each fd, used to discard stale completions */
+	std::vector<unsigned> generation;
+	/** Set for each fd which is in the dirty list */
+	std::vector<char> dirty;
+	/** Fds whose armed poll may no longer match their event mask */
+	std::vector<int> dirtylist;
+	/** The dirty list being processed by DispatchEvents(), kept to reuse its storage */
+	std::vector<int> workinglist;
+	/** Completions reaped from the ring, copied out so handlers may queue new requests */
+	std::vector<io_uring_cqe> events;
+
+	/** Get a free submission queue entry, submitting queued requests first if the ring is full */
+	io_uring_sqe* GetSQE();
+	/** Pass all queued requests to the kernel, optionally waiting for at least one completion */
+	int Submit(unsigned min_complete);
+	/** Queue removal of the poll armed for the given fd, if there is one */
+	void Disarm(int fd);
+	/** Re-arm the poll for the given fd to match its event mask */
+	void Rearm(int fd);
+	/** Remember that the poll armed for the given fd must be checked against its event mask */
+	void MarkDirty(int fd);
+
+public:
+	/** Create a new UringEngine
+	 */
+	UringEngine();
+	/** Delete a UringEngine
+	 */
+	virtual ~UringEngine();
+	virtual bool AddFd(EventHandler* eh, int event_mask);
+	virtual void OnSetEvent(EventHandler* eh, int old_mask, int new_mask);
+	virtual void DelFd(EventHandler* eh);
+	virtual int DispatchEvents();
+	virtual std::string GetName();
+};
+
+static inline __u64 make_user_data(int fd, unsigned gen)
+{
+	return (static_cast<__u64>(fd) << 32) | gen;
+}
+
+static short mask_to_poll(int event_mask)
+{
+	short rv = 0;
+	if (event_mask & (FD_WANT_POLL_READ | FD_WANT_FAST_READ))
+		rv |= POLLIN;
+	if (event_mask & (FD_WANT_POLL_WRITE | FD_WANT_FAST_WRITE | FD_WANT_SINGLE_WRITE))
+		rv |= POLLOUT;
+	return rv;
+}
+
+static void UringFatal(const char* what)
+{
+	ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "ERROR: Could not initialize socket engine: %s: %s", what, strerror(errno));
+	ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "ERROR: Your kernel probably does not have the proper features. This is a fatal error, exiting now.");
+	std::cout << "ERROR: Could not initialize io_uring socket engine: " << what << ": " << strerror(errno) << std::endl;
+	std::cout << "ERROR: Your kernel probably does not have the proper features. This is a fatal error, exiting now." << std::endl;
+	ServerInstance->QuickExit(EXIT_STATUS_SOCKETENGINE);
+}
+
+UringEngine::UringEngine()
+	: to_submit(0), timeout_pending(false), armed(1), generation(1), dirty(1)
+{
+	CurrentSetSize = 0;
+	struct rlimit limits;
+	if (!getrlimit(RLIMIT_NOFILE, &limits))
+	{
+		MAX_DESCRIPTORS = limits.rlim_cur;
+	}
+	else
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "ERROR: Can't determine maximum number of open sockets: %s", strerror(errno));
+		std::cout << "ERROR: Can't determine maximum number of open sockets: " << strerror(errno) << std::endl;
+		ServerInstance->QuickExit(EXIT_STATUS_SOCKETENGINE);
+	}
+
+	// Every fd has at most one poll in flight plus the occasional removal, so
+	// size the completion queue for the descriptor limit where the kernel allows.
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = std::min(std::max(GetMaxFds() * 2, 8192), 65536);
+
+	EngineHandle = syscall(__NR_io_uring_setup, 4096, &params);
+	if (EngineHandle == -1)
+		UringFatal("io_uring_setup");
+
+	sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+	sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, IORING_OFF_SQ_RING);
+	if (sq_ring == MAP_FAILED)
+		UringFatal("mmap");
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		cq_ring = sq_ring;
+	}
+	else
+	{
+		cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, IORING_OFF_CQ_RING);
+		if (cq_ring == MAP_FAILED)
+			UringFatal("mmap");
+	}
+
+	sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	void* sqe_map = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, IORING_OFF_SQES);
+	if (sqe_map == MAP_FAILED)
+		UringFatal("mmap");
+	sqes = static_cast<io_uring_sqe*>(sqe_map);
+
+	char* sq = static_cast<char*>(sq_ring);
+	sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+	sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+	sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+	sq_entries = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_entries);
+	sq_flags = reinterpret_cast<unsigned*>(sq + params.sq_off.flags);
+	sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+	char* cq = static_cast<char*>(cq_ring);
+	cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+	cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+	cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+	cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+	timeout.tv_sec = 1;
+	timeout.tv_nsec = 0;
+}
+
+UringEngine::~UringEngine()
+{
+	munmap(sqes, sqes_size);
+	if (cq_ring != sq_ring)
+		munmap(cq_ring, cq_ring_size);
+	munmap(sq_ring, sq_ring_size);
+	this->Close(EngineHandle);
+}
+
+int UringEngine::Submit(unsigned min_complete)
+{
+	unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	int rv = syscall(__NR_io_uring_enter, EngineHandle, to_submit, min_complete, flags, NULL, 0);
+	if (rv > 0)
+		to_submit -= std::min(to_submit, static_cast<unsigned>(rv));
+	return rv;
+}
+
+io_uring_sqe* UringEngine::GetSQE()
+{
+	unsigned tail = *sq_tail;
+	if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= *sq_entries)
+	{
+		// The ring is full; hand what we have to the kernel to make room
+		Submit(0);
+		if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= *sq_entries)
+			return NULL;
+	}
+
+	unsigned index = tail & *sq_mask;
+	io_uring_sqe* sqe = &sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_array[index] = index;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	to_submit++;
+	return sqe;
+}
+
+void UringEngine::MarkDirty(int fd)
+{
+	if (dirty[fd])
+		return;
+	dirty[fd] = 1;
+	dirtylist.push_back(fd);
+}
+
+void UringEngine::Disarm(int fd)
+{
+	if (!armed[fd])
+		return;
+
+	io_uring_sqe* sqe = GetSQE();
+	if (sqe)
+	{
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = make_user_data(fd, generation[fd]);
+		sqe->user_data = URING_REMOVE_DATA;
+	}
+
+	// Whatever happens to the old poll, its completion is stale from now on
+	armed[fd] = 0;
+	generation[fd]++;
+}
+
+void UringEngine::Rearm(int fd)
+{
+	EventHandler* eh = GetRef(fd);
+	short want = eh ? mask_to_poll(eh->GetEventMask()) : 0;
+	if (want == armed[fd])
+		return;
+
+	Disarm(fd);
+	if (!want)
+		return;
+
+	io_uring_sqe* sqe = GetSQE();
+	if (!sqe)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Submission queue full, deferring poll on fd %d", fd);
+		MarkDirty(fd);
+		return;
+	}
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll_events = want;
+	sqe->user_data = make_user_data(fd, generation[fd]);
+	armed[fd] = want;
+}
+
+bool UringEngine::AddFd(EventHandler* eh, int event_mask)
+{
+	int fd = eh->GetFd();
+	if ((fd < 0) || (fd > GetMaxFds() - 1))
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "AddFd out of range: (fd: %d, max: %d)", fd, GetMaxFds());
+		return false;
+	}
+
+	if (!SocketEngine::AddFd(eh))
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Attempt to add duplicate fd: %d", fd);
+		return false;
+	}
+
+	while (static_cast<unsigned int>(fd) >= armed.size())
+	{
+		armed.resize(armed.size() * 2);
+		generation.resize(armed.size());
+		dirty.resize(armed.size());
+	}
+
+	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "New file descriptor: %d", fd);
+
+	SocketEngine::SetEventMask(eh, event_mask);
+	MarkDirty(fd);
+	CurrentSetSize++;
+	return true;
+}
+
+void UringEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
+{
+	// The poll is brought up to date in the next DispatchEvents, so that
+	// several changes to the same fd only cost one request
+	if (mask_to_poll(old_mask) != mask_to_poll(new_mask))
+		MarkDirty(eh->GetFd());
+}
+
+void UringEngine::DelFd(EventHandler* eh)
+{
+	int fd = eh->GetFd();
+	if ((fd < 0) || (fd > GetMaxFds() - 1))
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "DelFd out of range: (fd: %d, max: %d)", fd, GetMaxFds());
+		return;
+	}
+
+	// This must happen now rather than in the next DispatchEvents; the fd
+	// number may be reused by a new socket before then.
+	Disarm(fd);
+
+	SocketEngine::DelFd(eh);
+
+	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Remove file descriptor: %d", fd);
+	CurrentSetSize--;
+}
+
+int UringEngine::DispatchEvents()
+{
+	socklen_t codesize = sizeof(int);
+	int errcode;
+
+	// Rearm() may mark fds dirty again, so work on a copy; swapping the two
+	// lists keeps both buffers allocated between calls
+	workinglist.clear();
+	workinglist.swap(dirtylist);
+	for (std::vector<int>::const_iterator i = workinglist.begin(); i != workinglist.end(); ++i)
+	{
+		dirty[*i] = 0;
+		Rearm(*i);
+	}
+
+	if (!timeout_pending)
+	{
+		io_uring_sqe* sqe = GetSQE();
+		if (sqe)
+		{
+			sqe->opcode = IORING_OP_TIMEOUT;
+			sqe->addr = reinterpret_cast<unsigned long>(&timeout);
+			sqe->len = 1;
+			sqe->off = 1;
+			sqe->user_data = URING_TIMEOUT_DATA;
+			timeout_pending = true;
+		}
+	}
+
+	// Submit every change queued since the last call, and wait for events
+	Submit(1);
+	ServerInstance->UpdateTime();
+
+	events.clear();
+	for (;;)
+	{
+		unsigned head = *cq_head;
+		unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+			events.push_back(cqes[head & *cq_mask]);
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+		// Completions which did not fit in the ring are moved into it by entering the kernel
+		if (!(__atomic_load_n(sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW))
+			break;
+		Submit(0);
+		syscall(__NR_io_uring_enter, EngineHandle, 0, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+	}
+
+	int processed = 0;
+	for (std::vector<io_uring_cqe>::const_iterator i = events.begin(); i != events.end(); ++i)
+	{
+		const io_uring_cqe& cqe = *i;
+		if (cqe.user_data == URING_TIMEOUT_DATA)
+		{
+			timeout_pending = false;
+			continue;
+		}
+		if (cqe.user_data == URING_REMOVE_DATA)
+			continue;
+
+		int fd = static_cast<int>(cqe.user_data >> 32);
+		unsigned gen = static_cast<unsigned>(cqe.user_data & 0xFFFFFFFF);
+		if (static_cast<unsigned int>(fd) >= armed.size() || gen != generation[fd])
+			continue;
+
+		// The poll was one-shot, it needs arming again if the handler still wants events
+		armed[fd] = 0;
+		generation[fd]++;
+		MarkDirty(fd);
+
+		EventHandler* eh = GetRef(fd);
+		if (!eh)
+			continue;
+
+		processed++;
+
+		if (cqe.res < 0)
+		{
+			ErrorEvents++;
+			eh->HandleEvent(EVENT_ERROR, -cqe.res);
+			continue;
+		}
+
+		int revents = cqe.res;
+		if (revents & POLLHUP)
+		{
+			ErrorEvents++;
+			eh->HandleEvent(EVENT_ERROR, 0);
+			continue;
+		}
+
+		if (revents & POLLERR)
+		{
+			ErrorEvents++;
+			// Get error number
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &errcode, &codesize) < 0)
+				errcode = errno;
+			eh->HandleEvent(EVENT_ERROR, errcode);
+			continue;
+		}
+
+		if (revents & POLLIN)
+		{
+			ReadEvents++;
+			SetEventMask(eh, eh->GetEventMask() & ~FD_READ_WILL_BLOCK);
+			eh->HandleEvent(EVENT_READ);
+			if (eh != GetRef(fd))
+				// whoops, deleted out from under us
+				continue;
+		}
+
+		if (revents & POLLOUT)
+		{
+			WriteEvents++;
+			SetEventMask(eh, eh->GetEventMask() & ~(FD_WRITE_WILL_BLOCK | FD_WANT_SINGLE_WRITE));
+			eh->HandleEvent(EVENT_WRITE);
+		}
+	}
+
+	TotalEvents += processed;
+	return processed;
+}
+
+std::string UringEngine::GetName()
+{
+	return "io_uring";
+}
+
+SocketEngine* CreateSocketEngine()
+{
+	return new UringEngine;
+}
@@ -22,6 +22,7 @@
 #include "inspircd.h"
 #include "testsuite.h"
 #include "threadengine.h"
+#include "xline.h"
 #include <iostream>
 
 class TestSuiteThread : public Thread
@@ -62,6 +63,9 @@ TestSuite::TestSuite()
 		std::cout << "(6) Comma sepstream tests\n";
 		std::cout << "(7) Space sepstream tests\n";
 		std::cout << "(8) UID generation tests\n";
+		std::cout << "(9) Line tokenizer tests\n";
+		std::cout << "(A) Wildcard matcher benchmark\n";
+		std::cout << "(B) X-line index tests\n";
 
 		std::cout << std::endl << "(X) Exit test suite\n";
 
@@ -105,6 +109,15 @@ TestSuite::TestSuite()
 			case '8':
 				std::cout << (DoGenerateUIDTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
 				break;
+			case '9':
+				std::cout << (DoLineTokenizerTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'A':
+				std::cout << (DoWildBenchmark() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'B':
+				std::cout << (DoXLineIndexTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
 			case 'X':
 				return;
 				break;
@@ -116,15 +129,15 @@ TestSuite::TestSuite()
 	}
 }
 
-/* Test that x matches y with match() */
-#define WCTEST(x, y) std::cout << "match(\"" << x << "\",\"" << y "\") " << ((passed = (InspIRCd::Match(x, y, NULL))) ? " SUCCESS!\n" : " FAILURE\n")
-/* Test that x does not match y with match() */
-#define WCTESTNOT(x, y) std::cout << "!match(\"" << x << "\",\"" << y "\") " << ((passed = ((!InspIRCd::Match(x, y, NULL)))) ? " SUCCESS!\n" : " FAILURE\n")
+/* Test that x matches y with match() and a compiled mask */
+#define WCTEST(x, y) std::cout << "match(\"" << x << "\",\"" << y "\") " << ((passed = (InspIRCd::Match(x, y, NULL) && WildcardMask(y).Match(x))) ? " SUCCESS!\n" : " FAILURE\n")
+/* Test that x does not match y with match() and a compiled mask */
+#define WCTESTNOT(x, y) std::cout << "!match(\"" << x << "\",\"" << y "\") " << ((passed = ((!InspIRCd::Match(x, y, NULL)) && (!WildcardMask(y).Match(x)))) ? " SUCCESS!\n" : " FAILURE\n")
 
 /* Test that x matches y with match() and cidr enabled */
-#define CIDRTEST(x, y) std::cout << "match(\"" << x << "\",\"" << y "\", true) " << ((passed = (InspIRCd::MatchCIDR(x, y, NULL))) ? " SUCCESS!\n" : " FAILURE\n")
+#define CIDRTEST(x, y) std::cout << "match(\"" << x << "\",\"" << y "\", true) " << ((passed = (InspIRCd::MatchCIDR(x, y, NULL) && WildcardMask(y).MatchCIDR(x))) ? " SUCCESS!\n" : " FAILURE\n")
 /* Test that x does not match y with match() and cidr enabled */
-#define CIDRTESTNOT(x, y) std::cout << "!match(\"" << x << "\",\"" << y "\", true) " << ((passed = ((!InspIRCd::MatchCIDR(x, y, NULL)))) ? " SUCCESS!\n" : " FAILURE\n")
+#define CIDRTESTNOT(x, y) std::cout << "!match(\"" << x << "\",\"" << y "\", true) " << ((passed = ((!InspIRCd::MatchCIDR(x, y, NULL)) && (!WildcardMask(y).MatchCIDR(x)))) ? " SUCCESS!\n" : " FAILURE\n")
 
 bool TestSuite::DoWildTests()
 {
@@ -198,6 +211,58 @@ bool TestSuite::DoWildTests()
 	return true;
 }
 
+bool TestSuite::DoWildBenchmark()
+{
+	std::cout << "\n\nWildcard matcher benchmark\n\n";
+
+	static const char* const masks[] = {
+		"some.host.example.com", "some.host.*", "*.example.com", "*host.examp*", "*.Host.*", "*", "s?me.*.example.*"
+	};
+	static const char* const strings[] = {
+		"some.host.example.com", "another.host.example.com", "some.host.example.net", "a.very.long.hostname.belonging.to.someone.example.org",
+		"SOME.HOST.EXAMPLE.COM", "127.0.0.1", "2001:db8::1", "x"
+	};
+	const unsigned int stringcount = sizeof(strings) / sizeof(strings[0]);
+	const unsigned int rounds = 200000;
+
+	std::vector<std::string> subjects(strings, strings + stringcount);
+	bool passed = true;
+	for (unsigned int m = 0; m < sizeof(masks) / sizeof(masks[0]); ++m)
+	{
+		const std::string mask = masks[m];
+		const WildcardMask compiled(mask);
+
+		for (unsigned int s = 0; s < stringcount; ++s)
+		{
+			if (InspIRCd::Match(subjects[s], mask) != compiled.Match(subjects[s]))
+			{
+				std::cout << "Results differ for \"" << subjects[s] << "\" and \"" << mask << "\"\n";
+				passed = false;
+			}
+		}
+
+		// Count the matches so the loops can not be optimized away
+		unsigned long hits = 0;
+		uint64_t start = ModuleManager::GetClock();
+		for (unsigned int r = 0; r < rounds; ++r)
+			for (unsigned int s = 0; s < stringcount; ++s)
+				hits += InspIRCd::Match(subjects[s], mask);
+		const uint64_t plain = ModuleManager::GetClock() - start;
+
+		start = ModuleManager::GetClock();
+		for (unsigned int r = 0; r < rounds; ++r)
+			for (unsigned int s = 0; s < stringcount; ++s)
+				hits += compiled.Match(subjects[s]);
+		const uint64_t fast = ModuleManager::GetClock() - start;
+
+		const double calls = static_cast<double>(rounds) * stringcount;
+		std::cout << mask << " (kind " << compiled.GetKind() << "): " << (plain / calls) << " ns per match, compiled "
+			<< (fast / calls) << " ns per match, " << hits << " hits\n";
+	}
+
+	return passed;
+}
+
 
 #define STREQUALTEST(x, y) std::cout << "==(\"" << x << ",\"" << y "\") " << ((passed = (x == y)) ? "SUCCESS\n" : "FAILURE\n")
 
@@ -275,6 +340,87 @@ bool TestSuite::DoSpaceSepStreamTests()
 	return true;
 }
 
+/* Split a line the way CommandParser used to, with a tokenstream */
+static void TokenStreamSplit(const std::string& line, std::string& command, std::vector<std::string>& params)
+{
+	irc::tokenstream tokens(line);
+	std::string token;
+	params.clear();
+	tokens.GetToken(command);
+	if (command[0] == ':')
+		tokens.GetToken(command);
+	while (tokens.GetToken(token))
+		params.push_back(token);
+}
+
+bool TestSuite::DoLineTokenizerTests()
+{
+	static const char* const lines[] = {
+		"PRIVMSG #channel :hello there, how are you?",
+		"JOIN #a,#b,#c key1,key2",
+		"MODE #channel +ovb nick1 nick2 *!*@host.example.com",
+		":nick!user@host PRIVMSG #channel :prefixed line",
+		"TOPIC #channel :  spaces   inside and at the end  ",
+		"PING :",
+		"NICK    many   spaces",
+		"USER ident 0 * :Real Name",
+		NULL
+	};
+
+	bool passed = true;
+	irc::linetokenizer tokenizer;
+	std::vector<std::string> params;
+	std::vector<std::string> expectedparams;
+	std::string expectedcommand;
+
+	for (const char* const* line = lines; *line; ++line)
+	{
+		std::string str(*line);
+		TokenStreamSplit(str, expectedcommand, expectedparams);
+		tokenizer.Parse(str);
+		tokenizer.GetParameters(params);
+
+		if ((tokenizer.command.str() != expectedcommand) || (params != expectedparams))
+		{
+			std::cout << "LINETOKENIZER: FAILURE: Tokens of \"" << str << "\" differ from tokenstream\n";
+			passed = false;
+		}
+	}
+
+	std::string tagged("@time=12:00;+draft/label=x :irc.example.com NOTICE * :message");
+	tokenizer.Parse(tagged);
+	if ((tokenizer.tags.str() != "time=12:00;+draft/label=x") || (tokenizer.source.str() != "irc.example.com")
+		|| (tokenizer.command.str() != "NOTICE") || (tokenizer.params.size() != 2) || (tokenizer.params[1].str() != "message"))
+	{
+		std::cout << "LINETOKENIZER: FAILURE: Tagged line not split correctly\n";
+		passed = false;
+	}
+
+	const unsigned int iterations = 1000000;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		clock_t start = clock();
+		for (unsigned int i = 0; i < iterations; i++)
+		{
+			std::string str(lines[i % 8]);
+			if (pass == 0)
+			{
+				TokenStreamSplit(str, expectedcommand, expectedparams);
+			}
+			else
+			{
+				tokenizer.Parse(str);
+				expectedcommand.assign(tokenizer.command.data, tokenizer.command.length);
+				tokenizer.GetParameters(params);
+			}
+		}
+		double secs = double(clock() - start) / CLOCKS_PER_SEC;
+		std::cout << (pass == 0 ? "tokenstream: " : "linetokenizer: ") << iterations << " lines in " << secs << "s\n";
+	}
+
+	return passed;
+}
+
 bool TestSuite::DoThreadTests()
 {
 	std::string anything;
@@ -389,6 +535,58 @@ bool TestSuite::DoGenerateUIDTests()
 	return true;
 }
 
+bool TestSuite::DoXLineIndexTests()
+{
+	std::cout << "\n\nX-line index tests\n\n";
+
+	XLineManager* xlines = ServerInstance->XLines;
+	std::size_t peak = 0;
+	std::size_t empty = 0;
+
+	// Every round adds and removes CIDR Z-lines which only differ from the other
+	// rounds in their first octet or hextet, so each round needs the same number
+	// of trie nodes and should reuse the nodes freed by the round before it
+	for (unsigned int round = 1; round <= 9; round++)
+	{
+		std::vector<std::string> masks;
+		for (unsigned int i = 0; i < 10; i++)
+		{
+			for (unsigned int j = 0; j < 20; j++)
+				masks.push_back(ConvToStr(round) + "." + ConvToStr(i) + "." + ConvToStr(j) + ".0/24");
+			masks.push_back("200" + ConvToStr(round) + ":db8:" + ConvToStr(i) + "::/48");
+		}
+
+		for (std::vector<std::string>::const_iterator i = masks.begin(); i != masks.end(); ++i)
+			xlines->AddLine(new ZLine(ServerInstance->Time(), 0, "<testsuite>", "X-line index test", *i), NULL);
+		const std::size_t added = xlines->GetTrieSize("Z");
+
+		for (std::vector<std::string>::const_iterator i = masks.begin(); i != masks.end(); ++i)
+			xlines->DelLine(i->c_str(), "Z", NULL);
+		const std::size_t removed = xlines->GetTrieSize("Z");
+
+		std::cout << "Round " << round << ": " << added << " trie nodes with " << masks.size() << " lines, " << removed << " after removing them\n";
+		if (round == 1)
+		{
+			peak = added;
+			empty = removed;
+		}
+		else if ((added != peak) || (removed != empty))
+		{
+			std::cout << "XLINEINDEX: FAILURE: The trie grew from " << peak << " to " << added << " nodes\n";
+			return false;
+		}
+	}
+
+	// Lines stored in reused nodes must still be found
+	xlines->AddLine(new ZLine(ServerInstance->Time(), 0, "<testsuite>", "X-line index test", "5.6.0.0/16"), NULL);
+	bool passed = ((xlines->MatchesLine("Z", "5.6.7.8")) && (!xlines->MatchesLine("Z", "5.7.7.8")));
+	xlines->DelLine("5.6.0.0/16", "Z", NULL);
+	passed = ((passed) && (!xlines->MatchesLine("Z", "5.6.7.8")));
+	std::cout << "Z-line 5.6.0.0/16 added to reused nodes " << (passed ? "SUCCESS!\n" : "FAILURE\n");
+
+	return passed;
+}
+
 TestSuite::~TestSuite()
 {
 	std::cout << "\n\n*** END OF TEST SUITE ***\n";
@@ -36,42 +36,161 @@ Timer::~Timer()
 	ServerInstance->Timers->DelTimer(this);
 }
 
-void TimerManager::TickTimers(time_t TIME)
+TimerManager::TimerManager()
+	: nexttick(ServerInstance->Time())
+{
+	memset(root, 0, sizeof(root));
+	memset(levels, 0, sizeof(levels));
+}
+
+void TimerManager::Link(Timer** slot, Timer* t)
 {
-	for (TimerMap::iterator i = Timers.begin(); i != Timers.end(); )
+	t->slot = slot;
+	Timer* first = *slot;
+	if (!first)
 	{
-		Timer* t = i->second;
-		if (t->GetTrigger() > TIME)
-			break;
+		t->next = t->prev = t;
+		*slot = t;
+		return;
+	}
 
-		Timers.erase(i++);
+	Timer* last = first->prev;
+	t->prev = last;
+	t->next = first;
+	last->next = t;
+	first->prev = t;
+}
 
-		if (!t->Tick(TIME))
-			continue;
+void TimerManager::Unlink(Timer* t)
+{
+	Timer** slot = t->slot;
+	if (t->next == t)
+	{
+		*slot = NULL;
+	}
+	else
+	{
+		t->prev->next = t->next;
+		t->next->prev = t->prev;
+		if (*slot == t)
+			*slot = t->next;
+	}
+	t->slot = NULL;
+	t->next = t->prev = NULL;
+}
+
+void TimerManager::Schedule(Timer* t)
+{
+	// Timers that are already due run on the next tick
+	time_t expires = std::max(t->GetTrigger(), nexttick);
+	time_t delta = expires - nexttick;
+	if (delta < ROOT_SIZE)
+	{
+		Link(&root[expires & (ROOT_SIZE - 1)], t);
+		return;
+	}
 
-		if (t->GetRepeat())
+	for (unsigned int level = 0; level < LEVELS; level++)
+	{
+		const time_t range = (time_t)1 << (ROOT_BITS + (level + 1) * LEVEL_BITS);
+		if (delta >= range)
 		{
-			t->SetTrigger(TIME + t->GetInterval());
-			AddTimer(t);
+			if (level != LEVELS - 1)
+				continue;
+
+			// Too far away, park it in the last slot; it is placed again when that slot is cascaded
+			expires = nexttick + range - 1;
 		}
+
+		Link(&levels[level][(expires >> (ROOT_BITS + level * LEVEL_BITS)) & (LEVEL_SIZE - 1)], t);
+		return;
 	}
 }
 
-void TimerManager::DelTimer(Timer* t)
+unsigned int TimerManager::Cascade(unsigned int level)
 {
-	std::pair<TimerMap::iterator, TimerMap::iterator> itpair = Timers.equal_range(t->GetTrigger());
+	unsigned int index = (nexttick >> (ROOT_BITS + level * LEVEL_BITS)) & (LEVEL_SIZE - 1);
+	Timer* first = levels[level][index];
+	levels[level][index] = NULL;
 
-	for (TimerMap::iterator i = itpair.first; i != itpair.second; ++i)
+	if (first)
 	{
-		if (i->second == t)
+		// Every timer in the slot is now less than a slot of this level away
+		Timer* t = first;
+		do
 		{
-			Timers.erase(i);
-			break;
+			Timer* next = t->next;
+			t->slot = NULL;
+			Schedule(t);
+			t = next;
+		} while (t != first);
+	}
+	return index;
+}
+
+void TimerManager::TickTimers(time_t TIME)
+{
+	while (nexttick <= TIME)
+	{
+		unsigned int index = nexttick & (ROOT_SIZE - 1);
+		if (!index)
+		{
+			// The root wrapped around, refill it from the levels above
+			for (unsigned int level = 0; level < LEVELS; level++)
+			{
+				if (Cascade(level))
+					break;
+			}
+		}
+		nexttick++;
+
+		if (!root[index])
+			continue;
+
+		// Take the slot over so Tick() can add and remove timers while we go through it
+		Timer* work = root[index];
+		root[index] = NULL;
+		Timer* t = work;
+		do
+		{
+			t->slot = &work;
+			t = t->next;
+		} while (t != work);
+
+		while (work)
+		{
+			t = work;
+			Unlink(t);
+
+			// The trigger was moved with SetTrigger()
+			if (t->GetTrigger() > TIME)
+			{
+				Schedule(t);
+				continue;
+			}
+
+			if (!t->Tick(TIME))
+				continue;
+
+			// Tick() may have rescheduled the timer itself with SetInterval() or AddTimer()
+			if ((t->GetRepeat()) && (!t->slot))
+			{
+				t->SetTrigger(TIME + t->GetInterval());
+				Schedule(t);
+			}
 		}
 	}
 }
 
+void TimerManager::DelTimer(Timer* t)
+{
+	if (t->slot)
+		Unlink(t);
+}
+
 void TimerManager::AddTimer(Timer* t)
 {
-	Timers.insert(std::make_pair(t->GetTrigger(), t));
+	if (t->slot)
+		Unlink(t);
+	Schedule(t);
 }
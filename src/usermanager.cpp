@@ -82,6 +82,7 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 	ServerInstance->Users->AddGlobalClone(New);
 
 	this->local_users.push_front(New);
+	ServerInstance->Timers->AddTimer(&New->timeouttimer);
 
 	if ((this->local_users.size() > ServerInstance->Config->SoftLimit) || (this->local_users.size() >= (unsigned int)ServerInstance->SE->GetMaxFds()))
 	{
@@ -111,7 +112,7 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 	 */
 	New->exempt = (ServerInstance->XLines->MatchesLine("E",New) != NULL);
 
-	if (BanCacheHit *b = ServerInstance->BanCache->GetHit(New->GetIPString()))
+	if (BanCacheHit *b = ServerInstance->BanCache->GetHit(New->client_sa))
 	{
 		if (!b->Type.empty() && !New->exempt)
 		{
@@ -191,6 +192,8 @@ void UserManager::QuitUser(User* user, const std::string& quitreason, const std:
 	else
 		unregistered_count--;
 
+	RemoveFromIndexes(user);
+
 	if (IS_LOCAL(user))
 	{
 		LocalUser* lu = IS_LOCAL(user);
@@ -266,16 +269,154 @@ unsigned long UserManager::LocalCloneCount(User *user)
 		return 0;
 }
 
+void UserManager::AddToIndexes(User* user)
+{
+	if (user->indexed)
+		return;
+
+	hosts.Add(user, user->host);
+	dhosts.Add(user, user->dhost);
+	ips.Add(user);
+
+	if (user->server->users.empty())
+		servers.insert(user->server);
+	user->server->users.push_front(user);
+	user->indexed = true;
+}
+
+void UserManager::RemoveFromIndexes(User* user)
+{
+	if (!user->indexed)
+		return;
+
+	hosts.Remove(user, user->host);
+	dhosts.Remove(user, user->dhost);
+	ips.Remove(user);
+
+	user->server->users.erase(user);
+	if (user->server->users.empty())
+		servers.erase(user->server);
+	user->indexed = false;
+}
+
+std::string HostIndex::MakeKey(const std::string& host)
+{
+	std::string key;
+	key.reserve(host.length());
+	for (std::string::const_reverse_iterator i = host.rbegin(); i != host.rend(); ++i)
+		key.push_back(ascii_case_insensitive_map[static_cast<unsigned char>(*i)]);
+	return key;
+}
+
+void HostIndex::Add(User* user, const std::string& host)
+{
+	index.insert(std::make_pair(MakeKey(host), user));
+}
+
+void HostIndex::Remove(User* user, const std::string& host)
+{
+	std::pair<IndexMap::iterator, IndexMap::iterator> range = index.equal_range(MakeKey(host));
+	for (IndexMap::iterator i = range.first; i != range.second; ++i)
+	{
+		if (i->second == user)
+		{
+			index.erase(i);
+			return;
+		}
+	}
+
+	// The host was changed without going through a method which keeps the index up to date
+	ServerInstance->Logs->Log("USERS", LOG_DEFAULT, "ERROR: Host index has no entry for %s at %s, searching all entries", user->uuid.c_str(), host.c_str());
+	for (IndexMap::iterator i = index.begin(); i != index.end(); ++i)
+	{
+		if (i->second == user)
+		{
+			index.erase(i);
+			return;
+		}
+	}
+}
+
+bool HostIndex::Find(const WildcardMask& mask, std::vector<User*>& out) const
+{
+	std::string key(mask.GetLiteral().rbegin(), mask.GetLiteral().rend());
+	switch (mask.GetKind())
+	{
+		case WildcardMask::MASK_EXACT:
+		{
+			std::pair<IndexMap::const_iterator, IndexMap::const_iterator> range = index.equal_range(key);
+			for (IndexMap::const_iterator i = range.first; i != range.second; ++i)
+				out.push_back(i->second);
+			return true;
+		}
+		case WildcardMask::MASK_SUFFIX:
+		{
+			// Every host ending in the literal has a key starting with the reversed literal
+			for (IndexMap::const_iterator i = index.lower_bound(key); i != index.end(); ++i)
+			{
+				if (i->first.compare(0, key.length(), key) != 0)
+					break;
+				out.push_back(i->second);
+			}
+			return true;
+		}
+		default:
+			return false;
+	}
+}
+
+std::string IPIndex::MakeKey(const irc::sockets::cidr_mask& range)
+{
+	std::string key(1, range.type);
+	key.append(reinterpret_cast<const char*>(range.bits), sizeof(range.bits));
+	return key;
+}
+
+void IPIndex::Add(User* user)
+{
+	if (user->client_sa.sa.sa_family != AF_INET && user->client_sa.sa.sa_family != AF_INET6)
+		return;
+
+	index.insert(std::make_pair(MakeKey(irc::sockets::cidr_mask(user->client_sa, 128)), user));
+}
+
+void IPIndex::Remove(User* user)
+{
+	if (user->client_sa.sa.sa_family != AF_INET && user->client_sa.sa.sa_family != AF_INET6)
+		return;
+
+	std::pair<IndexMap::iterator, IndexMap::iterator> range = index.equal_range(MakeKey(irc::sockets::cidr_mask(user->client_sa, 128)));
+	for (IndexMap::iterator i = range.first; i != range.second; ++i)
+	{
+		if (i->second == user)
+		{
+			index.erase(i);
+			return;
+		}
+	}
+}
+
+void IPIndex::Find(const irc::sockets::cidr_mask& range, std::vector<User*>& out) const
+{
+	// The unused bits of the range are zero, so its key sorts before every address within it
+	for (IndexMap::const_iterator i = index.lower_bound(MakeKey(range)); i != index.end(); ++i)
+	{
+		if (!range.match(i->second->client_sa))
+			break;
+		out.push_back(i->second);
+	}
+}
+
 void UserManager::ServerNoticeAll(const char* text, ...)
 {
 	std::string message;
 	VAFORMAT(message, text, text);
-	message = "NOTICE $" + ServerInstance->Config->ServerName + " :" + message;
+	reference<SharedMessage> line = LocalUser::MakeSharedLine(":" + ServerInstance->Config->ServerName + " NOTICE $" + ServerInstance->Config->ServerName + " :" + message);
 
 	for (LocalUserList::const_iterator i = local_users.begin(); i != local_users.end(); i++)
 	{
-		User* t = *i;
-		t->WriteServ(message);
+		LocalUser* t = *i;
+		t->Write(line);
 	}
 }
 
@@ -308,17 +449,12 @@ bool UserManager::AllModulesReportReady(LocalUser* user)
  */
 void UserManager::DoBackgroundUserStuff()
 {
-	/*
-	 * loop over all local users..
-	 */
-	for (LocalUserList::iterator i = local_users.begin(); i != local_users.end(); ++i)
+	for (BusyUserList::iterator i = busy_users.begin(); i != busy_users.end(); )
 	{
 		LocalUser* curr = *i;
+		++i;
 
-		if (curr->quitting)
-			continue;
-
-		if (curr->CommandFloodPenalty || curr->eh.getSendQSize())
+		if (!curr->quitting)
 		{
 			unsigned int rate = curr->MyClass->GetCommandRate();
 			if (curr->CommandFloodPenalty > rate)
@@ -326,45 +462,80 @@ void UserManager::DoBackgroundUserStuff()
 			else
 				curr->CommandFloodPenalty = 0;
 			curr->eh.OnDataReady();
+
+			if ((curr->CommandFloodPenalty) || (curr->eh.HasQueuedLines()))
+				continue;
 		}
 
-		switch (curr->registered)
-		{
-			case REG_ALL:
-				if (ServerInstance->Time() > curr->nping)
-				{
-					// This user didn't answer the last ping, remove them
-					if (!curr->lastping)
-					{
-						time_t time = ServerInstance->Time() - (curr->nping - curr->MyClass->GetPingTime());
-						const std::string message = "Ping timeout: " + ConvToStr(time) + (time != 1 ? " seconds" : " second");
-						this->QuitUser(curr, message);
-						continue;
-					}
-
-					curr->Write("PING :" + ServerInstance->Config->ServerName);
-					curr->lastping = 0;
-					curr->nping = ServerInstance->Time() + curr->MyClass->GetPingTime();
-				}
-				break;
-			case REG_NICKUSER:
-				if (AllModulesReportReady(curr))
+		busy_users.erase(curr);
+		curr->busy = false;
+	}
+}
+
+void UserManager::MarkBusy(LocalUser* user)
+{
+	if (user->busy)
+		return;
+
+	busy_users.push_front(user);
+	user->busy = true;
+}
+
+UserTimeoutTimer::UserTimeoutTimer(LocalUser* me)
+	: Timer(1, ServerInstance->Time())
+	, user(me)
+{
+}
+
+bool UserTimeoutTimer::Tick(time_t TIME)
+{
+	if (user->quitting)
+		return true;
+
+	switch (user->registered)
+	{
+		case REG_ALL:
+			if (TIME > user->nping)
+			{
+				// This user didn't answer the last ping, remove them
+				if (!user->lastping)
 				{
-					/* User has sent NICK/USER, modules are okay, DNS finished. */
-					curr->FullConnect();
-					continue;
+					time_t time = TIME - (user->nping - user->MyClass->GetPingTime());
+					const std::string message = "Ping timeout: " + ConvToStr(time) + (time != 1 ? " seconds" : " second");
+					ServerInstance->Users->QuitUser(user, message);
+					return true;
 				}
-				break;
-		}
 
-		if (curr->registered != REG_ALL && (ServerInstance->Time() > (curr->age + curr->MyClass->GetRegTimeout())))
-		{
-			/*
-			 * registration timeout -- didnt send USER/NICK/HOST
-			 * in the time specified in their connection class.
-			 */
-			this->QuitUser(curr, "Registration timeout");
-			continue;
-		}
+				user->Write("PING :" + ServerInstance->Config->ServerName);
+				user->lastping = 0;
+				user->nping = TIME + user->MyClass->GetPingTime();
+			}
+
+			// Commands from the user push nping back, so look at it again when the current value is due
+			SetInterval(user->nping - TIME + 1);
+			return true;
+		case REG_NICKUSER:
+			if (ServerInstance->Users->AllModulesReportReady(user))
+			{
+				/* User has sent NICK/USER, modules are okay, DNS finished. */
+				user->FullConnect();
+				if (!user->quitting)
+					SetInterval(user->nping - TIME + 1);
+				return true;
+			}
+			break;
+	}
+
+	if (TIME > (user->age + user->MyClass->GetRegTimeout()))
+	{
+		/*
+		 * registration timeout -- didnt send USER/NICK/HOST
+		 * in the time specified in their connection class.
+		 */
+		ServerInstance->Users->QuitUser(user, "Registration timeout");
+		return true;
 	}
+
+	SetInterval(1);
+	return true;
 }
@@ -76,7 +76,11 @@ User::User(const std::string& uid, Server* srv, int type)
 	signon = 0;
 	registered = 0;
 	quitting = false;
+	indexed = false;
+	banversion = 0;
 	client_sa.sa.sa_family = AF_UNSPEC;
+	neighborstamp = 0;
+	neighborcached = false;
 
 	ServerInstance->Logs->Log("USERS", LOG_DEBUG, "New UUID for user: %s", uuid.c_str());
 
@@ -86,10 +90,10 @@ User::User(const std::string& uid, Server* srv, int type)
 
 LocalUser::LocalUser(int myfd, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* servaddr)
 	: User(ServerInstance->UIDGen.GetUID(), ServerInstance->FakeClient->server, USERTYPE_LOCAL), eh(this),
-	bytes_in(0), bytes_out(0), cmds_in(0), cmds_out(0), nping(0), CommandFloodPenalty(0),
+	timeouttimer(this), bytes_in(0), bytes_out(0), cmds_in(0), cmds_out(0), nping(0), CommandFloodPenalty(0),
 	already_sent(0)
 {
-	exempt = quitting_sendq = false;
+	exempt = quitting_sendq = busy = false;
 	idle_lastmsg = 0;
 	ident = "unknown";
 	lastping = 0;
@@ -244,6 +248,9 @@ void UserIOHandler::OnDataReady()
 	if (user->quitting)
 		return;
 
+	// Anything processed here is likely to add a penalty which has to be decayed
+	ServerInstance->Users->MarkBusy(user);
+
 	if (recvq.length() > user->MyClass->GetRecvqMax() && !user->HasPrivPermission("users/flood/increased-buffers"))
 	{
 		ServerInstance->Users->QuitUser(user, "RecvQ exceeded");
@@ -260,12 +267,17 @@ void UserIOHandler::OnDataReady()
 
 	while (user->CommandFloodPenalty < penaltymax && getSendQSize() < sendqmax)
 	{
+		std::string::size_type eol = recvq.find('\n');
+		// if the recvq has no newline in it, wait for the rest of the line
+		if (eol == std::string::npos)
+			return;
+
 		std::string line;
 		line.reserve(ServerInstance->Config->Limits.MaxLine);
-		std::string::size_type qpos = 0;
-		while (qpos < recvq.length())
+		const char* data = recvq.data();
+		for (std::string::size_type i = 0; i < eol; i++)
 		{
-			char c = recvq[qpos++];
+			char c = data[i];
 			switch (c)
 			{
 			case '\0':
@@ -273,17 +285,14 @@ void UserIOHandler::OnDataReady()
 				break;
 			case '\r':
 				continue;
-			case '\n':
-				goto eol_found;
 			}
 			if (line.length() < ServerInstance->Config->Limits.MaxLine - 2)
 				line.push_back(c);
 		}
-		// if we got here, the recvq ran out before we found a newline
-		return;
-eol_found:
-		// just found a newline. Terminate the string, and pull it out of recvq
-		recvq = recvq.substr(qpos);
+
+		// pull the line and its newline out of recvq
+		std::string::size_type qpos = eol + 1;
+		recvq.erase_front(qpos);
 
 		// TODO should this be moved to when it was inserted in recvq?
 		ServerInstance->stats->statsRecv += qpos;
@@ -298,22 +307,33 @@ eol_found:
 		ServerInstance->Users->QuitUser(user, "Excess Flood");
 }
 
-void UserIOHandler::AddWriteBuf(const std::string &data)
+bool UserIOHandler::CanAddWriteBuf(size_t len)
 {
 	if (user->quitting_sendq)
-		return;
-	if (!user->quitting && getSendQSize() + data.length() > user->MyClass->GetSendqHardMax() &&
+		return false;
+	if (!user->quitting && getSendQSize() + len > user->MyClass->GetSendqHardMax() &&
 		!user->HasPrivPermission("users/flood/increased-buffers"))
 	{
 		user->quitting_sendq = true;
 		ServerInstance->GlobalCulls.AddSQItem(user);
-		return;
+		return false;
 	}
 
 	// We still want to append data to the sendq of a quitting user,
 	// e.g. their ERROR message that says 'closing link'
+	return true;
+}
 
-	WriteData(data);
+void UserIOHandler::AddWriteBuf(const std::string &data)
+{
+	if (CanAddWriteBuf(data.length()))
+		WriteData(data);
+}
+
+void UserIOHandler::AddWriteBuf(SharedMessage* msg)
+{
+	if (CanAddWriteBuf(msg->data.length()))
+		WriteData(msg);
 }
 
 void UserIOHandler::OnError(BufferedSocketError)
@@ -321,6 +341,16 @@ void UserIOHandler::OnError(BufferedSocketError)
 	ServerInstance->Users->QuitUser(user, getError());
 }
 
+void UserIOHandler::DoWrite()
+{
+	if (!getSendQSize())
+		return;
+
+	StreamSocket::DoWrite();
+	if (!getSendQSize() && !user->quitting)
+		FOREACH_MOD(OnBufferFlushed, (user));
+}
+
 CullResult User::cull()
 {
 	if (!quitting)
@@ -335,6 +365,9 @@ CullResult User::cull()
 CullResult LocalUser::cull()
 {
 	ServerInstance->Users->local_users.erase(this);
+	if (busy)
+		ServerInstance->Users->busy_users.erase(this);
+	ServerInstance->Timers->DelTimer(&timeouttimer);
 	ClearInvites();
 	eh.cull();
 	return User::cull();
@@ -357,6 +390,7 @@ void User::Oper(OperInfo* info)
 
 	this->SetMode(opermh, true);
 	this->oper = info;
+	this->InvalidateBanCache();
 	this->WriteServ("MODE %s :+o", this->nick.c_str());
 	FOREACH_MOD(OnOper, (this, info->name));
 
@@ -453,7 +487,7 @@ void User::UnOper()
 	 * to call UnOper. -- w00t
 	 */
 	oper = NULL;
-
+	InvalidateBanCache();
 
 	/* Remove all oper only modes from the user when the deoper - Bug #466*/
 	std::string moderemove("-");
@@ -515,6 +549,10 @@ void LocalUser::CheckClass(bool clone_count)
 	}
 
 	this->nping = ServerInstance->Time() + a->GetPingTime() + ServerInstance->Config->dns_timeout;
+
+	// The ping time may have become shorter, unregistered users are checked every second anyway
+	if (registered == REG_ALL)
+		timeouttimer.SetInterval(nping - ServerInstance->Time() + 1);
 }
 
 bool LocalUser::CheckLines(bool doZline)
@@ -594,13 +632,14 @@ void LocalUser::FullConnect()
 	FOREACH_MOD(OnUserConnect, (this));
 
 	this->registered = REG_ALL;
+	ServerInstance->Users->AddToIndexes(this);
 
 	FOREACH_MOD(OnPostConnect, (this));
 
 	ServerInstance->SNO->WriteToSnoMask('c',"Client connecting on port %d (class %s): %s (%s) [%s]",
 		this->GetServerPort(), this->MyClass->name.c_str(), GetFullRealHost().c_str(), this->GetIPString().c_str(), this->fullname.c_str());
 	ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCache: Adding NEGATIVE hit for " + this->GetIPString());
-	ServerInstance->BanCache->AddHit(this->GetIPString(), "", "");
+	ServerInstance->BanCache->AddHit(this->client_sa, "", "");
 	// reset the flood penalty (which could have been raised due to things like auto +x)
 	CommandFloodPenalty = 0;
 }
@@ -612,6 +651,7 @@ void User::InvalidateCache()
 	cached_hostip.clear();
 	cached_makehost.clear();
 	cached_fullrealhost.clear();
+	InvalidateBanCache();
 }
 
 bool User::ChangeNick(const std::string& newnick, bool force)
@@ -773,14 +813,25 @@ bool User::SetClientIP(const char* sip, bool recheck_eline)
 {
 	cachedip.clear();
 	cached_hostip.clear();
-	return irc::sockets::aptosa(sip, 0, client_sa);
+	InvalidateBanCache();
+	if (indexed)
+		ServerInstance->Users->ips.Remove(this);
+	bool ret = irc::sockets::aptosa(sip, 0, client_sa);
+	if (indexed)
+		ServerInstance->Users->ips.Add(this);
+	return ret;
 }
 
 void User::SetClientIP(const irc::sockets::sockaddrs& sa, bool recheck_eline)
 {
 	cachedip.clear();
 	cached_hostip.clear();
+	InvalidateBanCache();
+	if (indexed)
+		ServerInstance->Users->ips.Remove(this);
 	memcpy(&client_sa, &sa, sizeof(irc::sockets::sockaddrs));
+	if (indexed)
+		ServerInstance->Users->ips.Add(this);
 }
 
 bool LocalUser::SetClientIP(const char* sip, bool recheck_eline)
@@ -806,7 +857,7 @@ void LocalUser::SetClientIP(const irc::sockets::sockaddrs& sa, bool recheck_elin
 	}
 }
 
-static std::string wide_newline("\r\n");
+static const std::string wide_newline("\r\n");
 
 void User::Write(const std::string& text)
 {
@@ -829,13 +880,39 @@ void LocalUser::Write(const std::string& text)
 		return;
 	}
 
-	ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %s", uuid.c_str(), text.c_str());
+	if (ServerInstance->Config->RawLog)
+		ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %s", uuid.c_str(), text.c_str());
 
-	eh.AddWriteBuf(text);
-	eh.AddWriteBuf(wide_newline);
+	std::string line;
+	line.reserve(text.length() + wide_newline.length());
+	line.append(text).append(wide_newline);
+	eh.AddWriteBuf(line);
 
-	ServerInstance->stats->statsSent += text.length() + 2;
-	this->bytes_out += text.length() + 2;
+	ServerInstance->stats->statsSent += line.length();
+	this->bytes_out += line.length();
+	this->cmds_out++;
+}
+
+SharedMessage* LocalUser::MakeSharedLine(const std::string& text)
+{
+	std::string line(text, 0, ServerInstance->Config->Limits.MaxLine - 2);
+	line.append(wide_newline);
+	return new SharedMessage(line);
+}
+
+void LocalUser::Write(SharedMessage* line)
+{
+	if (!ServerInstance->SE->BoundsCheckFd(&eh))
+		return;
+
+	const std::string& data = line->data;
+	if (ServerInstance->Config->RawLog)
+		ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %.*s", uuid.c_str(), (int)(data.length() - wide_newline.length()), data.c_str());
+
+	eh.AddWriteBuf(line);
+
+	ServerInstance->stats->statsSent += data.length();
+	this->bytes_out += data.length();
 	this->cmds_out++;
 }
 
@@ -947,39 +1024,97 @@ void User::WriteCommonRaw(const std::string &line, bool include_self)
 	if (this->registered != REG_ALL || quitting)
 		return;
 
+	reference<SharedMessage> msg = LocalUser::MakeSharedLine(line);
+
+	// Without modules altering the neighbor list the cached neighbors are the recipients
+	if ((ServerInstance->Config->NeighborCache) && (!*ServerInstance->Modules->EventTables[I_OnBuildNeighborList]))
+	{
+		LocalUser* self = IS_LOCAL(this);
+		if ((self) && (include_self))
+			self->Write(msg);
+
+		const std::vector<LocalUser*>& neighbors = GetLocalNeighbors();
+		for (std::vector<LocalUser*>::const_iterator i = neighbors.begin(); i != neighbors.end(); ++i)
+		{
+			if (!(*i)->quitting)
+				(*i)->Write(msg);
+		}
+		return;
+	}
+
 	LocalUser::already_sent_id++;
 
 	IncludeChanList include_c(chans.begin(), chans.end());
-	std::map<User*,bool> exceptions;
+	NeighborExceptions exceptions;
 
 	exceptions[this] = include_self;
 
 	FOREACH_MOD(OnBuildNeighborList, (this, include_c, exceptions));
 
-	for (std::map<User*,bool>::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
+	for (NeighborExceptions::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
 	{
 		LocalUser* u = IS_LOCAL(i->first);
 		if (u && !u->quitting)
 		{
 			u->already_sent = LocalUser::already_sent_id;
 			if (i->second)
-				u->Write(line);
+				u->Write(msg);
 		}
 	}
 	for (IncludeChanList::const_iterator v = include_c.begin(); v != include_c.end(); ++v)
 	{
-		Channel* c = (*v)->chan;
-		const UserMembList* ulist = c->GetUsers();
-		for (UserMembList::const_iterator i = ulist->begin(); i != ulist->end(); i++)
+		const Channel::LocalMemberBuckets& buckets = (*v)->chan->GetLocalMembers();
+		for (Channel::LocalMemberBuckets::const_iterator b = buckets.begin(); b != buckets.end(); ++b)
+		{
+			for (std::vector<Membership*>::const_iterator i = b->second.begin(); i != b->second.end(); ++i)
+			{
+				LocalUser* u = static_cast<LocalUser*>((*i)->user);
+				if (u->already_sent != LocalUser::already_sent_id)
+				{
+					u->already_sent = LocalUser::already_sent_id;
+					u->Write(msg);
+				}
+			}
+		}
+	}
+}
+
+const std::vector<LocalUser*>& User::GetLocalNeighbors()
+{
+	unsigned long stamp = 0;
+	for (UCListIter i = chans.begin(); i != chans.end(); ++i)
+		stamp += (*i)->chan->GetLocalMemberVersion();
+
+	// Versions only ever grow, so an unchanged sum over the same channels means nobody joined or left
+	if ((neighborcached) && (stamp == neighborstamp))
+		return neighborcache;
+
+	neighborcache.clear();
+	already_sent_t uniq_id = ++LocalUser::already_sent_id;
+	LocalUser* self = IS_LOCAL(this);
+	if (self)
+		self->already_sent = uniq_id;
+
+	for (UCListIter i = chans.begin(); i != chans.end(); ++i)
+	{
+		const Channel::LocalMemberBuckets& buckets = (*i)->chan->GetLocalMembers();
+		for (Channel::LocalMemberBuckets::const_iterator b = buckets.begin(); b != buckets.end(); ++b)
 		{
-			LocalUser* u = IS_LOCAL(i->first);
-			if (u && u->already_sent != LocalUser::already_sent_id)
+			for (std::vector<Membership*>::const_iterator j = b->second.begin(); j != b->second.end(); ++j)
 			{
-				u->already_sent = LocalUser::already_sent_id;
-				u->Write(line);
+				LocalUser* u = static_cast<LocalUser*>((*j)->user);
+				if (u->already_sent != uniq_id)
+				{
+					u->already_sent = uniq_id;
+					neighborcache.push_back(u);
+				}
 			}
 		}
 	}
+
+	neighborstamp = stamp;
+	neighborcached = true;
+	return neighborcache;
 }
 
 void User::WriteCommonQuit(const std::string &normal_text, const std::string &oper_text)
@@ -989,15 +1124,15 @@ void User::WriteCommonQuit(const std::string &normal_text, const std::string &op
 
 	already_sent_t uniq_id = ++LocalUser::already_sent_id;
 
-	const std::string normalMessage = ":" + this->GetFullHost() + " QUIT :" + normal_text;
-	const std::string operMessage = ":" + this->GetFullHost() + " QUIT :" + oper_text;
+	reference<SharedMessage> normalMessage = LocalUser::MakeSharedLine(":" + this->GetFullHost() + " QUIT :" + normal_text);
+	reference<SharedMessage> operMessage = LocalUser::MakeSharedLine(":" + this->GetFullHost() + " QUIT :" + oper_text);
 
 	IncludeChanList include_c(chans.begin(), chans.end());
-	std::map<User*,bool> exceptions;
+	NeighborExceptions exceptions;
 
 	FOREACH_MOD(OnBuildNeighborList, (this, include_c, exceptions));
 
-	for (std::map<User*,bool>::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
+	for (NeighborExceptions::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
 	{
 		LocalUser* u = IS_LOCAL(i->first);
 		if (u && !u->quitting)
@@ -1009,14 +1144,17 @@ void User::WriteCommonQuit(const std::string &normal_text, const std::string &op
 	}
 	for (IncludeChanList::const_iterator v = include_c.begin(); v != include_c.end(); ++v)
 	{
-		const UserMembList* ulist = (*v)->chan->GetUsers();
-		for (UserMembList::const_iterator i = ulist->begin(); i != ulist->end(); i++)
+		const Channel::LocalMemberBuckets& buckets = (*v)->chan->GetLocalMembers();
+		for (Channel::LocalMemberBuckets::const_iterator b = buckets.begin(); b != buckets.end(); ++b)
 		{
-			LocalUser* u = IS_LOCAL(i->first);
-			if (u && (u->already_sent != uniq_id))
+			for (std::vector<Membership*>::const_iterator i = b->second.begin(); i != b->second.end(); ++i)
 			{
-				u->already_sent = uniq_id;
-				u->Write(u->IsOper() ? operMessage : normalMessage);
+				LocalUser* u = static_cast<LocalUser*>((*i)->user);
+				if (u->already_sent != uniq_id)
+				{
+					u->already_sent = uniq_id;
+					u->Write(u->IsOper() ? operMessage : normalMessage);
+				}
 			}
 		}
 	}
@@ -1067,10 +1205,9 @@ void User::SendText(const std::string& linePrefix, std::stringstream& textStream
  * the first users channels then the second users channels within the outer loop,
  * therefore it was a maximum of x*y iterations (upon returning 0 and checking
  * all possible iterations). However this new function instead checks against the
- * channel's userlist in the inner loop which is a std::map<User*,User*>
+ * channel's userlist in the inner loop which is a hash indexed dense_ptr_map
  * and saves us time as we already know what pointer value we are after.
- * Don't quote me on the maths as i am not a mathematician or computer scientist,
- * but i believe this algorithm is now x+(log y) maximum iterations instead.
+ * This makes it x iterations with a constant time lookup in each.
  */
 bool User::SharesChannelWith(User *other)
 {
@@ -1081,7 +1218,7 @@ bool User::SharesChannelWith(User *other)
 	for (UCListIter i = this->chans.begin(); i != this->chans.end(); i++)
 	{
 		/* Eliminate the inner loop (which used to be ~equal in size to the outer loop)
-		 * by replacing it with a map::find which *should* be more efficient
+		 * by replacing it with a hash lookup
 		 */
 		if ((*i)->chan->HasUser(other))
 			return true;
@@ -1103,6 +1240,7 @@ bool User::ChangeName(const std::string& gecos)
 		FOREACH_MOD(OnChangeName, (this,gecos));
 	}
 	this->fullname.assign(gecos, 0, ServerInstance->Config->Limits.MaxGecos);
+	this->InvalidateBanCache();
 
 	return true;
 }
@@ -1122,7 +1260,11 @@ bool User::ChangeDisplayedHost(const std::string& shost)
 
 	FOREACH_MOD(OnChangeHost, (this,shost));
 
+	if (this->indexed)
+		ServerInstance->Users->dhosts.Remove(this, this->dhost);
 	this->dhost.assign(shost, 0, 64);
+	if (this->indexed)
+		ServerInstance->Users->dhosts.Add(this, this->dhost);
 	this->InvalidateCache();
 
 	if (IS_LOCAL(this))
@@ -1148,7 +1290,7 @@ void User::SendAll(const char* command, const char* text, ...)
 {
 	std::string textbuffer;
 	VAFORMAT(textbuffer, text, text);
-	const std::string message = ":" + this->GetFullHost() + " " + command + " $* :" + textbuffer;
+	reference<SharedMessage> message = LocalUser::MakeSharedLine(":" + this->GetFullHost() + " " + command + " $* :" + textbuffer);
 
 	for (LocalUserList::const_iterator i = ServerInstance->Users->local_users.begin(); i != ServerInstance->Users->local_users.end(); i++)
 	{
@@ -73,6 +73,189 @@ static bool MatchInternal(const unsigned char* str, const unsigned char* mask, u
 	return !*wild;
 }
 
+WildcardMask::WildcardMask()
+	: map(national_case_insensitive_map)
+	, national(true)
+	, mapversion(national_case_insensitive_map_version)
+	, kind(MASK_EXACT)
+	, anchor(std::string::npos)
+	, anchorbyte(0)
+	, hascidr(false)
+{
+}
+
+WildcardMask::WildcardMask(const std::string& str, unsigned const char* casemap)
+{
+	Compile(str, casemap);
+}
+
+void WildcardMask::Compile(const std::string& str, unsigned const char* casemap)
+{
+	mask = str;
+	national = (casemap == NULL);
+	map = (national ? national_case_insensitive_map : casemap);
+	mapversion = national_case_insensitive_map_version;
+	anchor = std::string::npos;
+	anchorbyte = 0;
+	literal.clear();
+
+	// A range is only ever matched as one if it has a '/' and no '@', see irc::sockets::MatchCIDR()
+	hascidr = ((mask.find('/') != std::string::npos) && (mask.find('@') == std::string::npos));
+	if (hascidr)
+		cidr = irc::sockets::cidr_mask(mask);
+
+	// Consecutive stars are the same as one, so only look at the first and last non-star character
+	std::string::size_type first = mask.find_first_not_of('*');
+	if (first == std::string::npos)
+	{
+		kind = (mask.empty() ? MASK_EXACT : MASK_ANY);
+		return;
+	}
+
+	std::string::size_type last = mask.find_last_not_of('*');
+	const bool leading = (first > 0);
+	const bool trailing = (last < mask.length() - 1);
+	if (mask.find_first_of("*?", first) <= last)
+	{
+		kind = MASK_GENERAL;
+		return;
+	}
+
+	if (leading)
+		kind = (trailing ? MASK_INFIX : MASK_SUFFIX);
+	else
+		kind = (trailing ? MASK_PREFIX : MASK_EXACT);
+
+	literal.reserve(last - first + 1);
+	for (std::string::size_type i = first; i <= last; ++i)
+		literal.push_back(map[static_cast<unsigned char>(mask[i])]);
+
+	if (kind != MASK_INFIX)
+		return;
+
+	// Find a character of the literal which only one byte folds to, so memchr() can look for it
+	for (std::string::size_type i = 0; i < literal.length(); ++i)
+	{
+		const unsigned char folded = literal[i];
+		unsigned int preimages = 0;
+		for (unsigned int c = 0; (c < 256) && (preimages < 2); ++c)
+		{
+			if (map[c] == folded)
+			{
+				anchorbyte = c;
+				preimages++;
+			}
+		}
+
+		if (preimages == 1)
+		{
+			anchor = i;
+			break;
+		}
+	}
+}
+
+bool WildcardMask::CompareLiteral(const unsigned char* str) const
+{
+	const unsigned char* lit = reinterpret_cast<const unsigned char*>(literal.data());
+	for (std::string::size_type i = 0; i < literal.length(); ++i)
+	{
+		if (map[str[i]] != lit[i])
+			return false;
+	}
+	return true;
+}
+
+bool WildcardMask::Match(const std::string& str) const
+{
+	// A module changed the national case map since the literal was folded
+	if ((national) && (mapversion != national_case_insensitive_map_version))
+		return MatchInternal((const unsigned char*)str.c_str(), (const unsigned char*)mask.c_str(), national_case_insensitive_map);
+
+	const unsigned char* data = reinterpret_cast<const unsigned char*>(str.data());
+	const std::string::size_type len = str.length();
+	const std::string::size_type litlen = literal.length();
+	switch (kind)
+	{
+		case MASK_ANY:
+			return true;
+		case MASK_EXACT:
+			return ((len == litlen) && (CompareLiteral(data)));
+		case MASK_PREFIX:
+			return ((len >= litlen) && (CompareLiteral(data)));
+		case MASK_SUFFIX:
+			return ((len >= litlen) && (CompareLiteral(data + len - litlen)));
+		case MASK_INFIX:
+		{
+			if (len < litlen)
+				return false;
+
+			const std::string::size_type lastpos = len - litlen;
+			if (anchor == std::string::npos)
+			{
+				for (std::string::size_type pos = 0; pos <= lastpos; ++pos)
+				{
+					if (CompareLiteral(data + pos))
+						return true;
+				}
+				return false;
+			}
+
+			// The anchor byte of a match at pos is at pos + anchor, scan only where a match can start
+			const unsigned char* scan = data + anchor;
+			const unsigned char* end = data + lastpos + anchor + 1;
+			while (scan < end)
+			{
+				const unsigned char* hit = static_cast<const unsigned char*>(memchr(scan, anchorbyte, end - scan));
+				if (!hit)
+					return false;
+
+				if (CompareLiteral(hit - anchor))
+					return true;
+				scan = hit + 1;
+			}
+			return false;
+		}
+		case MASK_GENERAL:
+			break;
+	}
+
+	return MatchInternal((const unsigned char*)str.c_str(), (const unsigned char*)mask.c_str(), map);
+}
+
+bool WildcardMask::MatchCIDR(const std::string& str) const
+{
+	if (hascidr)
+	{
+		// Leave addresses with a username part to irc::sockets::MatchCIDR()
+		if (str.find('@') != std::string::npos)
+			return InspIRCd::MatchCIDR(str, mask, (national ? NULL : map));
+
+		irc::sockets::sockaddrs addr;
+		irc::sockets::aptosa(str, 0, addr);
+		if (cidr == irc::sockets::cidr_mask(addr, cidr.length))
+			return true;
+	}
+	else if (mask.find('@') != std::string::npos)
+	{
+		return InspIRCd::MatchCIDR(str, mask, (national ? NULL : map));
+	}
+
+	return Match(str);
+}
+
+void BanMask::Compile(const std::string& mask)
+{
+	// Extbans are handled by modules through OnCheckBan
+	std::string::size_type at = mask.find('@');
+	valid = ((mask.length() > 2) && (mask[1] != ':') && (at != std::string::npos));
+	if (!valid)
+		return;
+
+	nickident.Compile(mask.substr(0, at));
+	host.Compile(mask.substr(at + 1));
+}
+
 // Below here is all wrappers around MatchInternal
 
 bool InspIRCd::Match(const std::string& str, const std::string& mask, unsigned const char* map)
@@ -136,6 +136,576 @@ class ZLineFactory : public XLineFactory
  *  bans. :)
  */
 
+/** Indexes the lines of one of the core line types by the mask they match against a user,
+ * so finding the lines that match a user does not need to look at every line.
+ *
+ * Masks without wildcards are hashed, masks that are a fixed prefix followed by '*' or
+ * '*' followed by a fixed suffix are hashed by the length of the fixed part and CIDR masks
+ * are stored in a binary trie. Every other mask is a residual which is always a candidate.
+ * The index only narrows down the lines to check, candidates are still checked with
+ * XLine::Matches() so the result is the same as checking every line.
+ */
+class XLineManager::Index
+{
+ public:
+	/** What the indexed mask of a line is matched against
+	 */
+	enum MaskType
+	{
+		/** Hostname or IP address, the host part of G, K and E-lines */
+		MASK_HOST,
+		/** IP address, Z-lines */
+		MASK_IP,
+		/** Nickname, Q-lines */
+		MASK_NICK
+	};
+
+ private:
+	typedef std::vector<XLine*> LineList;
+	typedef TR1NS::unordered_map<std::string, LineList> LineMap;
+
+	/** Maps of fixed prefixes or suffixes, keyed by their length
+	 */
+	typedef std::map<std::string::size_type, LineMap> AffixMap;
+
+	struct TrieNode
+	{
+		unsigned int child[2];
+		LineList lines;
+
+		/** Number of lines in this node and the nodes below it
+		 */
+		std::size_t total;
+
+		TrieNode() : total(0) { child[0] = child[1] = 0; }
+	};
+
+	/** A binary trie of CIDR ranges, node 0 is the root.
+	 * Every node other than the root has at least one line in it or below it; the nodes
+	 * of a branch that no longer has any lines are unlinked and their ids are reused.
+	 */
+	struct Trie
+	{
+		std::vector<TrieNode> nodes;
+
+		/** Ids of nodes that are not linked into the trie
+		 */
+		std::vector<unsigned int> freenodes;
+
+		TrieNode& operator[](unsigned int node) { return nodes[node]; }
+		const TrieNode& operator[](unsigned int node) const { return nodes[node]; }
+		bool empty() const { return nodes.empty(); }
+
+		void clear()
+		{
+			nodes.clear();
+			freenodes.clear();
+		}
+
+		unsigned int Allocate()
+		{
+			if (freenodes.empty())
+			{
+				nodes.push_back(TrieNode());
+				return nodes.size() - 1;
+			}
+
+			unsigned int node = freenodes.back();
+			freenodes.pop_back();
+			return node;
+		}
+
+		void Free(unsigned int node)
+		{
+			TrieNode& curr = nodes[node];
+			curr.child[0] = curr.child[1] = 0;
+			curr.total = 0;
+			LineList().swap(curr.lines);
+			freenodes.push_back(node);
+		}
+	};
+
+	const MaskType masktype;
+
+	/** The case map used by XLine::Matches() for lines of this type, which can be changed by modules
+	 */
+	unsigned const char* const* const currentmap;
+
+	/** The case map the keys in the index were folded with
+	 */
+	unsigned const char* casemap;
+
+	/** The value of national_case_insensitive_map_version when the keys were folded
+	 */
+	unsigned int casemapversion;
+
+	/** All lines in the index
+	 */
+	dense_ptr_map<XLine, XLine> lines;
+
+	LineMap exact;
+	AffixMap prefixes;
+	AffixMap suffixes;
+	Trie trie4;
+	Trie trie6;
+	dense_ptr_map<XLine, XLine> residual;
+
+	/** The exact masks that are IP addresses, as address family followed by the address bits,
+	 * so the masks in a range are next to each other
+	 */
+	std::multiset<std::string> addresses;
+
+	static std::string AddressKey(const irc::sockets::cidr_mask& cidr)
+	{
+		std::string key(1, static_cast<char>(cidr.type));
+		key.append(reinterpret_cast<const char*>(cidr.bits), sizeof(cidr.bits));
+		return key;
+	}
+
+	static bool KeyInRange(const std::string& key, const irc::sockets::cidr_mask& range)
+	{
+		if (static_cast<unsigned char>(key[0]) != range.type)
+			return false;
+
+		for (unsigned int i = 0; i < range.length; i += 8)
+		{
+			const unsigned char mask = (range.length - i >= 8 ? 0xFF : (0xFF00 >> (range.length - i)) & 0xFF);
+			if ((static_cast<unsigned char>(key[1 + i / 8]) & mask) != range.bits[i / 8])
+				return false;
+		}
+		return true;
+	}
+
+	std::string Fold(const std::string& str) const
+	{
+		std::string ret(str);
+		for (std::string::iterator i = ret.begin(); i != ret.end(); ++i)
+			*i = casemap[static_cast<unsigned char>(*i)];
+		return ret;
+	}
+
+	/** Get the mask of a line that is matched against the field of the user
+	 * @return The mask, or NULL if the line is not one of the core line classes
+	 */
+	const std::string* GetMask(XLine* line) const
+	{
+		switch (masktype)
+		{
+			case MASK_HOST:
+			{
+				GLine* gline = dynamic_cast<GLine*>(line);
+				if (gline)
+					return &gline->hostmask;
+				KLine* kline = dynamic_cast<KLine*>(line);
+				if (kline)
+					return &kline->hostmask;
+				ELine* eline = dynamic_cast<ELine*>(line);
+				if (eline)
+					return &eline->hostmask;
+				break;
+			}
+			case MASK_IP:
+			{
+				ZLine* zline = dynamic_cast<ZLine*>(line);
+				if (zline)
+					return &zline->ipaddr;
+				break;
+			}
+			case MASK_NICK:
+			{
+				QLine* qline = dynamic_cast<QLine*>(line);
+				if (qline)
+					return &qline->nick;
+				break;
+			}
+		}
+		return NULL;
+	}
+
+	static void UpdateList(LineList& list, XLine* line, bool add)
+	{
+		if (add)
+			list.push_back(line);
+		else
+			list.erase(std::remove(list.begin(), list.end(), line), list.end());
+	}
+
+	static void UpdateMap(LineMap& map, const std::string& key, XLine* line, bool add)
+	{
+		LineList& list = map[key];
+		UpdateList(list, line, add);
+		if (list.empty())
+			map.erase(key);
+	}
+
+	static void UpdateAffix(AffixMap& affixes, const std::string& key, XLine* line, bool add)
+	{
+		AffixMap::iterator it = affixes.insert(std::make_pair(key.length(), LineMap())).first;
+		UpdateMap(it->second, key, line, add);
+		if (it->second.empty())
+			affixes.erase(it);
+	}
+
+	static void UpdateTrie(Trie& trie, const irc::sockets::cidr_mask& cidr, XLine* line, bool add)
+	{
+		if (!add)
+		{
+			RemoveFromTrie(trie, cidr, line);
+			return;
+		}
+
+		if (trie.empty())
+			trie.Allocate();
+
+		unsigned int node = 0;
+		for (unsigned int depth = 0; ; depth++)
+		{
+			trie[node].total++;
+			if (depth == cidr.length)
+				break;
+
+			unsigned int bit = (cidr.bits[depth / 8] >> (7 - (depth % 8))) & 1;
+			if (!trie[node].child[bit])
+			{
+				// Allocate() may move the nodes
+				unsigned int child = trie.Allocate();
+				trie[node].child[bit] = child;
+			}
+			node = trie[node].child[bit];
+		}
+		UpdateList(trie[node].lines, line, true);
+	}
+
+	static void RemoveFromTrie(Trie& trie, const irc::sockets::cidr_mask& cidr, XLine* line)
+	{
+		if (trie.empty())
+			return;
+
+		// The root and one node for every bit of the longest range
+		unsigned int path[sizeof(cidr.bits) * 8 + 1];
+		unsigned int depth = 0;
+		path[0] = 0;
+		for (; depth < cidr.length; depth++)
+		{
+			unsigned int bit = (cidr.bits[depth / 8] >> (7 - (depth % 8))) & 1;
+			path[depth + 1] = trie[path[depth]].child[bit];
+			if (!path[depth + 1])
+				return;
+		}
+
+		for (unsigned int i = 0; i <= depth; i++)
+			trie[path[i]].total--;
+		UpdateList(trie[path[depth]].lines, line, false);
+
+		// The nodes left without lines are at the end of the path, free them bottom up
+		for (; (depth > 0) && (!trie[path[depth]].total); depth--)
+		{
+			unsigned int bit = (cidr.bits[(depth - 1) / 8] >> (7 - ((depth - 1) % 8))) & 1;
+			trie[path[depth - 1]].child[bit] = 0;
+			trie.Free(path[depth]);
+		}
+	}
+
+	static void SearchTrie(const Trie& trie, const irc::sockets::cidr_mask& addr, LineList& out)
+	{
+		if (trie.empty())
+			return;
+
+		unsigned int node = 0;
+		for (unsigned int depth = 0; ; depth++)
+		{
+			const TrieNode& curr = trie[node];
+			out.insert(out.end(), curr.lines.begin(), curr.lines.end());
+			if (depth == addr.length)
+				break;
+
+			unsigned int bit = (addr.bits[depth / 8] >> (7 - (depth % 8))) & 1;
+			node = curr.child[bit];
+			if (!node)
+				break;
+		}
+	}
+
+	/** Add or remove a line
+	 */
+	void Update(XLine* line, bool add)
+	{
+		const std::string* maskptr = GetMask(line);
+		if (!maskptr)
+		{
+			UpdateResidual(line, add);
+			return;
+		}
+
+		const std::string& mask = *maskptr;
+		const std::string::size_type wild = mask.find_first_of("*?");
+		if (masktype != MASK_NICK)
+		{
+			// MatchCIDR() treats an '@' as the start of the host part and a '/' as the start of the
+			// CIDR length; only index the masks that it matches like a plain IP or hostname
+			if (mask.find('@') != std::string::npos)
+			{
+				UpdateResidual(line, add);
+				return;
+			}
+
+			if (mask.find('/') != std::string::npos)
+			{
+				irc::sockets::cidr_mask cidr(mask);
+				if ((wild != std::string::npos) || ((cidr.type != AF_INET) && (cidr.type != AF_INET6)))
+				{
+					UpdateResidual(line, add);
+					return;
+				}
+
+				// Match() also compares the mask as text
+				UpdateTrie((cidr.type == AF_INET ? trie4 : trie6), cidr, line, add);
+				UpdateMap(exact, Fold(mask), line, add);
+				return;
+			}
+		}
+
+		if (wild == std::string::npos)
+		{
+			UpdateMap(exact, Fold(mask), line, add);
+
+			irc::sockets::sockaddrs sa;
+			if ((masktype != MASK_NICK) && (irc::sockets::aptosa(mask, 0, sa)))
+			{
+				const std::string key = AddressKey(irc::sockets::cidr_mask(sa, 128));
+				if (add)
+					addresses.insert(key);
+				else
+					addresses.erase(addresses.find(key));
+			}
+		}
+		else if ((wild == 0) && (mask.length() > 1) && (mask.find_first_of("*?", 1) == std::string::npos))
+			UpdateAffix(suffixes, Fold(mask.substr(1)), line, add);
+		else if ((wild != 0) && (wild == mask.length() - 1))
+			UpdateAffix(prefixes, Fold(mask.substr(0, wild)), line, add);
+		else
+			UpdateResidual(line, add);
+	}
+
+	/** Fold the keys again if the case map has been changed or rewritten since they were added
+	 */
+	void CheckCaseMap()
+	{
+		if ((*currentmap == casemap) && (casemapversion == national_case_insensitive_map_version))
+			return;
+
+		exact.clear();
+		prefixes.clear();
+		suffixes.clear();
+		trie4.clear();
+		trie6.clear();
+		residual.clear();
+		addresses.clear();
+		casemap = *currentmap;
+		casemapversion = national_case_insensitive_map_version;
+		for (dense_ptr_map<XLine, XLine>::const_iterator i = lines.begin(); i != lines.end(); ++i)
+			Update(i->first, true);
+	}
+
+	/** Remove duplicates from the found lines and add the residual lines to them
+	 */
+	void AddResidual(LineList& out) const
+	{
+		// A line can be found through both the host and the IP, and CIDR lines
+		// through both their text and their range
+		if (out.size() > 1)
+		{
+			std::sort(out.begin(), out.end());
+			out.erase(std::unique(out.begin(), out.end()), out.end());
+		}
+
+		for (dense_ptr_map<XLine, XLine>::const_iterator i = residual.begin(); i != residual.end(); ++i)
+			out.push_back(i->first);
+	}
+
+	void UpdateResidual(XLine* line, bool add)
+	{
+		if (add)
+			residual.insert(line, line);
+		else
+			residual.erase(residual.find(line));
+	}
+
+	/** Find the lines whose mask may match a string
+	 * @param str The string to look up
+	 * @param out The vector to add the lines to
+	 */
+	void Search(const std::string& str, LineList& out) const
+	{
+		const std::string folded = Fold(str);
+		LineMap::const_iterator it = exact.find(folded);
+		if (it != exact.end())
+			out.insert(out.end(), it->second.begin(), it->second.end());
+
+		for (AffixMap::const_iterator i = prefixes.begin(); i != prefixes.end(); ++i)
+		{
+			if (i->first > folded.length())
+				break;
+			it = i->second.find(folded.substr(0, i->first));
+			if (it != i->second.end())
+				out.insert(out.end(), it->second.begin(), it->second.end());
+		}
+
+		for (AffixMap::const_iterator i = suffixes.begin(); i != suffixes.end(); ++i)
+		{
+			if (i->first > folded.length())
+				break;
+			it = i->second.find(folded.substr(folded.length() - i->first));
+			if (it != i->second.end())
+				out.insert(out.end(), it->second.begin(), it->second.end());
+		}
+
+		if ((masktype != MASK_NICK) && ((!trie4.empty()) || (!trie6.empty())))
+		{
+			// Parse the string the same way MatchCIDR() does
+			irc::sockets::sockaddrs sa;
+			if (irc::sockets::aptosa(str, 0, sa))
+			{
+				irc::sockets::cidr_mask addr(sa, 128);
+				SearchTrie((addr.type == AF_INET ? trie4 : trie6), addr, out);
+			}
+		}
+	}
+
+ public:
+	Index(MaskType type, unsigned const char* const* map)
+		: masktype(type), currentmap(map), casemap(*map), casemapversion(national_case_insensitive_map_version)
+	{
+	}
+
+	/** Create an empty index for lines of the same type
+	 */
+	Index* CreateEmpty() const
+	{
+		return new Index(masktype, currentmap);
+	}
+
+	void Add(XLine* line)
+	{
+		CheckCaseMap();
+		lines.insert(line, line);
+		Update(line, true);
+	}
+
+	void Remove(XLine* line)
+	{
+		lines.erase(lines.find(line));
+		Update(line, false);
+	}
+
+	/** Get the lines which may match a user
+	 * @param user The user to look up
+	 * @param out The vector to put the candidates in, without duplicates
+	 */
+	void GetCandidates(User* user, LineList& out)
+	{
+		CheckCaseMap();
+		switch (masktype)
+		{
+			case MASK_HOST:
+				Search(user->host, out);
+				if (user->host != user->GetIPString())
+					Search(user->GetIPString(), out);
+				break;
+			case MASK_IP:
+				Search(user->GetIPString(), out);
+				break;
+			case MASK_NICK:
+				Search(user->nick, out);
+				break;
+		}
+		AddResidual(out);
+	}
+
+	/** Get the lines which may match a pattern given to XLineManager::MatchesLine()
+	 * @param pattern The pattern to look up
+	 * @param out The vector to put the candidates in, without duplicates
+	 * @return False if lines of this type can't be looked up by a pattern this way
+	 */
+	bool GetCandidates(const std::string& pattern, LineList& out)
+	{
+		// XLine::Matches() compares G, K and E-lines with "ident@host" and treats an '@'
+		// in a Z-line pattern specially; the index does not cover those
+		if ((masktype == MASK_HOST) || ((masktype == MASK_IP) && (pattern.find('@') != std::string::npos)))
+			return false;
+
+		CheckCaseMap();
+		Search(pattern, out);
+		AddResidual(out);
+		return true;
+	}
+
+	/** Get the number of nodes allocated by the CIDR tries, including the ones waiting for reuse
+	 */
+	std::size_t GetTrieSize() const
+	{
+		return trie4.nodes.size() + trie6.nodes.size();
+	}
+
+	/** Get the range of IP addresses the mask of a line matches
+	 * @param line The line
+	 * @param range Set to the range if the mask is an IP address or a CIDR range
+	 * @return True if the mask is an IP address or a CIDR range
+	 */
+	bool GetRange(XLine* line, irc::sockets::cidr_mask& range) const
+	{
+		const std::string* mask = GetMask(line);
+		if ((!mask) || (masktype == MASK_NICK) || (mask->find_first_of("*?@") != std::string::npos))
+			return false;
+
+		if (mask->find('/') != std::string::npos)
+		{
+			range = irc::sockets::cidr_mask(*mask);
+		}
+		else
+		{
+			irc::sockets::sockaddrs sa;
+			if (!irc::sockets::aptosa(*mask, 0, sa))
+				return false;
+			range = irc::sockets::cidr_mask(sa, 128);
+		}
+		return ((range.type == AF_INET) || (range.type == AF_INET6));
+	}
+
+	/** Check if a line may match an IP address in a range
+	 * @param range The range of addresses
+	 * @return False if no line in the index can match an address in the range
+	 */
+	bool MayMatchWithin(const irc::sockets::cidr_mask& range)
+	{
+		CheckCaseMap();
+		if ((!residual.empty()) || (!prefixes.empty()) || (!suffixes.empty()))
+			return true;
+
+		std::multiset<std::string>::const_iterator it = addresses.lower_bound(AddressKey(range));
+		if ((it != addresses.end()) && (KeyInRange(*it, range)))
+			return true;
+
+		const Trie& trie = (range.type == AF_INET ? trie4 : trie6);
+		if (trie.empty())
+			return false;
+
+		// Lines on the path to the range contain it, lines below it are in it
+		unsigned int node = 0;
+		for (unsigned int depth = 0; depth < range.length; depth++)
+		{
+			if (!trie[node].lines.empty())
+				return true;
+
+			unsigned int bit = (range.bits[depth / 8] >> (7 - (depth % 8))) & 1;
+			node = trie[node].child[bit];
+			if (!node)
+				return false;
+		}
+		return (trie[node].total != 0);
+	}
+};
+
 bool XLine::Matches(User *u)
 {
 	return false;
@@ -151,28 +721,16 @@ void XLineManager::CheckELines()
 	if (n == lookup_lines.end())
 		return;
 
-	XLineLookup& ELines = n->second;
-
-	if (ELines.empty())
+	if (n->second.empty())
 		return;
 
 	for (LocalUserList::const_iterator u2 = ServerInstance->Users->local_users.begin(); u2 != ServerInstance->Users->local_users.end(); u2++)
 	{
 		LocalUser* u = *u2;
 
-		/* This uses safe iteration to ensure that if a line expires here, it doenst trash the iterator */
-		LookupIter safei;
-
-		for (LookupIter i = ELines.begin(); i != ELines.end(); )
-		{
-			safei = i;
-			safei++;
-
-			XLine *e = i->second;
-			u->exempt = e->Matches(u);
-
-			i = safei;
-		}
+		// XLine::Matches() never matches exempt users, clear the flag before checking
+		u->exempt = false;
+		u->exempt = (MatchesLine("E", u) != NULL);
 	}
 }
 
@@ -276,12 +834,26 @@ bool XLineManager::AddLine(XLine* line, User* user)
 	if (!xlf)
 		return false;
 
-	ServerInstance->BanCache->RemoveEntries(line->type, false); // XXX perhaps remove ELines here?
+	// Negative ban cache entries only skip the Z-line check, the ones a new Z-line
+	// may apply to are removed together at the end of this main loop iteration
+	if (line->type == "Z")
+	{
+		Index* zindex = GetIndex("Z");
+		irc::sockets::cidr_mask range;
+		if ((zindex) && (zindex->GetRange(line, range)))
+			bancachestale.push_back(range);
+		else
+			bancacheflush = true;
+	}
+	ScheduleDeferred();
 
 	if (xlf->AutoApplyToUserList(line))
 		pending_lines.push_back(line);
 
 	lookup_lines[line->type][line->Displayable().c_str()] = line;
+	Index* index = GetIndex(line->type);
+	if (index)
+		index->Add(line);
 	line->OnAdd();
 
 	FOREACH_MOD(OnAddLine, (user, line));
@@ -306,10 +878,20 @@ bool XLineManager::DelLine(const char* hostmask, const std::string &type, User*
 	if (simulate)
 		return true;
 
-	ServerInstance->BanCache->RemoveEntries(y->second->type, true);
+	// Positive entries for Z-lines are for addresses the line matched, other lines may have matched a hostname
+	Index* index = GetIndex(type);
+	irc::sockets::cidr_mask range;
+	if ((type == "Z") && (index) && (index->GetRange(y->second, range)))
+		ServerInstance->BanCache->RemoveEntries(type, true, &range);
+	else
+		ServerInstance->BanCache->RemoveEntries(type, true);
 
 	FOREACH_MOD(OnDelLine, (user, y->second));
 
+	// Unset() of E-lines checks users against the remaining lines
+	if (index)
+		index->Remove(y->second);
+
 	y->second->Unset();
 
 	std::vector<XLine*>::iterator pptr = std::find(pending_lines.begin(), pending_lines.end(), y->second);
@@ -344,6 +926,14 @@ XLine* XLineManager::MatchesLine(const std::string &type, User* user)
 	if (x == lookup_lines.end())
 		return NULL;
 
+	Index* index = GetIndex(type);
+	if (index)
+	{
+		std::vector<XLine*> candidates;
+		index->GetCandidates(user, candidates);
+		return MatchCandidates(x, candidates, user, "");
+	}
+
 	const time_t current = ServerInstance->Time();
 
 	LookupIter safei;
@@ -378,6 +968,11 @@ XLine* XLineManager::MatchesLine(const std::string &type, const std::string &pat
 	if (x == lookup_lines.end())
 		return NULL;
 
+	Index* index = GetIndex(type);
+	std::vector<XLine*> candidates;
+	if ((index) && (index->GetCandidates(pattern, candidates)))
+		return MatchCandidates(x, candidates, NULL, pattern);
+
 	const time_t current = ServerInstance->Time();
 
 	 LookupIter safei;
@@ -406,12 +1001,64 @@ XLine* XLineManager::MatchesLine(const std::string &type, const std::string &pat
 	return NULL;
 }
 
+XLine* XLineManager::MatchCandidates(ContainerIter container, const std::vector<XLine*>& candidates, User* user, const std::string& pattern)
+{
+	const time_t current = ServerInstance->Time();
+	for (std::vector<XLine*>::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
+	{
+		XLine* line = *i;
+		if (user ? !line->Matches(user) : !line->Matches(pattern))
+			continue;
+
+		if (line->duration && current > line->expiry)
+		{
+			/* Expire the line, proceed to the next candidate */
+			ExpireLine(container, container->second.find(line->Displayable().c_str()));
+			continue;
+		}
+
+		return line;
+	}
+	return NULL;
+}
+
+XLineManager::Index* XLineManager::GetIndex(const std::string& type)
+{
+	std::map<std::string, Index*>::const_iterator it = indexes.find(type);
+	if (it == indexes.end())
+		return NULL;
+	return it->second;
+}
+
+std::size_t XLineManager::GetTrieSize(const std::string& type)
+{
+	Index* index = GetIndex(type);
+	return (index ? index->GetTrieSize() : 0);
+}
+
+bool XLineManager::HasLinesWithin(const std::string& type, const irc::sockets::cidr_mask& range)
+{
+	ContainerIter x = lookup_lines.find(type);
+	if ((x == lookup_lines.end()) || (x->second.empty()))
+		return false;
+
+	// Lines that are not indexed may match anything
+	Index* index = GetIndex(type);
+	return ((!index) || (index->MayMatchWithin(range)));
+}
+
 // removes lines that have expired
 void XLineManager::ExpireLine(ContainerIter container, LookupIter item)
 {
 	FOREACH_MOD(OnExpireLine, (item->second));
 
 	item->second->DisplayExpiry();
+
+	// Unset() of E-lines checks users against the remaining lines
+	Index* index = GetIndex(container->first);
+	if (index)
+		index->Remove(item->second);
+
 	item->second->Unset();
 
 	/* TODO: Can we skip this loop by having a 'pending' field in the XLine class, which is set when a line
@@ -427,9 +1074,97 @@ void XLineManager::ExpireLine(ContainerIter container, LookupIter item)
 }
 
 
-// applies lines, removing clients and changing nicks etc as applicable
 void XLineManager::ApplyLines()
 {
+	applyrequested = true;
+	ScheduleDeferred();
+}
+
+void XLineManager::ScheduleDeferred()
+{
+	if (deferredscheduled)
+		return;
+
+	deferredscheduled = true;
+	ServerInstance->AtomicActions.AddAction(&deferredaction);
+}
+
+void XLineManager::DeferredAction::Call()
+{
+	manager->RunDeferred();
+}
+
+namespace
+{
+	/** Pending lines of one type
+	 */
+	struct PendingBatch
+	{
+		std::string type;
+		std::vector<XLine*> lines;
+
+		/** Index of the lines if there are enough of them to be worth it, or NULL
+		 */
+		XLineManager::Index* index;
+
+		PendingBatch(const std::string& linetype) : type(linetype), index(NULL) { }
+	};
+}
+
+// applies lines, removing clients and changing nicks etc as applicable
+void XLineManager::RunDeferred()
+{
+	deferredscheduled = false;
+
+	if (bancacheflush)
+	{
+		ServerInstance->BanCache->RemoveEntries("", false);
+	}
+	else
+	{
+		for (std::vector<irc::sockets::cidr_mask>::const_iterator i = bancachestale.begin(); i != bancachestale.end(); ++i)
+			ServerInstance->BanCache->RemoveEntries("", false, &*i);
+	}
+	bancachestale.clear();
+	bancacheflush = false;
+
+	if ((!applyrequested) || (pending_lines.empty()))
+		return;
+	applyrequested = false;
+
+	// Applying a line may add new pending lines, those are applied in the next pass
+	std::vector<XLine*> lines;
+	lines.swap(pending_lines);
+
+	// Group the lines by type, keeping the order in which the types were first added
+	std::vector<PendingBatch> batches;
+	for (std::vector<XLine*>::const_iterator i = lines.begin(); i != lines.end(); ++i)
+	{
+		XLine* x = *i;
+		std::vector<PendingBatch>::iterator batch = batches.begin();
+		while ((batch != batches.end()) && (batch->type != x->type))
+			++batch;
+		if (batch == batches.end())
+			batch = batches.insert(batches.end(), PendingBatch(x->type));
+		batch->lines.push_back(x);
+	}
+
+	// Checking a handful of lines directly is cheaper than looking them up in an index
+	const size_t indexthreshold = 8;
+	for (std::vector<PendingBatch>::iterator batch = batches.begin(); batch != batches.end(); ++batch)
+	{
+		Index* index = GetIndex(batch->type);
+		if ((!index) || (batch->lines.size() <= indexthreshold))
+			continue;
+
+		batch->index = index->CreateEmpty();
+		for (std::vector<XLine*>::const_iterator i = batch->lines.begin(); i != batch->lines.end(); ++i)
+			batch->index->Add(*i);
+	}
+
+	unsigned long scanned = 0;
+	unsigned long applied = 0;
+	std::vector<XLine*> candidates;
 	LocalUserList& list = ServerInstance->Users->local_users;
 	for (LocalUserList::iterator j = list.begin(); j != list.end(); ++j)
 	{
@@ -439,15 +1174,43 @@ void XLineManager::ApplyLines()
 		if (u->exempt)
 			continue;
 
-		for (std::vector<XLine *>::iterator i = pending_lines.begin(); i != pending_lines.end(); i++)
+		scanned++;
+		for (std::vector<PendingBatch>::iterator batch = batches.begin(); batch != batches.end(); ++batch)
 		{
-			XLine *x = *i;
-			if (x->Matches(u))
-				x->Apply(u);
+			// Nothing else to do if a line has already disconnected the user
+			if (u->quitting)
+				break;
+
+			const std::vector<XLine*>* checklines = &batch->lines;
+			if (batch->index)
+			{
+				candidates.clear();
+				batch->index->GetCandidates(u, candidates);
+				checklines = &candidates;
+			}
+
+			for (std::vector<XLine*>::const_iterator i = checklines->begin(); i != checklines->end(); ++i)
+			{
+				XLine* x = *i;
+				if (x->Matches(u))
+				{
+					x->Apply(u);
+					applied++;
+					break;
+				}
+			}
 		}
 	}
 
-	pending_lines.clear();
+	for (std::vector<PendingBatch>::iterator batch = batches.begin(); batch != batches.end(); ++batch)
+		delete batch->index;
+
+	applystats.passes++;
+	applystats.lines += applied;
+	applystats.users += scanned;
+	applystats.lastusers = scanned;
+	ServerInstance->Logs->Log("XLINE", LOG_DEBUG, "Applied %lu of %lu pending lines, checked %lu users",
+		applied, (unsigned long)lines.size(), scanned);
 }
 
 void XLineManager::InvokeStats(const std::string &type, int numeric, User* user, string_list &results)
@@ -480,6 +1243,7 @@ void XLineManager::InvokeStats(const std::string &type, int numeric, User* user,
 
 
 XLineManager::XLineManager()
+	: deferredaction(this), deferredscheduled(false), applyrequested(false), bancacheflush(false)
 {
 	GLineFactory* GFact;
 	ELineFactory* EFact;
@@ -499,6 +1263,13 @@ XLineManager::XLineManager()
 	RegisterFactory(KFact);
 	RegisterFactory(QFact);
 	RegisterFactory(ZFact);
+
+	static unsigned const char* const asciimap = ascii_case_insensitive_map;
+	indexes["G"] = new Index(Index::MASK_HOST, &asciimap);
+	indexes["E"] = new Index(Index::MASK_HOST, &asciimap);
+	indexes["K"] = new Index(Index::MASK_HOST, &asciimap);
+	indexes["Q"] = new Index(Index::MASK_NICK, &national_case_insensitive_map);
+	indexes["Z"] = new Index(Index::MASK_IP, &national_case_insensitive_map);
 }
 
 XLineManager::~XLineManager()
@@ -518,6 +1289,9 @@ XLineManager::~XLineManager()
 			delete j->second;
 		}
 	}
+
+	for (std::map<std::string, Index*>::const_iterator i = indexes.begin(); i != indexes.end(); ++i)
+		delete i->second;
 }
 
 void XLine::Apply(User* u)
@@ -545,7 +1319,7 @@ void XLine::DefaultApply(User* u, const std::string &line, bool bancache)
 	if (bancache)
 	{
 		ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCache: Adding positive hit (" + line + ") for " + u->GetIPString());
-		ServerInstance->BanCache->AddHit(u->GetIPString(), this->type, banReason, this->duration);
+		ServerInstance->BanCache->AddHit(u->client_sa, this->type, banReason, this->duration);
 	}
 }
 
@@ -555,10 +1329,9 @@ bool KLine::Matches(User *u)
 	if (lu && lu->exempt)
 		return false;
 
-	if (InspIRCd::Match(u->ident, this->identmask, ascii_case_insensitive_map))
+	if (identpattern.Match(u->ident))
 	{
-		if (InspIRCd::MatchCIDR(u->host, this->hostmask, ascii_case_insensitive_map) ||
-		    InspIRCd::MatchCIDR(u->GetIPString(), this->hostmask, ascii_case_insensitive_map))
+		if (hostpattern.MatchCIDR(u->host) || hostpattern.MatchCIDR(u->GetIPString()))
 		{
 			return true;
 		}
@@ -578,10 +1351,9 @@ bool GLine::Matches(User *u)
 	if (lu && lu->exempt)
 		return false;
 
-	if (InspIRCd::Match(u->ident, this->identmask, ascii_case_insensitive_map))
+	if (identpattern.Match(u->ident))
 	{
-		if (InspIRCd::MatchCIDR(u->host, this->hostmask, ascii_case_insensitive_map) ||
-		    InspIRCd::MatchCIDR(u->GetIPString(), this->hostmask, ascii_case_insensitive_map))
+		if (hostpattern.MatchCIDR(u->host) || hostpattern.MatchCIDR(u->GetIPString()))
 		{
 			return true;
 		}
@@ -601,10 +1373,9 @@ bool ELine::Matches(User *u)
 	if (lu && lu->exempt)
 		return false;
 
-	if (InspIRCd::Match(u->ident, this->identmask, ascii_case_insensitive_map))
+	if (identpattern.Match(u->ident))
 	{
-		if (InspIRCd::MatchCIDR(u->host, this->hostmask, ascii_case_insensitive_map) ||
-		    InspIRCd::MatchCIDR(u->GetIPString(), this->hostmask, ascii_case_insensitive_map))
+		if (hostpattern.MatchCIDR(u->host) || hostpattern.MatchCIDR(u->GetIPString()))
 		{
 			return true;
 		}
@@ -619,7 +1390,7 @@ bool ZLine::Matches(User *u)
 	if (lu && lu->exempt)
 		return false;
 
-	if (InspIRCd::MatchCIDR(u->GetIPString(), this->ipaddr))
+	if (ippattern.MatchCIDR(u->GetIPString()))
 		return true;
 	else
 		return false;
@@ -633,7 +1404,7 @@ void ZLine::Apply(User* u)
 
 bool QLine::Matches(User *u)
 {
-	if (InspIRCd::Match(u->nick, this->nick))
+	if (nickpattern.Match(u->nick))
 		return true;
 
 	return false;
@@ -648,7 +1419,7 @@ void QLine::Apply(User* u)
 
 bool ZLine::Matches(const std::string &str)
 {
-	if (InspIRCd::MatchCIDR(str, this->ipaddr))
+	if (ippattern.MatchCIDR(str))
 		return true;
 	else
 		return false;
@@ -656,7 +1427,7 @@ bool ZLine::Matches(const std::string &str)
 
 bool QLine::Matches(const std::string &str)
 {
-	if (InspIRCd::Match(str, this->nick))
+	if (nickpattern.Match(str))
 		return true;
 
 	return false;